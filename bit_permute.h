@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+namespace flashcart_core {
+
+namespace detail {
+template<std::size_t... I> struct Indices {};
+template<std::size_t N, std::size_t... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+template<std::size_t... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+/// `values[v]` is `Fn::compute(v)`, worked out by the compiler.
+template<typename Fn, typename = typename MakeIndices<256>::type> struct ByteTable;
+template<typename Fn, std::size_t... I> struct ByteTable<Fn, Indices<I...>> {
+    static constexpr std::uint8_t values[256] = { Fn::compute(static_cast<std::uint8_t>(I))... };
+};
+template<typename Fn, std::size_t... I> constexpr std::uint8_t ByteTable<Fn, Indices<I...>>::values[256];
+}
+
+/// The byte scrambling some carts do between the card bus and the flash: XOR with
+/// `XorIn`, move bit n to bit `Bn`, XOR with `XorOut`.
+template<unsigned B0, unsigned B1, unsigned B2, unsigned B3, unsigned B4, unsigned B5, unsigned B6, unsigned B7,
+         std::uint8_t XorIn = 0, std::uint8_t XorOut = 0>
+struct BitPermutation {
+    static constexpr std::uint8_t compute(std::uint8_t v) {
+        return static_cast<std::uint8_t>(move(v ^ XorIn) ^ XorOut);
+    }
+
+    static std::uint8_t apply(std::uint8_t v) {
+        return detail::ByteTable<BitPermutation>::values[v];
+    }
+
+    /// `dst[i] = apply(src[i])`; `dst` may be `src`.
+    static void apply(std::uint8_t *dst, const std::uint8_t *src, std::size_t length) {
+        const std::uint8_t *const table = detail::ByteTable<BitPermutation>::values;
+        std::size_t i = 0;
+#if defined(__SSSE3__)
+        // apart from the XORs this is linear, so both nibbles can be looked up on their
+        // own (16-entry tables fit a shuffle) and the results XORed together
+        alignas(16) std::uint8_t loTable[16], hiTable[16];
+        for (unsigned int n = 0; n < 16; ++n) {
+            loTable[n] = table[n];
+            hiTable[n] = table[n << 4] ^ table[0];
+        }
+        const __m128i lo = _mm_load_si128(reinterpret_cast<const __m128i *>(loTable));
+        const __m128i hi = _mm_load_si128(reinterpret_cast<const __m128i *>(hiTable));
+        const __m128i mask = _mm_set1_epi8(0x0F);
+        for (; i + 16 <= length; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+            const __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(v, mask));
+            const __m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_xor_si128(l, h));
+        }
+#endif
+        for (; i < length; ++i) {
+            dst[i] = table[src[i]];
+        }
+    }
+
+private:
+    static constexpr unsigned move(unsigned v) {
+        return (v & 1) << B0 | (v >> 1 & 1) << B1 | (v >> 2 & 1) << B2 | (v >> 3 & 1) << B3
+            | (v >> 4 & 1) << B4 | (v >> 5 & 1) << B5 | (v >> 6 & 1) << B6 | (v >> 7 & 1) << B7;
+    }
+};
+}
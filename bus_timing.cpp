@@ -0,0 +1,140 @@
+#include <cstring>
+#include <algorithm>
+
+#include "bus_timing.h"
+#include "card.h"
+
+namespace flashcart_core {
+using platform::logMessage;
+
+namespace {
+constexpr std::uint32_t latency1Mask = 0x1FFF;
+constexpr std::uint32_t latency2Shift = 16;
+constexpr std::uint32_t latency2Mask = 0x3F << latency2Shift;
+constexpr std::uint32_t slowClockBit = 1u << 27;
+
+constexpr unsigned int stockReads = 3;
+constexpr unsigned int candidateReads = 8;
+
+bool probeRead(Card &card, const BusTimingProbe &probe, std::uint32_t flags, std::uint8_t *buf) {
+    return !card.sendCommand(probe.cmd, buf, probe.size, flags);
+}
+
+bool readsBack(Card &card, const BusTimingProbe &probe, std::uint32_t flags, const std::uint8_t *ref, unsigned int reads) {
+    std::uint8_t buf[BusTimingProbe::maxSize];
+    for (unsigned int i = 0; i < reads; ++i) {
+        if (!probeRead(card, probe, flags, buf) || std::memcmp(buf, ref, probe.size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Reads the reference data at stock timing; fails if that isn't stable or is useless.
+bool readReference(Card &card, const BusTimingProbe &probe, std::uint8_t *ref) {
+    if (!probe.size || probe.size > BusTimingProbe::maxSize) {
+        return false;
+    }
+
+    if (!probeRead(card, probe, probe.flags, ref) || !readsBack(card, probe, probe.flags, ref, stockReads - 1)) {
+        logMessage(LOG_WARN, "BusTiming: probe read isn't stable at stock timing");
+        return false;
+    }
+
+    // reads that are too fast tend to come back all 00 or all FF, which would look stable
+    if (std::all_of(ref, ref + probe.size, [ref](std::uint8_t b) { return b == ref[0]; })) {
+        logMessage(LOG_WARN, "BusTiming: probe read returns %02X only, can't tune with it", ref[0]);
+        return false;
+    }
+
+    return true;
+}
+
+/// Leaves a little room above the fastest setting that worked.
+std::uint32_t withMargin(std::uint32_t found, std::uint32_t stock) {
+    return std::min(stock, found + found / 8 + 1);
+}
+}
+
+BusTiming BusTiming::fromFlags(std::uint32_t flags) {
+    BusTiming timing;
+    timing.latency1 = static_cast<std::uint16_t>(flags & latency1Mask);
+    timing.latency2 = static_cast<std::uint8_t>((flags & latency2Mask) >> latency2Shift);
+    timing.slow_clock = flags & slowClockBit;
+    return timing;
+}
+
+std::uint32_t BusTiming::apply(std::uint32_t flags) const {
+    const BusTiming stock = fromFlags(flags);
+    flags &= ~(latency1Mask | latency2Mask | slowClockBit);
+    flags |= std::min(stock.latency1, latency1);
+    flags |= static_cast<std::uint32_t>(std::min(stock.latency2, latency2)) << latency2Shift;
+    if (stock.slow_clock && slow_clock) {
+        flags |= slowClockBit;
+    }
+    return flags;
+}
+
+bool findBusTiming(Card &card, const BusTimingProbe &probe, BusTiming *timing) {
+    CardPhaseScope phase(card, CardPhase::Read);
+    std::uint8_t ref[BusTimingProbe::maxSize];
+    if (!readReference(card, probe, ref)) {
+        return false;
+    }
+
+    const BusTiming stock = BusTiming::fromFlags(probe.flags);
+    BusTiming best = stock;
+
+    // one setting at a time, keeping whatever worked; the clock first, since it's the biggest win
+    if (best.slow_clock) {
+        BusTiming t = best;
+        t.slow_clock = false;
+        if (readsBack(card, probe, t.apply(probe.flags), ref, candidateReads)) {
+            best = t;
+        }
+    }
+
+    std::uint32_t lo = 0, hi = best.latency1;
+    while (lo < hi) {
+        BusTiming t = best;
+        t.latency1 = static_cast<std::uint16_t>((lo + hi) / 2);
+        if (readsBack(card, probe, t.apply(probe.flags), ref, candidateReads)) {
+            hi = t.latency1;
+        } else {
+            lo = t.latency1 + 1;
+        }
+    }
+    best.latency1 = static_cast<std::uint16_t>(hi < stock.latency1 ? withMargin(hi, stock.latency1) : stock.latency1);
+
+    lo = 0;
+    hi = best.latency2;
+    while (lo < hi) {
+        BusTiming t = best;
+        t.latency2 = static_cast<std::uint8_t>((lo + hi) / 2);
+        if (readsBack(card, probe, t.apply(probe.flags), ref, candidateReads)) {
+            hi = t.latency2;
+        } else {
+            lo = t.latency2 + 1;
+        }
+    }
+    best.latency2 = static_cast<std::uint8_t>(hi < stock.latency2 ? withMargin(hi, stock.latency2) : stock.latency2);
+
+    // the margins changed the settings, so check the result as a whole
+    if (!readsBack(card, probe, best.apply(probe.flags), ref, candidateReads)) {
+        logMessage(LOG_WARN, "BusTiming: tuned timing isn't stable, keeping stock");
+        return false;
+    }
+
+    logMessage(LOG_INFO, "BusTiming: latency1 %u -> %u, latency2 %u -> %u, %s clock",
+        stock.latency1, best.latency1, stock.latency2, best.latency2, best.slow_clock ? "slow" : "fast");
+    *timing = best;
+    return true;
+}
+
+bool checkBusTiming(Card &card, const BusTimingProbe &probe, const BusTiming &timing) {
+    CardPhaseScope phase(card, CardPhase::Read);
+    std::uint8_t ref[BusTimingProbe::maxSize];
+    return readReference(card, probe, ref)
+        && readsBack(card, probe, timing.apply(probe.flags), ref, candidateReads);
+}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+namespace flashcart_core {
+class Card;
+
+/// The timing part of a card command's ROMCNT flags.
+struct BusTiming {
+    /// Bits 0-12: gap before the first word.
+    std::uint16_t latency1;
+    /// Bits 16-21: gap between blocks.
+    std::uint8_t latency2;
+    /// Bit 27: 4.2MHz instead of 6.7MHz transfer clock.
+    bool slow_clock;
+
+    static BusTiming fromFlags(std::uint32_t flags);
+    /// Returns `flags` with timing that is at most as slow as this.
+    std::uint32_t apply(std::uint32_t flags) const;
+};
+
+/// A read that returns the same data every time and can be repeated at any timing, for tuning.
+struct BusTimingProbe {
+    static constexpr std::uint32_t maxSize = 0x200;
+
+    std::uint8_t cmd[8];
+    std::uint32_t size;
+    /// The flags the driver normally reads with.
+    std::uint32_t flags;
+};
+
+/// Searches for the fastest timing at which `probe` still reads back the same data, every
+/// time, as it does with the driver's own flags.
+bool findBusTiming(Card &card, const BusTimingProbe &probe, BusTiming *timing);
+
+/// Checks that `timing` (e.g. one found earlier) still reads back the same data as the
+/// driver's own flags.
+bool checkBusTiming(Card &card, const BusTimingProbe &probe, const BusTiming &timing);
+}
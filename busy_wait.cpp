@@ -0,0 +1,79 @@
+#include <algorithm>
+
+#include "busy_wait.h"
+#include "card.h"
+
+namespace flashcart_core {
+using platform::logMessage;
+
+namespace {
+// ncgc::delay() counts ARM9 cycles
+constexpr std::uint32_t delayPerUs = 67;
+constexpr std::uint32_t maxStep = 10000;
+}
+
+WaitTiming defaultWaitTiming(WaitOp op) {
+    switch (op) {
+        // a small NOR sector; drivers with bigger erase blocks should say so
+        case WaitOp::Erase: return WaitTiming{ 25000, 15000000 };
+        case WaitOp::Program: return WaitTiming{ 10, 20000 };
+        case WaitOp::Sd: return WaitTiming{ 100, 1000000 };
+        default: return WaitTiming{ 1, 100000 };
+    }
+}
+
+BusyWait::BusyWait(Card &card, WaitOp op)
+    : m_card(card), m_op(op), m_start(card.time()), m_estimate(0), m_step(0), m_polls(0), m_finished(false) {}
+
+std::uint64_t BusyWait::elapsed() const {
+    const std::uint64_t now = m_card.time();
+    return std::max(now > m_start ? now - m_start : 0, m_estimate);
+}
+
+bool BusyWait::poll() {
+    const WaitTiming &timing = m_card.waitTiming(m_op);
+    std::uint32_t wait;
+    if (!m_polls) {
+        // most ops take about as long every time, so don't bother polling early
+        wait = timing.expected - timing.expected / 4;
+        m_step = std::max<std::uint32_t>(timing.expected / 16, 1);
+    } else {
+        if (elapsed() > timing.max) {
+            logMessage(LOG_ERR, "BusyWait: %s timed out after %lu polls", waitOpName(m_op),
+                static_cast<unsigned long>(m_polls));
+            finish(true);
+            return false;
+        }
+
+        wait = m_step;
+        m_step = std::min<std::uint32_t>(std::min(m_step * 2, std::max<std::uint32_t>(timing.expected / 4, 1)), maxStep);
+    }
+
+    if (wait) {
+        m_card.delay(wait * delayPerUs);
+    }
+    m_estimate += wait + pollCost;
+    ++m_polls;
+    m_card.notePoll();
+    return true;
+}
+
+void BusyWait::finish(bool timedOut) {
+    if (m_finished) {
+        return;
+    }
+    m_finished = true;
+
+    const std::uint64_t time = elapsed();
+    WaitTiming &timing = m_card.waitTiming(m_op);
+    if (!timedOut) {
+        // move a quarter of the way towards what we just saw
+        const std::uint64_t expected = timing.expected - timing.expected / 4 + time / 4;
+        timing.expected = static_cast<std::uint32_t>(std::max<std::uint64_t>(std::min<std::uint64_t>(expected, timing.max / 2), 1));
+    }
+
+    if (m_card.stats()) {
+        m_card.stats()->recordWait(m_op, m_polls, time, timedOut);
+    }
+}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+
+#include "card_stats.h"
+
+namespace flashcart_core {
+class Card;
+
+/// How long a WaitOp takes on the current cart, in microseconds.
+///
+/// `expected` starts at the driver's (or the default) estimate and follows the observed
+/// completion times from then on; `max` is the deadline after which the cart is assumed hung.
+struct WaitTiming {
+    std::uint32_t expected;
+    std::uint32_t max;
+};
+
+/// Waits for the card to finish an operation, polling as little as possible.
+///
+/// Most of the expected time is waited out before the first poll, polls after that
+/// back off exponentially, and the wait gives up once the deadline has passed. Use as:
+///
+///     BusyWait wait(m_card, WaitOp::Erase);
+///     do {
+///         if (!wait.poll()) { return false; }
+///         // issue one status poll
+///     } while (busy);
+///     wait.done();
+///
+/// Time comes from platform::now(), or is estimated from the delays and polls issued
+/// if there's no clock.
+class BusyWait {
+    Card &m_card;
+    const WaitOp m_op;
+    const std::uint64_t m_start;
+    std::uint64_t m_estimate;
+    std::uint32_t m_step;
+    std::uint32_t m_polls;
+    bool m_finished;
+
+    std::uint64_t elapsed() const;
+    void finish(bool timedOut);
+
+public:
+    /// Rough cost of one status poll, in microseconds; used when there's no clock.
+    static constexpr std::uint32_t pollCost = 8;
+
+    BusyWait(Card &card, WaitOp op);
+
+    /// Waits until the next poll is due. Returns false once the deadline has passed.
+    bool poll();
+    /// The card is done; records how long it took.
+    void done() { finish(false); }
+
+    std::uint32_t polls() const { return m_polls; }
+
+    BusyWait(const BusyWait &) = delete;
+    BusyWait &operator=(const BusyWait &) = delete;
+};
+
+/// The timing a Card starts out with for `op`, before any driver tuning.
+WaitTiming defaultWaitTiming(WaitOp op);
+}
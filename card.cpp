@@ -0,0 +1,180 @@
+#include <algorithm>
+
+#include "card.h"
+
+namespace flashcart_core {
+using platform::logMessage;
+
+namespace {
+std::uint64_t commandBytes(const std::uint8_t *cmdbuf, std::uint32_t length) {
+    std::uint64_t cmd = 0;
+    for (std::uint32_t i = 0; i < std::min<std::uint32_t>(length, 8); ++i) {
+        cmd |= static_cast<std::uint64_t>(cmdbuf[i]) << (i * 8);
+    }
+    return cmd;
+}
+
+/// commandBytes() of `cmd` and `data` joined.
+std::uint64_t commandBytes(const std::uint8_t *cmd, std::uint32_t cmdLength, const std::uint8_t *data,
+                           std::uint32_t dataLength) {
+    std::uint64_t bytes = commandBytes(cmd, cmdLength);
+    for (std::uint32_t i = cmdLength; i < std::min<std::uint32_t>(cmdLength + dataLength, 8); ++i) {
+        bytes |= static_cast<std::uint64_t>(data[i - cmdLength]) << (i * 8);
+    }
+    return bytes;
+}
+
+bool statsOp(CardRecordKind kind, CardOp *op) {
+    switch (kind) {
+        case CardRecordKind::Command: *op = CardOp::Command; return true;
+        case CardRecordKind::WriteCommand: *op = CardOp::WriteCommand; return true;
+        case CardRecordKind::Spi: *op = CardOp::Spi; return true;
+        case CardRecordKind::ReadData: *op = CardOp::ReadData; return true;
+        case CardRecordKind::Init:
+        case CardRecordKind::BeginKey1:
+        case CardRecordKind::BeginKey2: *op = CardOp::Secure; return true;
+        default: return false;
+    }
+}
+}
+
+std::uint64_t Card::begin() {
+    return (m_stats || m_recorder) ? time() : 0;
+}
+
+void Card::end(CardRecordKind kind, std::uint64_t cmd, std::uint32_t romcnt, std::uint8_t flags, const CardErr &err,
+               std::uint64_t start, const void *out, std::uint32_t outLength, const void *in, std::uint32_t inLength,
+               const void *more, std::uint32_t moreLength) {
+    if (!m_stats && !m_recorder) {
+        return;
+    }
+
+    const std::uint64_t finish = begin();
+    CardOp op;
+    if (m_stats && statsOp(kind, &op)) {
+        const std::uint8_t opcode = kind == CardRecordKind::ReadData ? 0xB7 : (cmd & 0xFF);
+        m_stats->record(m_phase, op, opcode, outLength + moreLength + inLength, start, finish);
+    }
+
+    if (m_recorder) {
+        CardRecord rec;
+        rec.kind = static_cast<std::uint8_t>(kind);
+        rec.flags = flags | (err ? CardRecord::Failed : 0) | (err.unsupported() ? CardRecord::Unsupported : 0)
+            | ((inLength && !in) ? CardRecord::DataOmitted : 0);
+        rec.reserved = 0;
+        rec.err = err.errNo();
+        rec.cmd = cmd;
+        rec.romcnt = romcnt;
+        rec.duration = static_cast<std::uint32_t>(finish > start ? finish - start : 0);
+        rec.out_length = outLength + moreLength;
+        rec.in_length = inLength;
+
+        if (!m_recorder->write(&rec, sizeof(rec))
+            || (outLength && !m_recorder->write(out, outLength))
+            || (moreLength && !m_recorder->write(more, moreLength))
+            || (inLength && in && !m_recorder->write(in, inLength))) {
+            logMessage(LOG_ERR, "Card: trace write failed, recording stopped");
+            m_recorder = nullptr;
+        }
+    }
+}
+
+void Card::resetWaitTiming() {
+    for (unsigned int i = 0; i < static_cast<unsigned int>(WaitOp::Count); ++i) {
+        m_wait[i] = defaultWaitTiming(static_cast<WaitOp>(i));
+    }
+}
+
+bool Card::record(CardRecorder *recorder) {
+    m_recorder = recorder;
+    if (recorder) {
+        const std::uint32_t header[2] = { cardTraceMagic, cardTraceVersion };
+        if (!recorder->write(header, sizeof(header))) {
+            m_recorder = nullptr;
+            return false;
+        }
+    }
+    return true;
+}
+
+CardErr Card::sendCommand(std::uint64_t cmd, void *buf, std::uint32_t size, std::uint32_t flags, bool flagsAsIs) {
+    const std::uint64_t start = begin();
+    CardErr r = m_transport->sendCommand(cmd, buf, size, flags, flagsAsIs);
+    end(CardRecordKind::Command, cmd, flags, flagsAsIs ? CardRecord::FlagsAsIs : 0, r, start, nullptr, 0, buf, size);
+    return r;
+}
+
+CardErr Card::sendCommand(const std::uint8_t *cmdbuf, void *buf, std::uint32_t size, std::uint32_t flags, bool flagsAsIs) {
+    return sendCommand(commandBytes(cmdbuf, 8), buf, size, flags, flagsAsIs);
+}
+
+CardErr Card::sendWriteCommand(std::uint64_t cmd, const void *buf, std::uint32_t size, std::uint32_t flags) {
+    const std::uint64_t start = begin();
+    CardErr r = m_transport->sendWriteCommand(cmd, buf, size, flags);
+    end(CardRecordKind::WriteCommand, cmd, flags, 0, r, start, buf, size, nullptr, 0);
+    return r;
+}
+
+CardErr Card::sendSpi(const std::uint8_t *cmd, std::uint32_t cmdLength, std::uint8_t *resp, std::uint32_t respLength) {
+    const std::uint64_t start = begin();
+    CardErr r = m_transport->sendSpi(cmd, cmdLength, resp, respLength);
+    end(CardRecordKind::Spi, commandBytes(cmd, cmdLength), 0, 0, r, start, cmd, cmdLength, resp, respLength);
+    return r;
+}
+
+CardErr Card::sendSpiWrite(const std::uint8_t *cmd, std::uint32_t cmdLength, const std::uint8_t *data,
+                           std::uint32_t dataLength) {
+    const std::uint64_t start = begin();
+    CardErr r = m_transport->sendSpiWrite(cmd, cmdLength, data, dataLength);
+    end(CardRecordKind::Spi, commandBytes(cmd, cmdLength, data, dataLength), 0, 0, r, start, cmd, cmdLength,
+        nullptr, 0, data, dataLength);
+    return r;
+}
+
+CardErr Card::readData(std::uint32_t address, void *buf, std::uint32_t size) {
+    const std::uint64_t start = begin();
+    CardErr r = m_transport->readData(address, buf, size);
+    end(CardRecordKind::ReadData, address, 0, 0, r, start, nullptr, 0, buf, size);
+    return r;
+}
+
+void Card::delay(std::uint32_t delay) {
+    const std::uint64_t start = begin();
+    m_transport->delay(delay);
+    end(CardRecordKind::Delay, delay, 0, 0, CardErr(), start, nullptr, 0, nullptr, 0);
+}
+
+CardErr Card::init() {
+    const std::uint64_t start = begin();
+    CardErr r = m_transport->init();
+    end(CardRecordKind::Init, 0, 0, 0, r, start, nullptr, 0, nullptr, 0);
+    return r;
+}
+
+CardErr Card::beginKey1(const CardSecureParams &params) {
+    const std::uint64_t start = begin();
+    CardErr r = m_transport->beginKey1(params);
+    end(CardRecordKind::BeginKey1, 0, 0, 0, r, start, nullptr, 0, nullptr, 0);
+    return r;
+}
+
+CardErr Card::beginKey2() {
+    const std::uint64_t start = begin();
+    CardErr r = m_transport->beginKey2();
+    end(CardRecordKind::BeginKey2, 0, 0, 0, r, start, nullptr, 0, nullptr, 0);
+    return r;
+}
+
+CardState Card::state() {
+    const std::uint64_t start = begin();
+    CardState s = m_transport->state();
+    end(CardRecordKind::State, static_cast<std::uint64_t>(s), 0, 0, CardErr(), start, nullptr, 0, nullptr, 0);
+    return s;
+}
+
+void Card::state(CardState state) {
+    const std::uint64_t start = begin();
+    m_transport->state(state);
+    end(CardRecordKind::SetState, static_cast<std::uint64_t>(state), 0, 0, CardErr(), start, nullptr, 0, nullptr, 0);
+}
+}
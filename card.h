@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstdint>
+
+#include "platform.h"
+#include "card_transport.h"
+#include "card_stats.h"
+#include "card_record.h"
+#include "busy_wait.h"
+#include "bus_timing.h"
+#include "card_batch.h"
+
+namespace flashcart_core {
+
+/// The card as seen by the drivers.
+///
+/// This forwards everything to the attached CardTransport, counts and times each
+/// transaction into the attached CardStats, and writes it to the attached CardRecorder.
+class Card {
+    CardTransport *m_transport;
+    CardStats *m_stats;
+    CardRecorder *m_recorder;
+    CardPhase m_phase;
+    WaitTiming m_wait[static_cast<unsigned int>(WaitOp::Count)];
+    BusTiming m_read_timing;
+    bool m_read_tuned;
+
+    std::uint64_t begin();
+    void end(CardRecordKind kind, std::uint64_t cmd, std::uint32_t romcnt, std::uint8_t flags, const CardErr &err,
+             std::uint64_t start, const void *out, std::uint32_t outLength, const void *in, std::uint32_t inLength,
+             const void *more = nullptr, std::uint32_t moreLength = 0);
+    CardErr poll(const CardBatchEntry &entry);
+
+public:
+    Card() : m_transport(nullptr), m_stats(nullptr), m_recorder(nullptr),
+        m_phase(CardPhase::Idle), m_read_timing(), m_read_tuned(false) { resetWaitTiming(); }
+
+    void attach(CardTransport *transport) { m_transport = transport; resetTiming(); }
+    CardTransport *transport() { return m_transport; }
+
+    CardStats *stats() { return m_stats; }
+    void stats(CardStats *stats) { m_stats = stats; }
+
+    /// Starts (or stops, with nullptr) recording every call into `recorder`.
+    bool record(CardRecorder *recorder);
+
+    CardPhase phase() const { return m_phase; }
+    void phase(CardPhase phase) { m_phase = phase; }
+
+    /// Current time in microseconds, by the transport's clock: platform::now() on a real
+    /// card (so 0 if the platform has no clock), the recorded time when replaying.
+    std::uint64_t time() { return m_transport ? m_transport->now() : platform::now(); }
+
+    WaitTiming &waitTiming(WaitOp op) { return m_wait[static_cast<unsigned int>(op)]; }
+    /// Sets the expected and maximum time for `op`, e.g. from the flash chip's datasheet.
+    void waitTiming(WaitOp op, std::uint32_t expected, std::uint32_t max) { waitTiming(op) = WaitTiming{ expected, max }; }
+    void resetWaitTiming();
+
+    /// Sends reads with `timing` from now on, or with the drivers' own flags if it's null.
+    void readTiming(const BusTiming *timing) {
+        m_read_tuned = timing != nullptr;
+        if (timing) {
+            m_read_timing = *timing;
+        }
+    }
+    /// The flags to send a read command with: `flags`, sped up if a tuned timing is set.
+    std::uint32_t readFlags(std::uint32_t flags) const { return m_read_tuned ? m_read_timing.apply(flags) : flags; }
+
+    /// Forgets everything learned about the previous cart's timing.
+    void resetTiming() {
+        resetWaitTiming();
+        readTiming(nullptr);
+    }
+
+    /// Counts one status poll issued while waiting on the card.
+    void notePoll() {
+        if (m_stats) {
+            m_stats->recordPoll(m_phase);
+        }
+    }
+
+    /// Counts one program of `bytes` bytes that the driver didn't send, since the flash
+    /// already held them.
+    void noteSkippedProgram(std::uint32_t bytes) {
+        if (m_stats) {
+            m_stats->recordSkippedProgram(bytes);
+        }
+    }
+
+    CardErr sendCommand(std::uint64_t cmd, void *buf, std::uint32_t size, std::uint32_t flags, bool flagsAsIs = false);
+    CardErr sendCommand(const std::uint8_t *cmdbuf, void *buf, std::uint32_t size, std::uint32_t flags, bool flagsAsIs = false);
+    CardErr sendWriteCommand(std::uint64_t cmd, const void *buf, std::uint32_t size, std::uint32_t flags);
+    CardErr sendSpi(const std::uint8_t *cmd, std::uint32_t cmdLength, std::uint8_t *resp, std::uint32_t respLength);
+    /// Sends `cmd`, then `data`, as one SPI transfer; recorded as if they were one buffer.
+    CardErr sendSpiWrite(const std::uint8_t *cmd, std::uint32_t cmdLength, const std::uint8_t *data, std::uint32_t dataLength);
+    CardErr readData(std::uint32_t address, void *buf, std::uint32_t size);
+    void delay(std::uint32_t delay);
+
+    /// Sends every transaction in `batch`, in order, stopping at the first failure (or poll
+    /// timeout). If `completed` isn't null, it's set to the number of entries that succeeded.
+    ///
+    /// Transports that can send a batch in one go get it whole, unless it's being recorded;
+    /// what they send is then counted as a single transaction. They may send just the start
+    /// of it (e.g. up to a poll they can't do), and the rest goes entry by entry.
+    CardErr submit(const CardBatch &batch, std::uint32_t *completed = nullptr);
+
+    CardErr init();
+    CardErr beginKey1(const CardSecureParams &params);
+    CardErr beginKey2();
+    CardState state();
+    void state(CardState state);
+};
+
+/// Sets the phase that transactions are counted under, for the lifetime of this object.
+///
+/// The outermost phase wins, so e.g. the reads done while verifying a write
+/// are counted under CardPhase::Verify rather than CardPhase::Read.
+class CardPhaseScope {
+    Card &m_card;
+    const CardPhase m_prev;
+
+public:
+    CardPhaseScope(Card &card, CardPhase phase) : m_card(card), m_prev(card.phase()) {
+        if (m_prev == CardPhase::Idle) {
+            m_card.phase(phase);
+        }
+    }
+
+    ~CardPhaseScope() { m_card.phase(m_prev); }
+
+    CardPhaseScope(const CardPhaseScope &) = delete;
+    CardPhaseScope &operator=(const CardPhaseScope &) = delete;
+};
+}
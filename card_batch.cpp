@@ -0,0 +1,186 @@
+#include <cstring>
+#include <algorithm>
+
+#include "card_batch.h"
+#include "card.h"
+
+namespace flashcart_core {
+using platform::logMessage;
+
+namespace {
+const std::uint8_t spiWren[] = { 0x06 };
+const std::uint8_t spiRdsr[] = { 0x05 };
+}
+
+CardBatchEntry *CardBatch::add(CardBatchEntry::Kind kind) {
+    static CardBatchEntry overflow;
+    if (m_count >= m_capacity) {
+        m_overflow = true;
+        return &overflow;
+    }
+
+    CardBatchEntry *e = &m_entries[m_count++];
+    std::memset(e, 0, sizeof(*e));
+    e->kind = kind;
+    return e;
+}
+
+CardBatch &CardBatch::command(std::uint64_t cmd, void *in, std::uint32_t size, std::uint32_t flags) {
+    CardBatchEntry *e = add(CardBatchEntry::Kind::Command);
+    e->cmd = cmd;
+    e->in = in;
+    e->in_length = size;
+    e->flags = flags;
+    return *this;
+}
+
+CardBatch &CardBatch::command(const std::uint8_t *cmdbuf, void *in, std::uint32_t size, std::uint32_t flags) {
+    std::uint64_t cmd = 0;
+    for (int i = 0; i < 8; ++i) {
+        cmd |= static_cast<std::uint64_t>(cmdbuf[i]) << (i * 8);
+    }
+    return command(cmd, in, size, flags);
+}
+
+CardBatch &CardBatch::writeCommand(std::uint64_t cmd, const void *data, std::uint32_t size, std::uint32_t flags) {
+    CardBatchEntry *e = add(CardBatchEntry::Kind::WriteCommand);
+    e->cmd = cmd;
+    e->out = static_cast<const std::uint8_t *>(data);
+    e->out_length = size;
+    e->flags = flags;
+    return *this;
+}
+
+CardBatch &CardBatch::spi(const std::uint8_t *out, std::uint32_t outLength, std::uint8_t *in, std::uint32_t inLength) {
+    CardBatchEntry *e = add(CardBatchEntry::Kind::Spi);
+    e->out = out;
+    e->out_length = outLength;
+    e->in = in;
+    e->in_length = inLength;
+    return *this;
+}
+
+CardBatch &CardBatch::spiWrite(const std::uint8_t *header, std::uint32_t headerLength, const void *data,
+                               std::uint32_t dataLength) {
+    CardBatchEntry *e = add(CardBatchEntry::Kind::Spi);
+    e->out = header;
+    e->out_length = headerLength;
+    e->data = static_cast<const std::uint8_t *>(data);
+    e->data_length = dataLength;
+    return *this;
+}
+
+CardBatch &CardBatch::spiNorWrite(WaitOp op, const std::uint8_t *header, std::uint32_t headerLength,
+                                  const void *data, std::uint32_t dataLength) {
+    return spi(spiWren, sizeof(spiWren))
+        .spiWrite(header, headerLength, data, dataLength)
+        .spiPoll(op, spiRdsr, sizeof(spiRdsr), 1, 1, 0);
+}
+
+CardBatch &CardBatch::delay(std::uint32_t delay) {
+    add(CardBatchEntry::Kind::Delay)->cmd = delay;
+    return *this;
+}
+
+CardBatch &CardBatch::poll(WaitOp op, std::uint64_t cmd, std::uint32_t size, std::uint32_t flags,
+                           std::uint32_t mask, std::uint32_t value) {
+    CardBatchEntry *e = add(CardBatchEntry::Kind::Poll);
+    e->op = op;
+    e->cmd = cmd;
+    e->in_length = std::min<std::uint32_t>(size, 4);
+    e->flags = flags;
+    e->mask = mask;
+    e->value = value;
+    return *this;
+}
+
+CardBatch &CardBatch::spiPoll(WaitOp op, const std::uint8_t *out, std::uint32_t outLength, std::uint32_t inLength,
+                              std::uint32_t mask, std::uint32_t value) {
+    CardBatchEntry *e = add(CardBatchEntry::Kind::Poll);
+    e->op = op;
+    e->out = out;
+    e->out_length = outLength;
+    e->in_length = std::min<std::uint32_t>(inLength, 4);
+    e->mask = mask;
+    e->value = value;
+    return *this;
+}
+
+CardErr Card::poll(const CardBatchEntry &e) {
+    BusyWait wait(*this, e.op);
+    std::uint32_t resp;
+    do {
+        if (!wait.poll()) {
+            return CardErr(-1);
+        }
+
+        resp = 0;
+        CardErr err = e.out
+            ? sendSpi(e.out, e.out_length, reinterpret_cast<std::uint8_t *>(&resp), e.in_length)
+            : sendCommand(e.cmd, &resp, e.in_length, e.flags);
+        if (err) {
+            return err;
+        }
+    } while ((resp & e.mask) != e.value);
+    wait.done();
+    return CardErr();
+}
+
+CardErr Card::submit(const CardBatch &batch, std::uint32_t *completed) {
+    CardErr err;
+    std::uint32_t i = 0;
+    if (batch.overflowed()) {
+        logMessage(LOG_ERR, "Card: batch overflowed, not sent");
+        err = CardErr(-1);
+    } else if (!m_recorder && batch.size()) {
+        const std::uint64_t start = begin();
+        if (m_transport->submit(batch, &err, &i)) {
+            if (m_stats && i) {
+                std::uint32_t bytes = 0;
+                for (std::uint32_t j = 0; j < i; ++j) {
+                    bytes += batch[j].out_length + batch[j].data_length + batch[j].in_length;
+                }
+                m_stats->record(m_phase, CardOp::Command, batch[0].cmd & 0xFF, bytes, start, time());
+            }
+            // the transport may have sent only the start of the batch (say, up to a poll)
+            if (err || i == batch.size()) {
+                if (completed) {
+                    *completed = i;
+                }
+                return err;
+            }
+        }
+    }
+
+    for (; !err && i < batch.size(); ++i) {
+        const CardBatchEntry &e = batch[i];
+        switch (e.kind) {
+            case CardBatchEntry::Kind::Command:
+                err = sendCommand(e.cmd, e.in, e.in_length, e.flags);
+                break;
+            case CardBatchEntry::Kind::WriteCommand:
+                err = sendWriteCommand(e.cmd, e.out, e.out_length, e.flags);
+                break;
+            case CardBatchEntry::Kind::Spi:
+                err = e.data_length
+                    ? sendSpiWrite(e.out, e.out_length, e.data, e.data_length)
+                    : sendSpi(e.out, e.out_length, static_cast<std::uint8_t *>(e.in), e.in_length);
+                break;
+            case CardBatchEntry::Kind::Delay:
+                delay(static_cast<std::uint32_t>(e.cmd));
+                break;
+            case CardBatchEntry::Kind::Poll:
+                err = poll(e);
+                break;
+        }
+        if (err) {
+            break;
+        }
+    }
+
+    if (completed) {
+        *completed = i;
+    }
+    return err;
+}
+}
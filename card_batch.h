@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+
+#include "card_stats.h"
+
+namespace flashcart_core {
+
+/// One transaction in a CardBatch.
+struct CardBatchEntry {
+    enum class Kind : std::uint8_t {
+        Command,
+        WriteCommand,
+        Spi,
+        /// `cmd` is the delay, as passed to Card::delay().
+        Delay,
+        /// Repeats a command (or an SPI transfer, if `out` is set) until
+        /// `(response & mask) == value`, waiting as for `op`.
+        Poll
+    };
+
+    Kind kind;
+    WaitOp op;
+    std::uint64_t cmd;
+    /// Data for WriteCommand, bytes sent for Spi.
+    const std::uint8_t *out;
+    std::uint32_t out_length;
+    /// For Spi, sent straight after `out` in the same transfer, so that a payload doesn't
+    /// have to be copied in behind its command. Nothing is read back then.
+    const std::uint8_t *data;
+    std::uint32_t data_length;
+    /// Where the response goes; may be null if the caller doesn't need it.
+    void *in;
+    std::uint32_t in_length;
+    std::uint32_t flags;
+    std::uint32_t mask;
+    std::uint32_t value;
+};
+
+/// A fixed sequence of card transactions with no data dependencies between them (other
+/// than polls), sent in one go with Card::submit().
+///
+/// Entries live in storage the caller provides, so building a batch never allocates.
+/// Buffers the entries point to must stay alive until the batch is submitted.
+class CardBatch {
+    CardBatchEntry *const m_entries;
+    const std::uint32_t m_capacity;
+    std::uint32_t m_count;
+    bool m_overflow;
+
+    CardBatchEntry *add(CardBatchEntry::Kind kind);
+
+public:
+    CardBatch(CardBatchEntry *entries, std::uint32_t capacity)
+        : m_entries(entries), m_capacity(capacity), m_count(0), m_overflow(false) {}
+    template<std::uint32_t N>
+    explicit CardBatch(CardBatchEntry (&entries)[N]) : CardBatch(entries, N) {}
+
+    CardBatch &command(std::uint64_t cmd, void *in, std::uint32_t size, std::uint32_t flags);
+    CardBatch &command(const std::uint8_t *cmdbuf, void *in, std::uint32_t size, std::uint32_t flags);
+    CardBatch &writeCommand(std::uint64_t cmd, const void *data, std::uint32_t size, std::uint32_t flags);
+    CardBatch &spi(const std::uint8_t *out, std::uint32_t outLength, std::uint8_t *in = nullptr, std::uint32_t inLength = 0);
+    /// An SPI transfer sending `header`, then `data`, without reading anything back.
+    CardBatch &spiWrite(const std::uint8_t *header, std::uint32_t headerLength, const void *data, std::uint32_t dataLength);
+    /// An SPI NOR write as one unit: WREN, then `header` and `data` in one transfer, then
+    /// RDSR polled until WIP clears, waiting as for `op`. Takes three entries.
+    CardBatch &spiNorWrite(WaitOp op, const std::uint8_t *header, std::uint32_t headerLength,
+                           const void *data = nullptr, std::uint32_t dataLength = 0);
+    CardBatch &delay(std::uint32_t delay);
+    /// Polls `cmd` (reading `size` bytes, at most 4) until `(response & mask) == value`.
+    CardBatch &poll(WaitOp op, std::uint64_t cmd, std::uint32_t size, std::uint32_t flags,
+                    std::uint32_t mask, std::uint32_t value);
+    /// Polls an SPI transfer (reading `inLength` bytes, at most 4) until `(response & mask) == value`.
+    CardBatch &spiPoll(WaitOp op, const std::uint8_t *out, std::uint32_t outLength, std::uint32_t inLength,
+                       std::uint32_t mask, std::uint32_t value);
+
+    void clear() { m_count = 0; m_overflow = false; }
+    std::uint32_t size() const { return m_count; }
+    /// True if more entries were added than there's room for; submitting then fails.
+    bool overflowed() const { return m_overflow; }
+    const CardBatchEntry &operator[](std::uint32_t i) const { return m_entries[i]; }
+};
+}
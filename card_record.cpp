@@ -0,0 +1,151 @@
+#include <cstring>
+#include <algorithm>
+
+#include "card_record.h"
+#include "platform.h"
+
+namespace flashcart_core {
+using platform::logMessage;
+
+CardReplay::CardReplay(const void *trace, std::uint32_t size)
+    : m_trace(static_cast<const std::uint8_t *>(trace)), m_size(size), m_pos(8),
+      m_time(0), m_skipped(0), m_mismatches(0), m_valid(false) {
+    std::uint32_t header[2];
+    if (size < sizeof(header)) {
+        logMessage(LOG_ERR, "CardReplay: trace too short");
+        return;
+    }
+
+    std::memcpy(header, m_trace, sizeof(header));
+    if (header[0] != cardTraceMagic || header[1] != cardTraceVersion) {
+        logMessage(LOG_ERR, "CardReplay: bad trace header %08lX %08lX",
+            static_cast<unsigned long>(header[0]), static_cast<unsigned long>(header[1]));
+        return;
+    }
+
+    m_valid = true;
+}
+
+bool CardReplay::recordAt(std::uint32_t pos, CardRecord *rec, std::uint32_t *next) const {
+    if (pos + sizeof(CardRecord) > m_size) {
+        return false;
+    }
+
+    std::memcpy(rec, m_trace + pos, sizeof(CardRecord));
+    std::uint32_t end = pos + sizeof(CardRecord) + rec->out_length;
+    if (!(rec->flags & CardRecord::DataOmitted)) {
+        end += rec->in_length;
+    }
+    if (end > m_size || end < pos) {
+        return false;
+    }
+
+    *next = end;
+    return true;
+}
+
+bool CardReplay::next(CardRecordKind kind, std::uint64_t cmd, CardRecord *rec, const std::uint8_t **in, bool anyCmd) {
+    if (!m_valid) {
+        return false;
+    }
+
+    std::uint32_t pos = m_pos, next, skipped = 0;
+    while (skipped <= resyncWindow && recordAt(pos, rec, &next)) {
+        if (rec->kind == static_cast<std::uint8_t>(kind) && (anyCmd || rec->cmd == cmd)) {
+            if (skipped) {
+                logMessage(LOG_DEBUG, "CardReplay: skipped %lu records", static_cast<unsigned long>(skipped));
+            }
+
+            *in = (rec->flags & CardRecord::DataOmitted) ? nullptr
+                : m_trace + pos + sizeof(CardRecord) + rec->out_length;
+            m_skipped += skipped;
+            m_time += rec->duration;
+            m_pos = next;
+            return true;
+        }
+
+        // delays aren't responses, skipping them isn't a mismatch
+        if (rec->kind != static_cast<std::uint8_t>(CardRecordKind::Delay)) {
+            ++skipped;
+        }
+        pos = next;
+    }
+
+    ++m_mismatches;
+    logMessage(LOG_ERR, "CardReplay: no record for call %d %016llX", static_cast<int>(kind),
+        static_cast<unsigned long long>(cmd));
+    return false;
+}
+
+void CardReplay::delay() {
+    CardRecord rec;
+    std::uint32_t next;
+    if (m_valid && recordAt(m_pos, &rec, &next) && rec.kind == static_cast<std::uint8_t>(CardRecordKind::Delay)) {
+        m_time += rec.duration;
+        m_pos = next;
+    }
+}
+
+CardErr CardReplay::replay(CardRecordKind kind, std::uint64_t cmd, void *in, std::uint32_t inLength) {
+    CardRecord rec;
+    const std::uint8_t *data;
+    if (!next(kind, cmd, &rec, &data)) {
+        return CardErr(-1);
+    }
+
+    if (in && data) {
+        std::memcpy(in, data, std::min(inLength, rec.in_length));
+    }
+
+    if (rec.flags & CardRecord::Failed) {
+        return CardErr(rec.err, rec.flags & CardRecord::Unsupported);
+    }
+    return CardErr();
+}
+
+CardErr CardReplay::sendCommand(std::uint64_t cmd, void *buf, std::uint32_t size, std::uint32_t, bool) {
+    return replay(CardRecordKind::Command, cmd, buf, size);
+}
+
+CardErr CardReplay::sendWriteCommand(std::uint64_t cmd, const void *, std::uint32_t, std::uint32_t) {
+    return replay(CardRecordKind::WriteCommand, cmd, nullptr, 0);
+}
+
+CardErr CardReplay::sendSpi(const std::uint8_t *cmd, std::uint32_t cmdLength, std::uint8_t *resp, std::uint32_t respLength) {
+    std::uint64_t cmd64 = 0;
+    for (std::uint32_t i = 0; i < std::min<std::uint32_t>(cmdLength, 8); ++i) {
+        cmd64 |= static_cast<std::uint64_t>(cmd[i]) << (i * 8);
+    }
+    return replay(CardRecordKind::Spi, cmd64, resp, respLength);
+}
+
+CardErr CardReplay::readData(std::uint32_t address, void *buf, std::uint32_t size) {
+    return replay(CardRecordKind::ReadData, address, buf, size);
+}
+
+CardErr CardReplay::init() {
+    return replay(CardRecordKind::Init, 0, nullptr, 0);
+}
+
+CardErr CardReplay::beginKey1(const CardSecureParams &) {
+    return replay(CardRecordKind::BeginKey1, 0, nullptr, 0);
+}
+
+CardErr CardReplay::beginKey2() {
+    return replay(CardRecordKind::BeginKey2, 0, nullptr, 0);
+}
+
+CardState CardReplay::state() {
+    // the state is the response here, so match any
+    CardRecord rec;
+    const std::uint8_t *data;
+    if (next(CardRecordKind::State, 0, &rec, &data, true)) {
+        return static_cast<CardState>(rec.cmd);
+    }
+    return CardState::Unknown;
+}
+
+void CardReplay::state(CardState state) {
+    replay(CardRecordKind::SetState, static_cast<std::uint64_t>(state), nullptr, 0);
+}
+}
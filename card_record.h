@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+
+#include "card_transport.h"
+
+namespace flashcart_core {
+
+/// Card command stream traces.
+///
+/// A trace is an 8-byte file header (magic "FCRT", then a 32-bit little-endian version),
+/// followed by one record per card call. Each record is a CardRecord, then `out_length`
+/// bytes sent to the card, then `in_length` bytes received (unless the data was
+/// omitted, see CardRecord::DataOmitted). All fields are little-endian.
+
+enum class CardRecordKind : std::uint8_t {
+    Command = 0,
+    WriteCommand,
+    Spi,
+    ReadData,
+    Init,
+    BeginKey1,
+    BeginKey2,
+    /// Reading the encryption state; `cmd` is the state.
+    State,
+    /// Setting the encryption state; `cmd` is the state.
+    SetState,
+    /// A delay; `cmd` is the delay as passed to Card::delay().
+    Delay
+};
+
+struct CardRecord {
+    enum : std::uint8_t {
+        FlagsAsIs = 1 << 0,
+        Failed = 1 << 1,
+        Unsupported = 1 << 2,
+        /// The caller didn't want the response, so it wasn't recorded.
+        DataOmitted = 1 << 3
+    };
+
+    std::uint8_t kind;
+    std::uint8_t flags;
+    std::uint16_t reserved;
+    std::int32_t err;
+    /// The command (as sent, first byte in the low bits), the first 8 bytes of an SPI
+    /// command, the address for ReadData, or the state.
+    std::uint64_t cmd;
+    std::uint32_t romcnt;
+    /// In microseconds, as measured through platform::now().
+    std::uint32_t duration;
+    std::uint32_t out_length;
+    std::uint32_t in_length;
+};
+static_assert(sizeof(CardRecord) == 32, "Wrong CardRecord size");
+
+constexpr std::uint32_t cardTraceMagic = 0x54524346; // "FCRT"
+constexpr std::uint32_t cardTraceVersion = 1;
+
+/// Where recorded traces go. Platforms implement write() to e.g. append to a file.
+class CardRecorder {
+public:
+    virtual ~CardRecorder() {}
+
+    /// Returns false if the data couldn't be written; recording then stops.
+    virtual bool write(const void *data, std::uint32_t length) = 0;
+};
+
+/// Plays a recorded trace back in place of a card.
+///
+/// Calls are matched to records in order. If a call doesn't match the next record (e.g. a
+/// driver change dropped some polls), the next few records are searched for one that
+/// does, and the ones in between are skipped.
+class CardReplay : public CardTransport {
+    const std::uint8_t *const m_trace;
+    const std::uint32_t m_size;
+    std::uint32_t m_pos;
+    std::uint64_t m_time;
+    std::uint32_t m_skipped;
+    std::uint32_t m_mismatches;
+    bool m_valid;
+
+    static constexpr std::uint32_t resyncWindow = 256;
+
+    /// Reads the record at `pos`; returns false at the end of the trace or if it's truncated.
+    bool recordAt(std::uint32_t pos, CardRecord *rec, std::uint32_t *next) const;
+    /// Replays the next call of kind `kind`, copying up to `inLength` bytes of its response to `in`.
+    CardErr replay(CardRecordKind kind, std::uint64_t cmd, void *in, std::uint32_t inLength);
+
+public:
+    /// `trace` must stay alive for as long as this is used.
+    CardReplay(const void *trace, std::uint32_t size);
+
+    bool valid() const { return m_valid; }
+    bool finished() const { return m_pos >= m_size; }
+
+    /// Finds the record for the next call of kind `kind` with command `cmd` (or any
+    /// command, if `anyCmd` is set).
+    ///
+    /// On success, `*in` points to the recorded response (or is null if it was omitted).
+    bool next(CardRecordKind kind, std::uint64_t cmd, CardRecord *rec, const std::uint8_t **in, bool anyCmd = false);
+
+    /// Consumes a Delay record, if that's what comes next.
+    void delay();
+
+    /// Recorded time, in microseconds, up to the last consumed record.
+    std::uint64_t time() const { return m_time; }
+    std::uint32_t skipped() const { return m_skipped; }
+    std::uint32_t mismatches() const { return m_mismatches; }
+
+    CardErr sendCommand(std::uint64_t cmd, void *buf, std::uint32_t size, std::uint32_t flags, bool flagsAsIs) override;
+    CardErr sendWriteCommand(std::uint64_t cmd, const void *buf, std::uint32_t size, std::uint32_t flags) override;
+    CardErr sendSpi(const std::uint8_t *cmd, std::uint32_t cmdLength, std::uint8_t *resp, std::uint32_t respLength) override;
+    CardErr readData(std::uint32_t address, void *buf, std::uint32_t size) override;
+
+    CardErr init() override;
+    CardErr beginKey1(const CardSecureParams &params) override;
+    CardErr beginKey2() override;
+    CardState state() override;
+    void state(CardState state) override;
+
+    void delay(std::uint32_t) override { delay(); }
+    std::uint64_t now() override { return m_time; }
+};
+}
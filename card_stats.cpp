@@ -0,0 +1,191 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "card_stats.h"
+#include "platform.h"
+
+namespace flashcart_core {
+using platform::logMessage;
+
+namespace {
+unsigned int histogramBucket(std::uint64_t duration) {
+    unsigned int bucket = 0;
+    while (duration && bucket < CardPhaseStats::histogramBuckets - 1) {
+        duration >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+}
+
+const char *cardPhaseName(CardPhase phase) {
+    switch (phase) {
+        case CardPhase::Idle: return "idle";
+        case CardPhase::Init: return "init";
+        case CardPhase::Read: return "read";
+        case CardPhase::Erase: return "erase";
+        case CardPhase::Program: return "program";
+        case CardPhase::Verify: return "verify";
+        default: return "?";
+    }
+}
+
+const char *cardOpName(CardOp op) {
+    switch (op) {
+        case CardOp::Command: return "command";
+        case CardOp::WriteCommand: return "write command";
+        case CardOp::Spi: return "spi";
+        case CardOp::ReadData: return "read data";
+        case CardOp::Secure: return "secure init";
+        default: return "?";
+    }
+}
+
+const char *waitOpName(WaitOp op) {
+    switch (op) {
+        case WaitOp::Erase: return "erase";
+        case WaitOp::Program: return "program";
+        case WaitOp::Sd: return "sd";
+        case WaitOp::Status: return "status";
+        default: return "?";
+    }
+}
+
+void CardStats::reset() {
+    std::memset(phase, 0, sizeof(phase));
+    std::memset(op_calls, 0, sizeof(op_calls));
+    std::memset(command, 0, sizeof(command));
+    std::memset(spi, 0, sizeof(spi));
+    std::memset(wait, 0, sizeof(wait));
+    skipped_programs = 0;
+    skipped_program_bytes = 0;
+    trace_count = 0;
+    trace_dropped = 0;
+}
+
+void CardStats::setTraceBuffer(CardTraceEvent *events, std::uint32_t capacity) {
+    trace = events;
+    trace_capacity = events ? capacity : 0;
+    trace_count = 0;
+    trace_dropped = 0;
+}
+
+void CardStats::record(CardPhase phase, CardOp op, std::uint8_t opcode, std::uint32_t bytes,
+                       std::uint64_t start, std::uint64_t end) {
+    const std::uint64_t duration = end > start ? end - start : 0;
+
+    CardPhaseStats &p = this->phase[static_cast<unsigned int>(phase)];
+    ++p.calls;
+    p.bytes += bytes;
+    p.time += duration;
+    ++p.histogram[histogramBucket(duration)];
+
+    ++op_calls[static_cast<unsigned int>(op)];
+    if (op == CardOp::Spi) {
+        ++spi[opcode].calls;
+        spi[opcode].bytes += bytes;
+    } else if (op != CardOp::Secure) {
+        ++command[opcode].calls;
+        command[opcode].bytes += bytes;
+    }
+
+    if (trace_count < trace_capacity) {
+        CardTraceEvent &e = trace[trace_count++];
+        e.start = start;
+        e.duration = static_cast<std::uint32_t>(duration);
+        e.bytes = bytes;
+        e.opcode = opcode;
+        e.op = op;
+        e.phase = phase;
+    } else if (trace) {
+        ++trace_dropped;
+    }
+}
+
+void CardStats::recordWait(WaitOp op, std::uint32_t polls, std::uint64_t time, bool timedOut) {
+    CardWaitStats &w = wait[static_cast<unsigned int>(op)];
+    ++w.waits;
+    w.polls += polls;
+    w.time += time;
+    w.max = std::max<std::uint32_t>(w.max, static_cast<std::uint32_t>(std::min<std::uint64_t>(time, UINT32_MAX)));
+    if (timedOut) {
+        ++w.timeouts;
+    }
+}
+
+void logCardStats(const CardStats &stats) {
+    for (unsigned int i = 0; i < static_cast<unsigned int>(CardPhase::Count); ++i) {
+        const CardPhaseStats &p = stats.phase[i];
+        if (!p.calls && !p.polls) {
+            continue;
+        }
+
+        logMessage(LOG_INFO, "card stats: %s: %lu calls, %lu polls, %llu bytes, %llu us",
+            cardPhaseName(static_cast<CardPhase>(i)), static_cast<unsigned long>(p.calls),
+            static_cast<unsigned long>(p.polls), static_cast<unsigned long long>(p.bytes),
+            static_cast<unsigned long long>(p.time));
+        for (unsigned int b = 0; b < CardPhaseStats::histogramBuckets; ++b) {
+            if (p.histogram[b]) {
+                logMessage(LOG_INFO, "card stats: %s: < %lu us: %lu", cardPhaseName(static_cast<CardPhase>(i)),
+                    1ul << b, static_cast<unsigned long>(p.histogram[b]));
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < 256; ++i) {
+        if (stats.command[i].calls) {
+            logMessage(LOG_INFO, "card stats: command %02X: %lu calls, %lu bytes", i,
+                static_cast<unsigned long>(stats.command[i].calls), static_cast<unsigned long>(stats.command[i].bytes));
+        }
+    }
+    for (unsigned int i = 0; i < 256; ++i) {
+        if (stats.spi[i].calls) {
+            logMessage(LOG_INFO, "card stats: spi %02X: %lu calls, %lu bytes", i,
+                static_cast<unsigned long>(stats.spi[i].calls), static_cast<unsigned long>(stats.spi[i].bytes));
+        }
+    }
+
+    for (unsigned int i = 0; i < static_cast<unsigned int>(WaitOp::Count); ++i) {
+        const CardWaitStats &w = stats.wait[i];
+        if (w.waits) {
+            logMessage(LOG_INFO, "card stats: wait %s: %lu waits, %lu polls, %lu timeouts, avg %llu us, max %lu us",
+                waitOpName(static_cast<WaitOp>(i)), static_cast<unsigned long>(w.waits),
+                static_cast<unsigned long>(w.polls), static_cast<unsigned long>(w.timeouts),
+                static_cast<unsigned long long>(w.time / w.waits), static_cast<unsigned long>(w.max));
+        }
+    }
+
+    if (stats.skipped_programs) {
+        logMessage(LOG_INFO, "card stats: %lu programs skipped, %llu bytes",
+            static_cast<unsigned long>(stats.skipped_programs),
+            static_cast<unsigned long long>(stats.skipped_program_bytes));
+    }
+
+    if (stats.trace_dropped) {
+        logMessage(LOG_INFO, "card stats: %lu trace events dropped", static_cast<unsigned long>(stats.trace_dropped));
+    }
+}
+
+void writeChromeTrace(const CardStats &stats,
+                      void (*sink)(void *ctx, const char *data, std::size_t length), void *ctx) {
+    static const char head[] = "{\"traceEvents\":[\n";
+    static const char tail[] = "\n]}\n";
+    char line[192];
+
+    sink(ctx, head, sizeof(head) - 1);
+    for (std::uint32_t i = 0; i < stats.trace_count; ++i) {
+        const CardTraceEvent &e = stats.trace[i];
+        int len = std::snprintf(line, sizeof(line),
+            "%s{\"name\":\"%s %02X\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+            "\"ts\":%llu,\"dur\":%lu,\"args\":{\"bytes\":%lu}}",
+            i ? ",\n" : "", cardOpName(e.op), e.opcode, cardPhaseName(e.phase),
+            static_cast<unsigned int>(e.phase), static_cast<unsigned long long>(e.start),
+            static_cast<unsigned long>(e.duration), static_cast<unsigned long>(e.bytes));
+        if (len > 0) {
+            sink(ctx, line, std::min<std::size_t>(static_cast<std::size_t>(len), sizeof(line) - 1));
+        }
+    }
+    sink(ctx, tail, sizeof(tail) - 1);
+}
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace flashcart_core {
+
+/// What the driver is doing while a transaction is issued.
+enum class CardPhase : std::uint8_t {
+    Idle = 0,
+    Init,
+    Read,
+    Erase,
+    Program,
+    Verify,
+    Count
+};
+
+/// Which kind of card transaction was issued.
+enum class CardOp : std::uint8_t {
+    Command = 0,
+    WriteCommand,
+    Spi,
+    ReadData,
+    Secure, // init, KEY1/KEY2 setup
+    Count
+};
+
+/// What a driver is waiting on the card for. See BusyWait.
+enum class WaitOp : std::uint8_t {
+    Erase = 0,
+    Program,
+    /// The cart's own SD controller finishing a command.
+    Sd,
+    /// Anything else; normally done by the first poll.
+    Status,
+    Count
+};
+
+const char *cardPhaseName(CardPhase phase);
+const char *cardOpName(CardOp op);
+const char *waitOpName(WaitOp op);
+
+/// One transaction in the optional timeline buffer.
+struct CardTraceEvent {
+    std::uint64_t start;
+    std::uint32_t duration;
+    std::uint32_t bytes;
+    std::uint8_t opcode;
+    CardOp op;
+    CardPhase phase;
+};
+
+struct CardPhaseStats {
+    static constexpr unsigned int histogramBuckets = 16;
+
+    std::uint32_t calls;
+    /// Busy/status polls issued while waiting on the card.
+    std::uint32_t polls;
+    std::uint64_t bytes;
+    /// Total wall time in microseconds, as reported by platform::now().
+    std::uint64_t time;
+    /// Bucket 0 counts transactions under 1us; bucket n counts [2^(n-1), 2^n) us.
+    /// The last bucket also takes everything longer.
+    std::uint32_t histogram[histogramBuckets];
+};
+
+struct CardOpcodeStats {
+    std::uint32_t calls;
+    std::uint32_t bytes;
+};
+
+struct CardWaitStats {
+    std::uint32_t waits;
+    std::uint32_t timeouts;
+    std::uint32_t polls;
+    /// Total and longest time until done, in microseconds (estimated if there's no clock).
+    std::uint64_t time;
+    std::uint32_t max;
+};
+
+/// Transaction counters for one flashcart session.
+///
+/// This is owned by the platform and attached with Flashcart::setStats(); nothing is
+/// recorded (and platform::now() is never called) while no stats are attached.
+struct CardStats {
+    CardPhaseStats phase[static_cast<unsigned int>(CardPhase::Count)];
+    std::uint32_t op_calls[static_cast<unsigned int>(CardOp::Count)];
+    /// Indexed by the first command byte.
+    CardOpcodeStats command[256];
+    /// Indexed by the SPI opcode (first byte sent).
+    CardOpcodeStats spi[256];
+    CardWaitStats wait[static_cast<unsigned int>(WaitOp::Count)];
+    /// Program commands not sent because the flash already held the data (0xFF after an
+    /// erase, mostly), and the bytes they would have written.
+    std::uint32_t skipped_programs;
+    std::uint64_t skipped_program_bytes;
+
+    /// Optional timeline, filled in order until full. See setTraceBuffer().
+    CardTraceEvent *trace;
+    std::uint32_t trace_capacity;
+    std::uint32_t trace_count;
+    std::uint32_t trace_dropped;
+
+    CardStats() : trace(nullptr), trace_capacity(0) { reset(); }
+
+    /// Clears all counters and the timeline (but keeps the timeline buffer).
+    void reset();
+    void setTraceBuffer(CardTraceEvent *events, std::uint32_t capacity);
+
+    void record(CardPhase phase, CardOp op, std::uint8_t opcode, std::uint32_t bytes,
+                std::uint64_t start, std::uint64_t end);
+    void recordPoll(CardPhase phase) { ++this->phase[static_cast<unsigned int>(phase)].polls; }
+    void recordWait(WaitOp op, std::uint32_t polls, std::uint64_t time, bool timedOut);
+    void recordSkippedProgram(std::uint32_t bytes) {
+        ++skipped_programs;
+        skipped_program_bytes += bytes;
+    }
+};
+
+/// Logs a summary of `stats` at LOG_INFO.
+void logCardStats(const CardStats &stats);
+
+/// Writes the timeline as Chrome trace-event JSON (chrome://tracing, Perfetto).
+///
+/// `sink` is called repeatedly with chunks of the output.
+void writeChromeTrace(const CardStats &stats,
+                      void (*sink)(void *ctx, const char *data, std::size_t length), void *ctx);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "platform.h"
+
+namespace flashcart_core {
+class CardBatch;
+
+/// The result of a card call: failed or not, and the transport's error number if it did.
+class CardErr {
+    std::int32_t m_errno;
+    bool m_failed;
+    bool m_unsupported;
+
+public:
+    CardErr() : m_errno(0), m_failed(false), m_unsupported(false) {}
+    CardErr(std::int32_t err, bool unsupported = false) : m_errno(err), m_failed(true), m_unsupported(unsupported) {}
+
+    std::int32_t errNo() const { return m_errno; }
+    bool unsupported() const { return m_unsupported; }
+    explicit operator bool() const { return m_failed; }
+};
+
+/// Which encryption the card's command stream is in.
+enum class CardState : std::uint8_t {
+    Raw = 0,
+    Key1,
+    Key2,
+    Unknown
+};
+
+/// What it takes to get a cart into KEY1 and KEY2 mode.
+struct CardSecureParams {
+    BlowfishKey key;
+    /// ROMCNT for KEY1 and KEY2 commands; carts often want something other than their header says.
+    std::uint32_t key1_romcnt;
+    std::uint32_t key2_romcnt;
+    std::uint8_t key2_seed;
+};
+
+/// How a Card reaches the cart.
+///
+/// The transport only moves commands and data; counting, recording and timing are done by
+/// Card on top of it. Commands are given as sent, first byte in the low bits.
+///
+/// Backends: NcgcTransport (libncgc, on the console), CardReplay (a recorded trace), and
+/// the host-side ones in host/.
+class CardTransport {
+public:
+    virtual ~CardTransport() {}
+
+    virtual CardErr sendCommand(std::uint64_t cmd, void *buf, std::uint32_t size, std::uint32_t flags, bool flagsAsIs) = 0;
+    virtual CardErr sendWriteCommand(std::uint64_t cmd, const void *buf, std::uint32_t size, std::uint32_t flags) = 0;
+    virtual CardErr sendSpi(const std::uint8_t *cmd, std::uint32_t cmdLength, std::uint8_t *resp, std::uint32_t respLength) = 0;
+    virtual CardErr readData(std::uint32_t address, void *buf, std::uint32_t size) = 0;
+    /// Sends `cmd`, then `data`, as one SPI transfer (chip select held throughout), reading
+    /// nothing back. By default the two are joined for sendSpi(), which is enough for a
+    /// command and a page; transports that can send from two buffers override this.
+    virtual CardErr sendSpiWrite(const std::uint8_t *cmd, std::uint32_t cmdLength,
+                                 const std::uint8_t *data, std::uint32_t dataLength) {
+        std::uint8_t buf[0x108];
+        if (cmdLength + dataLength > sizeof(buf)) {
+            return CardErr(-1);
+        }
+        std::memcpy(buf, cmd, cmdLength);
+        std::memcpy(buf + cmdLength, data, dataLength);
+        return sendSpi(buf, cmdLength + dataLength, nullptr, 0);
+    }
+
+    /// Resets the cart and reads its header, leaving it in CardState::Raw.
+    virtual CardErr init() = 0;
+    virtual CardErr beginKey1(const CardSecureParams &params) = 0;
+    virtual CardErr beginKey2() = 0;
+    virtual CardState state() = 0;
+    /// Changes what the transport thinks the state is, without talking to the cart.
+    virtual void state(CardState state) = 0;
+
+    /// Waits about `delay` ARM9 cycles (at 67MHz).
+    virtual void delay(std::uint32_t delay) = 0;
+    /// Current time in microseconds. Transports with their own clock (simulated or
+    /// replayed) override this.
+    virtual std::uint64_t now() { return platform::now(); }
+
+    /// Sends a whole batch in one go, for transports that can do better than one call per
+    /// entry (DMA, USB). Returns false to have Card send it entry by entry instead.
+    virtual bool submit(const CardBatch & /*batch*/, CardErr * /*err*/, std::uint32_t * /*completed*/) { return false; }
+};
+}
@@ -1,5 +1,7 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 
 #include "device.h"
 
@@ -15,3 +17,103 @@ flashcart_core::Flashcart::Flashcart(const char* name, const char* short_name, c
 
 flashcart_core::Flashcart::Flashcart(const char* name, const size_t max_length)
     : Flashcart(name, name, max_length) {}
+
+namespace {
+struct SavedBusTiming {
+    std::uint32_t magic;
+    flashcart_core::BusTiming timing;
+};
+constexpr std::uint32_t savedBusTimingMagic = 0x54424346; // "FCBT"
+
+/// How much of a skipped part readUsedFlash() reads at each sample.
+constexpr std::uint32_t blankSampleSize = 0x10;
+}
+
+bool flashcart_core::Flashcart::tuneBusTiming(bool retune) {
+    BusTimingProbe probe;
+    if (!getBusTimingProbe(&probe)) {
+        platform::logMessage(LOG_INFO, "%s: bus timing tuning not supported", m_short_name);
+        return false;
+    }
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "%s.timing", m_short_name);
+
+    m_card.readTiming(nullptr);
+    SavedBusTiming saved;
+    if (!retune && platform::loadData(name, &saved, sizeof(saved)) && saved.magic == savedBusTimingMagic) {
+        if (checkBusTiming(m_card, probe, saved.timing)) {
+            m_card.readTiming(&saved.timing);
+            platform::logMessage(LOG_INFO, "%s: using saved bus timing", m_short_name);
+            return true;
+        }
+        platform::logMessage(LOG_NOTICE, "%s: saved bus timing doesn't work, tuning again", m_short_name);
+    }
+
+    if (!findBusTiming(m_card, probe, &saved.timing)) {
+        return false;
+    }
+
+    m_card.readTiming(&saved.timing);
+    saved.magic = savedBusTimingMagic;
+    platform::saveData(name, &saved, sizeof(saved));
+    return true;
+}
+
+bool flashcart_core::Flashcart::readUsedFlash(uint8_t *buffer, std::vector<FlashExtent> *skipped, uint32_t sampleStride) {
+    const uint32_t size = static_cast<uint32_t>(getMaxLength());
+    std::vector<FlashExtent> used;
+    skipped->clear();
+    if (!getUsedFlash(&used)) {
+        return readFlash(0, size, buffer);
+    }
+
+    std::sort(used.begin(), used.end(), [](const FlashExtent &a, const FlashExtent &b) {
+        return a.address < b.address;
+    });
+    std::memset(buffer, 0xFF, size);
+
+    // walks the gaps before each used extent (and after the last), merging overlaps
+    uint32_t pos = 0, bytesRead = 0;
+    for (std::size_t i = 0; i <= used.size(); ++i) {
+        const uint32_t start = i < used.size() ? std::min(used[i].address, size) : size;
+        const uint32_t end = i < used.size() ? std::min(used[i].address + used[i].length, size) : size;
+
+        if (start > pos) {
+            bool blank = true;
+            for (uint32_t a = pos; sampleStride && blank && a < start; a += sampleStride) {
+                const uint32_t n = std::min(blankSampleSize, start - a);
+                if (!readFlash(a, n, buffer + a)) {
+                    return false;
+                }
+                for (uint32_t j = 0; j < n; ++j) {
+                    blank = blank && buffer[a + j] == 0xFF;
+                }
+            }
+
+            if (blank) {
+                skipped->push_back(FlashExtent{pos, start - pos});
+            } else {
+                platform::logMessage(LOG_NOTICE, "%s: unmapped flash at 0x%06lX isn't blank, reading it too",
+                    m_short_name, static_cast<unsigned long>(pos));
+                if (!readFlash(pos, start - pos, buffer + pos)) {
+                    return false;
+                }
+                bytesRead += start - pos;
+            }
+            pos = start;
+        }
+
+        if (end > pos) {
+            if (!readFlash(pos, end - pos, buffer + pos)) {
+                return false;
+            }
+            bytesRead += end - pos;
+            pos = end;
+        }
+    }
+
+    platform::logMessage(LOG_INFO, "%s: read 0x%lX of 0x%lX bytes of flash, %lu parts skipped", m_short_name,
+        static_cast<unsigned long>(bytesRead), static_cast<unsigned long>(size), static_cast<unsigned long>(skipped->size()));
+    return true;
+}
@@ -4,9 +4,8 @@
 #include <cstddef>
 #include <vector>
 
-#include <ncgcpp/ntrcard.h>
-
 #include "platform.h"
+#include "card.h"
 
 using std::uint8_t;
 using std::uint16_t;
@@ -17,14 +16,29 @@ using std::uint32_t;
 #define PAGE_ROUND_DOWN(x, s) ( (x) & (~((s)-1)) )
 
 #define BIT(n) (1 << (n))
+
+namespace ncgc {
+class NTRCard;
+}
+
 namespace flashcart_core {
+/// A stretch of flash.
+struct FlashExtent {
+    uint32_t address;
+    uint32_t length;
+};
+
 class Flashcart {
 public:
     Flashcart(const char* name, const size_t max_length);
     Flashcart(const char* name, const char* short_name, const size_t max_length);
 
-    inline bool initialize(ncgc::NTRCard *card) {
-        m_card = card;
+    /// Runs the driver on an ncgc card; see ncgc_transport.cpp.
+    bool initialize(ncgc::NTRCard *card);
+    /// Runs the driver over any other transport, e.g. a CardReplay or one of host/.
+    inline bool initialize(CardTransport *transport) {
+        m_card.attach(transport);
+        CardPhaseScope phase(m_card, CardPhase::Init);
         return initialize();
     }
     virtual void shutdown() = 0;
@@ -33,19 +47,54 @@ public:
     virtual bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer) = 0;
     virtual bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) = 0;
 
+    /// Backs up the whole flash (getMaxLength() bytes) to `buffer`, but reads only what the
+    /// cart's own ROM => NOR map and configuration say is in use, if the driver knows them.
+    ///
+    /// The parts skipped are filled with 0xFF and listed in `skipped`. If `sampleStride` is
+    /// set, a few bytes every `sampleStride` bytes of each of those are read to check that
+    /// it's blank; a part that isn't is read in full and not listed.
+    bool readUsedFlash(uint8_t *buffer, std::vector<FlashExtent> *skipped, uint32_t sampleStride = 0);
+
     const char *getName() { return m_name; }
     const char *getShortName() { return m_short_name; }
     virtual const char *getAuthor() { return "unknown"; }
     virtual const char *getDescription() { return ""; }
     virtual size_t getMaxLength() { return m_max_length; }
 
+    /// Attaches (or detaches, with nullptr) the counters that card transactions are recorded into.
+    void setStats(CardStats *stats) { m_card.stats(stats); }
+    CardStats *getStats() { return m_card.stats(); }
+    /// Starts (or stops, with nullptr) recording every card call; see card_record.h.
+    bool setRecorder(CardRecorder *recorder) { return m_card.record(recorder); }
+
+    /// Opt-in: looks for faster bus timings for this cart's reads (or reuses the ones saved
+    /// last time through platform::loadData()), and uses them for all later reads.
+    ///
+    /// Returns false if the driver doesn't support it or no faster timing was found.
+    bool tuneBusTiming(bool retune = false);
+
 protected:
     const char* m_name;
     const char* m_short_name;
     const size_t m_max_length;
-    ncgc::NTRCard *m_card;
+    Card m_card;
+
+    template<
+        typename FlashcartClass,
+        unsigned int readSizePower, bool (FlashcartClass::*readFn)(std::uint32_t, std::uint32_t, void *),
+        unsigned int eraseSizePower, bool (FlashcartClass::*eraseFn)(std::uint32_t),
+        unsigned int writeSizePower, bool (FlashcartClass::*writeFn)(std::uint32_t, const void *)
+    > friend class FlashUtil;
 
     virtual bool initialize() = 0;
+
+    /// Lists the parts of the flash in use, for readUsedFlash(); they may overlap and come in
+    /// any order. Returns false if the driver can't tell, and everything is read then.
+    virtual bool getUsedFlash(std::vector<FlashExtent> *used) { return false; }
+
+    /// Fills in a read for tuneBusTiming(), getting the cart ready for it if needed.
+    /// Drivers that support tuning override this, and send their reads with m_card.readFlags().
+    virtual bool getBusTimingProbe(BusTimingProbe *probe) { return false; }
 };
 
 extern std::vector<Flashcart*> *flashcart_list;
@@ -1,18 +1,73 @@
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
 
-#include <ncgcpp/ntrcard.h>
-
 #include "../device.h"
 #include "../flash_util.h"
+#include "../rom_window.h"
 
 namespace flashcart_core {
 using platform::logMessage;
 using platform::showProgress;
 
-class Ace3DSPlus : Flashcart {
+namespace {
+/// ROM reads that get a cart past its anti-anti-piracy (AAP), named after the game whose
+/// flash they came from.
+struct AapSequence {
+    const char *name;
+    uint32_t reads[3];
+};
+
+const AapSequence aapSequences[] = {
+    { "Deep Labyrinth", { 0x10FE00, 0x167400 } },
+    { "Spongebob", { 0x18DE00, 0x198C00, 0x1A0C00 } },
+    { "Alex Rider", { 0x16D400, 0x6B200 } },
+    { "Metroid Prime Hunters", { 0x1159400 /* wtf */, 0xB7400 } },
+};
+constexpr uint8_t aapSequenceCount = sizeof(aapSequences) / sizeof(aapSequences[0]);
+/// Not a sequence: reading through the first 2M, twice if need be.
+constexpr uint8_t aapSweep = aapSequenceCount;
+constexpr uint32_t aapSweepStart = 0x8000;
+constexpr uint32_t aapSweepSpan = 0x200000 - aapSweepStart;
+constexpr uint32_t aapSweepChunk = 0x8000;
+
+/// What got carts past the AAP before, most recent first.
+struct SavedAap {
+    struct Entry {
+        uint32_t version;
+        uint32_t rdid;
+        /// An aapSequences index or aapSweep; 0xFF if the entry is unused.
+        uint8_t sequence;
+        uint8_t reserved[3];
+        /// For aapSweep, how far (over both passes) it had to read.
+        uint32_t sweep_length;
+    };
+
+    uint32_t magic;
+    Entry entries[8];
+};
+constexpr uint32_t savedAapMagic = 0x50414141; // "AAAP"
+}
+
+class Ace3DSPlus : public Flashcart {
+    /// How the AAP was passed during this initialize(), to be saved once the cart's
+    /// version and RDID are known; 0xFF if it wasn't needed.
+    uint8_t m_aap_sequence;
+    uint32_t m_aap_sweep_length;
+
+    /// 4K sector erase opcode, 0 if the chip can't; page program size. From SFDP if the
+    /// flash has it.
+    uint8_t m_erase_opcode;
+    uint32_t m_page_size;
+
+    /// For each NOR page, a ROM page (from 8 up, below is the secure area) that the map
+    /// shows it at, or 0; loaded on the first read.
+    std::vector<uint16_t> m_rom_pages;
+    RomWindow m_rom_window;
+
     /// Gets the cart version (in the high halfword) and status (in the low byte).
     bool cmdVersionStatus(uint32_t *resp) {
-        ncgc::Err r = m_card->sendCommand(0xB0, resp, 4, 0x180000);
+        CardErr r = m_card.sendCommand(0xB0, resp, 4, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdVersionStatus failed: %d", r.errNo());
             return false;
@@ -22,7 +77,7 @@ class Ace3DSPlus : Flashcart {
 
     /// Sets some SD-related register on the card (?)
     bool cmdSdRegister(uint8_t param) {
-        ncgc::Err r = m_card->sendCommand(0xC2ull | (((uint64_t) param) << 32), NULL, 0, 0x180000);
+        CardErr r = m_card.sendCommand(0xC2ull | (((uint64_t) param) << 32), NULL, 0, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdSdRegister failed: %d", r.errNo());
             return false;
@@ -44,7 +99,7 @@ class Ace3DSPlus : Flashcart {
         cmd.u8[6] = z;
         cmd.u8[7] = 0;
 
-        ncgc::Err r = m_card->sendCommand(cmd.u64, nullptr, 0, 0x180000);
+        CardErr r = m_card.sendCommand(cmd.u64, nullptr, 0, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdSdRaw failed: %d", r.errNo());
             return false;
@@ -60,22 +115,28 @@ class Ace3DSPlus : Flashcart {
             if (!cmdSdRaw(x, y, z)) { return false; }
 
             prev_tr = 4;
+            BusyWait wait(m_card, WaitOp::Sd);
             while (1) {
+                if (!wait.poll()) { return false; }
                 if (!cmdVersionStatus(&tr)) { return false; }
                 if (!(tr & 4) && tr == prev_tr) { break; }
                 prev_tr = tr;
             }
+            wait.done();
 
             if (!(z & 8)) {
                 return true;
             }
 
             prev_tr = 8;
+            BusyWait wait_resp(m_card, WaitOp::Sd);
             while (1) {
+                if (!wait_resp.poll()) { return false; }
                 if (!cmdVersionStatus(&tr)) { return false; }
                 if (!(tr & 8) && tr == prev_tr) { break; }
                 prev_tr = tr;
             }
+            wait_resp.done();
 
             if (!(prev_tr & 0x20)) {
                 if (!cmdReadSdBufferPlain(resp)) { return false; }
@@ -91,14 +152,17 @@ class Ace3DSPlus : Flashcart {
     /// which we'll call the card SD buffer.
     bool cmdSdReadSector() {
         // this is supposed to take an address, but it doesn't matter for us
-        ncgc::Err r;
+        CardErr r;
         uint32_t resp = 1;
+        BusyWait wait(m_card, WaitOp::Sd);
         do {
-            if ((r = m_card->sendCommand(0xB9, &resp, 4, 0x180000))) {
+            if (!wait.poll()) { return false; }
+            if ((r = m_card.sendCommand(0xB9, &resp, 4, 0x180000))) {
                 logMessage(LOG_ERR, "Ace3DSPlus: cmdSdReadSector failed: %d", r.errNo());
                 return false;
             }
         } while (resp);
+        wait.done();
         return true;
     }
 
@@ -107,7 +171,7 @@ class Ace3DSPlus : Flashcart {
     ///
     /// We don't care about the result.
     bool cmdReadSdBufferPlain(void *resp = nullptr) {
-        ncgc::Err r = m_card->sendCommand(0xBA, resp, 0x200, 0x180000);
+        CardErr r = m_card.sendCommand(0xBA, resp, 0x200, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdReadSdBufferPlain failed: %d", r.errNo());
             return false;
@@ -120,7 +184,7 @@ class Ace3DSPlus : Flashcart {
     ///
     /// We don't care about the result.
     bool cmdReadSdBufferCrypted() {
-        ncgc::Err r = m_card->sendCommand(0xBF, nullptr, 0x200, 0x180000);
+        CardErr r = m_card.sendCommand(0xBF, nullptr, 0x200, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdReadSdBufferCrypted failed: %d", r.errNo());
             return false;
@@ -131,7 +195,7 @@ class Ace3DSPlus : Flashcart {
     bool cmdEnableFlash() {
         uint32_t bufu32[0x200/4];
         uint8_t *buf = reinterpret_cast<uint8_t *>(bufu32);
-        ncgc::Err r = m_card->sendCommand(0xC6, buf, 0x200, 0x180000);
+        CardErr r = m_card.sendCommand(0xC6, buf, 0x200, 0x180000);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdEnableFlash 0xC6 failed: %d", r.errNo());
             return false;
@@ -172,7 +236,7 @@ class Ace3DSPlus : Flashcart {
             weird_sum = sum_lsl1;
         }
 
-        if((r = m_card->sendWriteCommand(0xC3FF3CA5AA555AC7, buf, 0x200, 0))) {
+        if((r = m_card.sendWriteCommand(0xC3FF3CA5AA555AC7, buf, 0x200, 0))) {
             logMessage(LOG_ERR, "Ace3DSPlus: cmdEnableFlash 0xC7 failed: %d", r.errNo());
             return false;
         }
@@ -182,7 +246,7 @@ class Ace3DSPlus : Flashcart {
 
     bool spiRdid(uint32_t *rdid) {
         static const uint8_t cmd[] = { 0x9F };
-        ncgc::Err r = m_card->sendSpi(cmd, 1, reinterpret_cast<uint8_t *>(rdid), 3);
+        CardErr r = m_card.sendSpi(cmd, 1, reinterpret_cast<uint8_t *>(rdid), 3);
         if (r) {
             logMessage(LOG_ERR, "Ace3DSPlus: spiRdid failed: %d", r.errNo());
             return false;
@@ -192,110 +256,231 @@ class Ace3DSPlus : Flashcart {
         return true;
     }
 
-    bool spiRead(const uint32_t address, const uint32_t size, void *const buf) {
-        uint8_t cmd[] = { 3, 0, 0, 0 };
+    bool spiReadSfdp(const uint32_t address, const uint32_t size, void *const buf) {
+        uint8_t cmd[] = { 0x5A, 0, 0, 0, 0 };
         cmd[1] = (address & 0xFF0000) >> 16;
         cmd[2] = (address & 0xFF00) >> 8;
         cmd[3] = address & 0xFF;
 
-        ncgc::Err r = m_card->sendSpi(cmd, 4, reinterpret_cast<uint8_t *>(buf), size);
+        CardErr r = m_card.sendSpi(cmd, sizeof(cmd), reinterpret_cast<uint8_t *>(buf), size);
         if (r) {
-            logMessage(LOG_ERR, "Ace3DSPlus: spiRead failed: %d", r.errNo());
+            logMessage(LOG_ERR, "Ace3DSPlus: spiReadSfdp failed: %d", r.errNo());
             return false;
         }
         return true;
     }
 
-    bool spiWriteEnable() {
-        static const uint8_t cmd[] = { 0x6 };
-        ncgc::Err r = m_card->sendSpi(cmd, 1, nullptr, 0);
-        if (r) {
-            logMessage(LOG_ERR, "Ace3DSPlus: spiWriteEnable failed: %d", r.errNo());
-            return false;
-        }
-        return true;
+    /// SFDP typical time field (5 bit count, 2 bit unit), in microseconds.
+    static uint32_t sfdpTime(uint32_t field, const uint32_t *units) {
+        return ((field & 0x1F) + 1) * units[(field >> 5) & 3];
     }
 
-    bool spiWaitWrite() {
-        static const uint8_t rdsr[] = { 0x5 };
-        uint8_t sr = 1;
-        do {
-            ncgc::Err r = m_card->sendSpi(rdsr, 1, &sr, 1);
-            if (r) {
-                logMessage(LOG_ERR, "Ace3DSPlus: spiWaitWrite failed: %d", r.errNo());
-                return false;
+    /// Reads the flash's JEDEC basic parameter table, if it has one, and takes the erase
+    /// opcode, page size, typical and max times and density from it.
+    ///
+    /// Returns the density in bytes, or 0 if there's no usable SFDP.
+    uint32_t readSfdp() {
+        uint8_t header[16];
+        if (!spiReadSfdp(0, sizeof(header), header)
+            || std::memcmp(header, "SFDP", 4)
+            // the first parameter header has to be the JEDEC basic table
+            || header[8] != 0x00 || header[15] != 0xFF || header[11] < 9) {
+            logMessage(LOG_INFO, "Ace3DSPlus: no SFDP");
+            return 0;
+        }
+
+        uint32_t dw[16] = {};
+        const uint32_t dwords = std::min<uint32_t>(header[11], 16);
+        const uint32_t table = header[12] | header[13] << 8 | header[14] << 16;
+        if (!spiReadSfdp(table, dwords * 4, dw)) {
+            return 0;
+        }
+
+        // DWORD 2: density in bits, or 2^N bits if the top bit is set
+        if ((dw[1] & 0x80000000) && (dw[1] & 0x7FFFFFFF) > 34) {
+            return 0;
+        }
+        const uint64_t bits = (dw[1] & 0x80000000) ? 1ull << (dw[1] & 0x7FFFFFFF) : dw[1] + 1ull;
+        const uint32_t density = static_cast<uint32_t>(std::min<uint64_t>(bits / 8, 0x80000000u));
+
+        // DWORD 1: 4K erase support and opcode, and the fast read modes (we only ever
+        // get single-bit transfers through the cart, so those are just for the log)
+        m_erase_opcode = (dw[0] & 3) == 1 ? (dw[0] >> 8) & 0xFF : 0;
+        logMessage(LOG_INFO, "Ace3DSPlus: SFDP: %lu bytes, 4K erase %02X, fast reads%s%s%s%s",
+            (unsigned long)density, m_erase_opcode, (dw[0] & (1 << 16)) ? " 1-1-2" : "",
+            (dw[0] & (1 << 20)) ? " 1-2-2" : "", (dw[0] & (1 << 21)) ? " 1-4-4" : "",
+            (dw[0] & (1 << 22)) ? " 1-1-4" : "");
+
+        // JESD216 rev A and later: erase times (DWORD 10), page size and program time (11)
+        if (dwords >= 11) {
+            static const uint32_t eraseUnits[] = { 1000, 16000, 128000, 1000000 };
+
+            // DWORDs 8 and 9 list the erase types; find the 4K one's time
+            for (unsigned int i = 0; i < 4; ++i) {
+                const uint32_t type = (dw[7 + i / 2] >> ((i & 1) * 16)) & 0xFFFF;
+                if ((type & 0xFF) == 12 && (type >> 8) == m_erase_opcode) {
+                    const uint32_t typical = sfdpTime(dw[9] >> (4 + i * 7), eraseUnits);
+                    m_card.waitTiming(WaitOp::Erase, typical, typical * 2 * ((dw[9] & 0xF) + 1));
+                    break;
+                }
             }
-        } while (sr & 1);
 
-        return true;
+            // the page program time has a 1-bit unit (8 or 64us) at bit 13
+            const uint32_t typical = ((dw[10] >> 8 & 0x1F) + 1) * ((dw[10] >> 13 & 1) ? 64 : 8);
+            m_card.waitTiming(WaitOp::Program, typical, typical * 2 * ((dw[10] & 0xF) + 1));
+            m_page_size = std::min<uint32_t>(1 << ((dw[10] >> 4) & 0xF), 256);
+        }
+
+        return density;
     }
 
-    bool spiSectorErase(uint32_t address) {
-        uint8_t cmd[] = { 0x20, 0, 0, 0 };
+    bool spiRead(const uint32_t address, const uint32_t size, void *const buf) {
+        uint8_t cmd[] = { 3, 0, 0, 0 };
         cmd[1] = (address & 0xFF0000) >> 16;
         cmd[2] = (address & 0xFF00) >> 8;
         cmd[3] = address & 0xFF;
 
-        ncgc::Err r = m_card->sendSpi(cmd, 4, nullptr, 0);
+        CardErr r = m_card.sendSpi(cmd, 4, reinterpret_cast<uint8_t *>(buf), size);
         if (r) {
-            logMessage(LOG_ERR, "Ace3DSPlus: spiSectorErase failed: %d", r.errNo());
+            logMessage(LOG_ERR, "Ace3DSPlus: spiRead failed: %d", r.errNo());
             return false;
         }
-
         return true;
     }
 
-    bool spiPageProgram(uint32_t address, const void *src) {
-        uint8_t cmd[256 + 4] = { 0 };
-        cmd[0] = 2;
-        cmd[1] = (address & 0xFF0000) >> 16;
-        cmd[2] = (address & 0xFF00) >> 8;
-        cmd[3] = address & 0xFF;
-        std::memcpy(cmd + 4, src, 256);
+    bool flashUtilErase(std::uint32_t addr) {
+        if (!m_erase_opcode) {
+            logMessage(LOG_ERR, "Ace3DSPlus: flash has no 4K erase");
+            return false;
+        }
+        uint8_t cmd[] = { m_erase_opcode, 0, 0, 0 };
+        cmd[1] = (addr & 0xFF0000) >> 16;
+        cmd[2] = (addr & 0xFF00) >> 8;
+        cmd[3] = addr & 0xFF;
 
-        ncgc::Err r = m_card->sendSpi(cmd, sizeof(cmd), nullptr, 0);
+        CardBatchEntry entries[3];
+        CardBatch batch(entries);
+        batch.spiNorWrite(WaitOp::Erase, cmd, sizeof(cmd));
+        CardErr r = m_card.submit(batch);
         if (r) {
-            logMessage(LOG_ERR, "Ace3DSPlus: spiPageProgram failed: %d", r.errNo());
+            logMessage(LOG_ERR, "Ace3DSPlus: flashUtilErase failed: %d", r.errNo());
             return false;
         }
+        return true;
+    }
 
+    /// Inverts the ROM => NOR map at 0x0-0x4000 (the one in use once the AAP is passed) into
+    /// m_rom_pages.
+    bool loadRomMap() {
+        uint8_t *map = static_cast<uint8_t *>(std::malloc(0x4000));
+        if (!map) {
+            logMessage(LOG_ERR, "malloc failed");
+            return false;
+        }
+        if (!spiRead(0, 0x4000, map)) {
+            std::free(map);
+            return false;
+        }
+
+        m_rom_pages.assign(getMaxLength() >> 12, 0);
+        for (uint32_t rom = 8; rom < 0x2000; ++rom) {
+            const uint32_t page = map[rom * 2] | map[rom * 2 + 1] << 8;
+            if (page < m_rom_pages.size() && !m_rom_pages[page]) {
+                m_rom_pages[page] = rom;
+            }
+        }
+        std::free(map);
         return true;
     }
 
-    bool flashUtilErase(std::uint32_t addr) {
-        return spiWriteEnable()
-            && spiSectorErase(addr)
-            && spiWaitWrite();
+    /// Whether the block at `address` can be read through the ROM window, and where ROM
+    /// shows it.
+    bool romAddress(uint32_t address, uint32_t size, uint32_t *rom) {
+        const uint32_t page = address >> 12;
+        if ((address & (RomWindow::blockSize - 1)) || size < RomWindow::blockSize || m_rom_window.unusable()
+            || page >= m_rom_pages.size() || !m_rom_pages[page]) {
+            return false;
+        }
+        *rom = m_rom_pages[page] << 12 | (address & 0xFFF);
+        return true;
+    }
+
+    /// Reads through the ROM window the blocks the map shows in ROM, and with spiRead() the
+    /// rest (or everything, if the window doesn't work).
+    bool flashUtilRead(uint32_t address, uint32_t size, void *dest) {
+        if (m_rom_window.unusable()) {
+            return spiRead(address, size, dest);
+        }
+        if (m_rom_pages.empty() && !loadRomMap()) {
+            return false;
+        }
+
+        uint8_t *p = static_cast<uint8_t *>(dest);
+        while (size) {
+            uint32_t rom, n;
+            if (romAddress(address, size, &rom)) {
+                n = RomWindow::blockSize;
+                if (!m_rom_window.read(m_card, rom, p)) {
+                    if (!spiRead(address, n, p)) {
+                        return false;
+                    }
+                    m_rom_window.check(m_card, rom, p);
+                }
+            } else {
+                // everything up to the next block the window can do, in one go
+                n = std::min(RomWindow::blockSize - (address & (RomWindow::blockSize - 1)), size);
+                while (n < size && !romAddress(address + n, size - n, &rom)) {
+                    n += std::min(RomWindow::blockSize, size - n);
+                }
+                if (!spiRead(address, n, p)) {
+                    return false;
+                }
+            }
+            address += n;
+            p += n;
+            size -= n;
+        }
+        return true;
     }
 
+    /// Programs 256 bytes, as one page or as several if the flash's pages are smaller.
     bool flashUtilPageProgram(std::uint32_t addr, const void *src) {
-        return spiWriteEnable()
-            && spiPageProgram(addr, src)
-            && spiWaitWrite();
+        for (uint32_t ofs = 0; ofs < 256; ofs += m_page_size) {
+            const uint32_t page = addr + ofs;
+            const uint8_t cmd[] = {
+                2, static_cast<uint8_t>(page >> 16), static_cast<uint8_t>(page >> 8), static_cast<uint8_t>(page)
+            };
+
+            CardBatchEntry entries[3];
+            CardBatch batch(entries);
+            batch.spiNorWrite(WaitOp::Program, cmd, sizeof(cmd), static_cast<const uint8_t *>(src) + ofs, m_page_size);
+            CardErr r = m_card.submit(batch);
+            if (r) {
+                logMessage(LOG_ERR, "Ace3DSPlus: flashUtilPageProgram failed: %d", r.errNo());
+                return false;
+            }
+        }
+        return true;
     }
 
     bool tryBlowfishKey(BlowfishKey key) {
-        ncgc::Err err = m_card->init();
+        CardErr err = m_card.init();
         if (err && !err.unsupported()) {
             logMessage(LOG_ERR, "Ace3DSPlus: tryBlowfishKey: ntrcard init failed");
             return false;
-        } else if (m_card->state() != ncgc::NTRState::Raw) {
+        } else if (m_card.state() != CardState::Raw) {
             logMessage(LOG_ERR, "Ace3DSPlus: tryBlowfishKey: status (%d) not RAW and cannot reset",
-                static_cast<uint32_t>(m_card->state()));
+                static_cast<uint32_t>(m_card.state()));
             return false;
         }
 
-        ncgc::c::ncgc_ncard_t& state = m_card->rawState();
-        state.hdr.key1_romcnt = state.key1.romcnt = 0x1808F8;
-        state.hdr.key2_romcnt = state.key2.romcnt = 0x416017;
-        state.key2.seed_byte = 0;
-        m_card->setBlowfishState(platform::getBlowfishKey(key), key != BlowfishKey::NTR);
+        const CardSecureParams params = { key, 0x1808F8, 0x416017, 0 };
 
-        if ((err = m_card->beginKey1())) {
+        if ((err = m_card.beginKey1(params))) {
             logMessage(LOG_ERR, "Ace3DSPlus: tryBlowfishKey: init key1 (key = %d) failed: %d", static_cast<int>(key), err.errNo());
             return false;
         }
-        if ((err = m_card->beginKey2())) {
+        if ((err = m_card.beginKey2())) {
             logMessage(LOG_ERR, "Ace3DSPlus: tryBlowfishKey: init key2 failed: %d", err.errNo());
             return false;
         }
@@ -380,57 +565,128 @@ class Ace3DSPlus : Flashcart {
     }
 
     void aapReadData(uint32_t addr) {
-        ncgc::Err err;
-        if ((err = m_card->readData(addr, nullptr, 0x200))) {
+        CardErr err;
+        if ((err = m_card.readData(addr, nullptr, 0x200))) {
             logMessage(LOG_INFO, "Ace3DSPlus: readData failed: %d", err.errNo());
         }
     }
 
+    bool runAapSequence(uint8_t sequence) {
+        for (uint32_t addr : aapSequences[sequence].reads) {
+            if (addr) {
+                aapReadData(addr);
+            }
+        }
+        return tryPollVersion();
+    }
+
+    /// Reads through the sweep range (over twice if need be) from `from` bytes in up to
+    /// `length`. If `check` is set, the version is checked after each chunk, and the sweep
+    /// stops (with `length` set to where) as soon as the cart unlocks.
+    bool runAapSweep(uint32_t from, uint32_t *length, bool check) {
+        for (uint32_t done = from; done < *length && done < aapSweepSpan * 2; done += aapSweepChunk) {
+            CardErr err;
+            if ((err = m_card.readData(aapSweepStart + done % aapSweepSpan, nullptr, aapSweepChunk))) {
+                logMessage(LOG_INFO, "Ace3DSPlus: readData failed: %d", err.errNo());
+                return false;
+            }
+
+            uint32_t resp;
+            if (check && cmdVersionStatus(&resp) && resp != 0 && resp != 0xFFFFFFFF) {
+                *length = done + aapSweepChunk;
+                return true;
+            }
+        }
+        return tryPollVersion();
+    }
+
     bool passAntiAntiPiracy() {
-        // Deep Labyrinth flash
-        aapReadData(0x10FE00);
-        aapReadData(0x167400);
-        if (tryPollVersion()) {
-            return true;
+        char name[64];
+        std::snprintf(name, sizeof(name), "%s.aap", m_short_name);
+        SavedAap saved;
+        if (!platform::loadData(name, &saved, sizeof(saved)) || saved.magic != savedAapMagic) {
+            std::memset(&saved, 0xFF, sizeof(saved));
+        }
+
+        // sequences that worked before go first, on their own; then all of them again in
+        // the usual order, as a sequence may only have worked after the reads of the ones
+        // before it. The (much longer) sweep only after all of them
+        uint8_t order[aapSequenceCount * 2];
+        uint8_t count = 0;
+        uint32_t sweep_length = 0;
+        for (const SavedAap::Entry &entry : saved.entries) {
+            if (entry.sequence == aapSweep && !sweep_length) {
+                sweep_length = std::min(entry.sweep_length, aapSweepSpan * 2);
+            } else if (entry.sequence < aapSequenceCount
+                       && std::find(order, order + count, entry.sequence) == order + count) {
+                order[count++] = entry.sequence;
+            }
+        }
+        for (uint8_t i = 0; i < aapSequenceCount; ++i) {
+            order[count++] = i;
         }
 
-        // Spongebob flash
-        aapReadData(0x18DE00);
-        aapReadData(0x198C00);
-        aapReadData(0x1A0C00);
-        if (tryPollVersion()) {
-            return true;
+        for (uint8_t i = 0; i < count; ++i) {
+            if (runAapSequence(order[i])) {
+                logMessage(LOG_INFO, "Ace3DSPlus: passed AAP with the %s sequence", aapSequences[order[i]].name);
+                m_aap_sequence = order[i];
+                return true;
+            }
         }
 
-        // Alex Rider flash
-        aapReadData(0x16D400);
-        aapReadData(0x6B200);
-        if (tryPollVersion()) {
+        logMessage(LOG_INFO, "Ace3DSPlus: known AAP sequences failed");
+        // last ditch attempt: sweep the first 2M (twice if need be) and see where it
+        // starts working (this works for the Deep Labyrinth flash); as far as it took last
+        // time in one go, then on from there a chunk at a time
+        m_aap_sequence = aapSweep;
+        m_aap_sweep_length = sweep_length;
+        if (sweep_length && runAapSweep(0, &m_aap_sweep_length, false)) {
+            logMessage(LOG_INFO, "Ace3DSPlus: passed AAP with the saved sweep");
             return true;
         }
-
-        // Metroid Prime Hunters flash
-        aapReadData(0x1159400); // wtf
-        aapReadData(0xB7400);
-        if (tryPollVersion()) {
+        m_aap_sweep_length = aapSweepSpan * 2;
+        if (runAapSweep(sweep_length, &m_aap_sweep_length, true)) {
+            logMessage(LOG_INFO, "Ace3DSPlus: passed AAP after sweeping 0x%lX bytes", m_aap_sweep_length);
             return true;
         }
+        m_aap_sequence = 0xFF;
+        return false;
+    }
+
+    /// Puts how the AAP was passed this time at the front of the saved list.
+    void saveAap(uint32_t version, uint32_t rdid) {
+        if (m_aap_sequence == 0xFF) {
+            return;
+        }
 
-        logMessage(LOG_INFO, "Ace3DSPlus: known AAP sequences failed");
-        // last ditch attempt (sweep the first 2M and see if it works)
-        // (this works for the Deep Labyrinth flash)
-        ncgc::Err err;
-        if ((err = m_card->readData(0x8000, nullptr, 0x200000 - 0x8000))
-            || (err = m_card->readData(0x8000, nullptr, 0x200000 - 0x8000))) {
-            logMessage(LOG_INFO, "Ace3DSPlus: readData failed: %d", err.errNo());
+        char name[64];
+        std::snprintf(name, sizeof(name), "%s.aap", m_short_name);
+        SavedAap saved;
+        if (!platform::loadData(name, &saved, sizeof(saved)) || saved.magic != savedAapMagic) {
+            std::memset(&saved, 0xFF, sizeof(saved));
         }
-        return tryPollVersion();
+
+        const unsigned int count = sizeof(saved.entries) / sizeof(saved.entries[0]);
+        unsigned int i = 0;
+        while (i < count - 1 && !(saved.entries[i].version == version && saved.entries[i].rdid == rdid)) {
+            ++i;
+        }
+        std::memmove(saved.entries + 1, saved.entries, i * sizeof(saved.entries[0]));
+
+        SavedAap::Entry &entry = saved.entries[0];
+        std::memset(&entry, 0, sizeof(entry));
+        entry.version = version;
+        entry.rdid = rdid;
+        entry.sequence = m_aap_sequence;
+        entry.sweep_length = m_aap_sequence == aapSweep ? m_aap_sweep_length : 0;
+        saved.magic = savedAapMagic;
+        platform::saveData(name, &saved, sizeof(saved));
     }
 
-    using Util = FlashUtil<Ace3DSPlus, 0, &Ace3DSPlus::spiRead, 12, &Ace3DSPlus::flashUtilErase, 8, &Ace3DSPlus::flashUtilPageProgram>;
+    using Util = FlashUtil<Ace3DSPlus, 0, &Ace3DSPlus::flashUtilRead, 12, &Ace3DSPlus::flashUtilErase, 8, &Ace3DSPlus::flashUtilPageProgram>;
 
 public:
-    Ace3DSPlus() : Flashcart("Ace3DS+", "Ace3DSPlus", 0x200000) { }
+    Ace3DSPlus() : Flashcart("Ace3DS+", "Ace3DSPlus", 0x200000), m_rom_window("Ace3DSPlus") { }
 
     const char* getAuthor() {
         return "ntrteam, et al.";
@@ -446,8 +702,11 @@ public:
 
     bool initialize() {
         uint32_t resp;
-        ncgc::Err err;
-        bool initFromRaw = m_card->state() != ncgc::NTRState::Key2;
+        CardErr err;
+        bool initFromRaw = m_card.state() != CardState::Key2;
+        m_aap_sequence = 0xFF;
+        m_rom_pages.clear();
+        m_rom_window.reset();
 
         if (initFromRaw
             && !tryBlowfishKey(BlowfishKey::NTR)
@@ -478,6 +737,9 @@ public:
         }
 
         logMessage(LOG_INFO, "Ace3DSPlus version: %08lX", resp);
+        // SPI NOR: 4K sector erase, 256-byte page program, until SFDP says otherwise
+        m_card.waitTiming(WaitOp::Erase, 45000, 2000000);
+        m_card.waitTiming(WaitOp::Program, 700, 10000);
 
         uint32_t rdid;
         if (!spiRdid(&rdid)) {
@@ -502,17 +764,25 @@ public:
             return false;
         }
 
+        m_erase_opcode = 0x20;
+        m_page_size = 256;
+        const uint32_t density = readSfdp();
         switch ((rdid & 0xFF0000) >> 16) {
             case 0x14:
             case 0x15:
             case 0x16:
                 break;
             default:
+                // a capacity code we don't know is fine if SFDP says the chip is big enough
+                if (density >= 0x100000) {
+                    break;
+                }
                 logMessage(LOG_ERR, "Ace3DSPlus: unexpected flash capacity in RDID: %06lX", rdid);
                 return false;
         }
 
         logMessage(LOG_INFO, "Ace3DSPlus RDID: %06lX", rdid);
+        saveAap(resp, rdid);
 
         return true;
     }
@@ -524,9 +794,39 @@ public:
     }
 
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer) {
+        if (address < 0x4000) {
+            m_rom_window.disable();
+        }
         return Util::write(this, address, length, buffer, true);
     }
 
+    /// The configuration (both maps, the Blowfish key and the version info, see
+    /// injectNtrBoot()) and every NOR page either map points a ROM page at.
+    bool getUsedFlash(std::vector<FlashExtent> *used) {
+        uint8_t *maps = static_cast<uint8_t *>(std::malloc(0x8000));
+        if (!maps) {
+            logMessage(LOG_ERR, "malloc failed");
+            return false;
+        }
+        if (!Util::read(this, 0, 0x8000, maps)) {
+            std::free(maps);
+            return false;
+        }
+
+        used->push_back(FlashExtent{0, PAGE_ROUND_UP(0x9100, 0x1000)});
+        const uint32_t pages = static_cast<uint32_t>(getMaxLength() >> 12);
+        std::vector<bool> mapped(pages);
+        for (uint32_t i = 0; i < 0x8000; i += 2) {
+            const uint32_t page = maps[i] | maps[i + 1] << 8;
+            if (page < pages && !mapped[page]) {
+                mapped[page] = true;
+                used->push_back(FlashExtent{page << 12, 0x1000});
+            }
+        }
+        std::free(maps);
+        return true;
+    }
+
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) {
         if (firm_size > 0x1F5200 /* 0x200000 - 0xAE00 */) {
             logMessage(LOG_NOTICE, "FIRM too big; maximum size is 2052608 bytes");
@@ -581,6 +881,7 @@ public:
             std::memcpy(configBfKey + 0x1000 + (0x11 - i)*4, blowfish_key + i*4, 4);
         }
 
+        m_rom_window.disable();
         bool result = Util::write(this, 0, 0x9100, configPage, true, "Writing configuration")
             && Util::write(this, 0xAE00, firm_size, firm, true, "Writing FIRM");
         std::free(configPage);
@@ -1,4 +1,5 @@
 #include "../device.h"
+#include "../flash_util.h"
 
 #include <stdlib.h>
 #include <cstring>
@@ -7,7 +8,7 @@ namespace flashcart_core {
 using platform::logMessage;
 using platform::showProgress;
 
-class AK2i : Flashcart {
+class AK2i : public Flashcart {
 protected:
     static const uint8_t ak2i_cmdWaitFlashBusy[8];
     static const uint8_t ak2i_cmdGetHWRevision[8];
@@ -26,20 +27,29 @@ protected:
     static const uint32_t page_size = 0x10000;
 
     uint32_t m_ak2i_hwrevision;
+    /// Whether the cart is set up for reads (flash locked) rather than erases and programs.
+    bool m_reading;
 
-    void a2ki_wait_flash_busy() {
+    bool a2ki_wait_flash_busy(WaitOp op) {
         uint32_t state;
+        BusyWait wait(m_card, op);
         do {
             // I've been trying to get down to the bottom of this delay for a while
             // hopefully soon it will no longer be needed.
             // ioDelay( 16 * 10 );
-            m_card->sendCommand(ak2i_cmdWaitFlashBusy, &state, 4, 4);
+            if (!wait.poll()) {
+                return false;
+            }
+            m_card.sendCommand(ak2i_cmdWaitFlashBusy, &state, 4, 4);
             logMessage(LOG_DEBUG, "AK2i: waitFlashBusy = 0x%08x", state);
         } while ((state & 1) != 0);
+        wait.done();
+        return true;
     }
 
-    void a2ki_read(uint8_t *outbuf, uint32_t address) {
+    bool a2ki_read(uint8_t *outbuf, uint32_t address) {
         uint8_t cmdbuf[8] = {0};
+        CardPhaseScope phase(m_card, CardPhase::Read);
         logMessage(LOG_DEBUG, "AK2i: read(0x%08x)", address);
         memcpy(cmdbuf, ak2i_cmdReadFlash, 8);
         cmdbuf[1] = (address >> 24) & 0xFF;
@@ -47,12 +57,13 @@ protected:
         cmdbuf[3] = (address >>  8) & 0xFF;
         cmdbuf[4] = (address >>  0) & 0xFF;
 
-        m_card->sendCommand(cmdbuf, outbuf, 0x200, 2);
         // a2ki_wait_flash_busy();
+        return !m_card.sendCommand(cmdbuf, outbuf, 0x200, m_card.readFlags(2));
     }
 
-    void a2ki_erase(uint32_t address) {
+    bool a2ki_erase(uint32_t address) {
         uint8_t cmdbuf[8] = {0};
+        CardPhaseScope phase(m_card, CardPhase::Erase);
 
         logMessage(LOG_DEBUG, "AK2i: erase(0x%08x)", address);
         if (m_ak2i_hwrevision == 0x44444444)
@@ -69,12 +80,13 @@ protected:
         cmdbuf[2] = (address >>  8) & 0xFF;
         cmdbuf[3] = (address >>  0) & 0xFF;
 
-        m_card->sendCommand(cmdbuf, nullptr, 0, (m_ak2i_hwrevision == 0x81818181) ? 20 : 0 );
-        a2ki_wait_flash_busy();
+        m_card.sendCommand(cmdbuf, nullptr, 0, (m_ak2i_hwrevision == 0x81818181) ? 20 : 0 );
+        return a2ki_wait_flash_busy(WaitOp::Erase);
     }
 
-    void a2ki_writebyte(uint32_t address, uint8_t value) {
+    bool a2ki_writebyte(uint32_t address, uint8_t value) {
         uint8_t cmdbuf[8] = {0};
+        CardPhaseScope phase(m_card, CardPhase::Program);
 
         logMessage(LOG_DEBUG, "AK2i: write(0x%08x) = 0x%02x", address, value);
         if (m_ak2i_hwrevision == 0x44444444)
@@ -92,12 +104,62 @@ protected:
         cmdbuf[3] = (address >>  0) & 0xFF;
         cmdbuf[4] = value;
 
-        m_card->sendCommand(cmdbuf, nullptr, 0, 20);
-        a2ki_wait_flash_busy();
+        m_card.sendCommand(cmdbuf, nullptr, 0, 20);
+        return a2ki_wait_flash_busy(WaitOp::Program);
+    }
+
+    void a2ki_prepare_read() {
+        m_card.sendCommand(ak2i_cmdLockFlash, nullptr, 0, 0);
+
+        if (m_ak2i_hwrevision == 0x81818181) m_card.sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
+        m_card.sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
+        m_reading = true;
+    }
+
+    void a2ki_prepare_write() {
+        m_card.sendCommand(ak2i_cmdUnlockFlash, nullptr, 0, 0);
+        m_card.sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
+
+        if (m_ak2i_hwrevision == 0x81818181) m_card.sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
+        m_card.sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
+        m_reading = false;
+    }
+
+    // FlashUtil reads a page before deciding whether to touch it, so these switch
+    // between read and write setup as needed
+    bool flashUtilRead(uint32_t address, uint32_t size, void *dest) {
+        if (!m_reading) {
+            a2ki_prepare_read();
+        }
+        return a2ki_read(static_cast<uint8_t *>(dest), address);
+    }
+
+    bool flashUtilErase(uint32_t address) {
+        if (m_reading) {
+            a2ki_prepare_write();
+        }
+        return a2ki_erase(address);
+    }
+
+    bool flashUtilProgram(uint32_t address, const void *src) {
+        if (m_reading) {
+            a2ki_prepare_write();
+        }
+        return a2ki_writebyte(address, *static_cast<const uint8_t *>(src));
+    }
+
+    using Util = FlashUtil<AK2i, 9, &AK2i::flashUtilRead, 16, &AK2i::flashUtilErase, 0, &AK2i::flashUtilProgram>;
+
+    bool getBusTimingProbe(BusTimingProbe *probe) {
+        a2ki_prepare_read();
+        memcpy(probe->cmd, ak2i_cmdReadFlash, 8);
+        probe->size = 0x200;
+        probe->flags = 2;
+        return true;
     }
 
 public:
-    AK2i() : Flashcart("Acekard 2i", "ak2i", 0x200000) { }
+    AK2i() : Flashcart("Acekard 2i", "ak2i", 0x200000), m_reading(false) { }
 
     const char *getAuthor() { return "Kitlith + Normmatt"; }
     const char *getDescription() { return "Works with the following carts:\n * Acekard 2i HW-44\n * Acekard 2i HW-81\n * R4i Ultra (r4ultra.com)"; }
@@ -112,22 +174,25 @@ public:
     bool initialize()
     {
         logMessage(LOG_INFO, "AK2i: Init");
-        m_card->sendCommand(ak2i_cmdGetHWRevision, &m_ak2i_hwrevision, 4, 0);
+        m_card.sendCommand(ak2i_cmdGetHWRevision, &m_ak2i_hwrevision, 4, 0);
         logMessage(LOG_NOTICE, "AK2i: HW Revision = %08x", m_ak2i_hwrevision);
+        // 64K sectors
+        m_card.waitTiming(WaitOp::Erase, 500000, 15000000);
+        m_reading = false;
 
         if (m_ak2i_hwrevision == 0x44444444)
         {
-            m_card->sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
-            m_card->sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 0);
-            m_card->sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
+            m_card.sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
+            m_card.sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 0);
+            m_card.sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
         }
         else if (m_ak2i_hwrevision == 0x81818181)
         {
-            m_card->sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
-            m_card->sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 0);
-            m_card->sendCommand(ak2i_cmdUnlockFlash, nullptr, 0, 0);
-            m_card->sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
-            m_card->sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
+            m_card.sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
+            m_card.sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 0);
+            m_card.sendCommand(ak2i_cmdUnlockFlash, nullptr, 0, 0);
+            m_card.sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
+            m_card.sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
         } else {
             return false;
         }
@@ -138,47 +203,21 @@ public:
     void shutdown()
     {
         logMessage(LOG_INFO, "AK2i: Shutdown");
-        m_card->sendCommand(ak2i_cmdLockFlash, nullptr, 0, 0);
-        m_card->sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
-        m_card->sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 4);
+        m_card.sendCommand(ak2i_cmdLockFlash, nullptr, 0, 0);
+        m_card.sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
+        m_card.sendCommand(ak2i_cmdActiveFatMap, nullptr, 4, 4);
     }
 
     bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer)
     {
         logMessage(LOG_INFO, "AK2i: readFlash(addr=0x%08x, size=0x%x)", address, length);
-        m_card->sendCommand(ak2i_cmdLockFlash, nullptr, 0, 0);
-
-        if (m_ak2i_hwrevision == 0x81818181) m_card->sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
-        m_card->sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
-
-        for (uint32_t curpos=0; curpos < length; curpos+=0x200) {
-            a2ki_read(buffer + curpos, address + curpos);
-            showProgress(curpos+1,length, "Reading");
-        }
-
-        return true;
+        return Util::read(this, address, length, buffer, true);
     }
 
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer)
     {
         logMessage(LOG_INFO, "AK2i: writeFlash(addr=0x%08x, size=0x%x)", address, length);
-        m_card->sendCommand(ak2i_cmdUnlockFlash, nullptr, 0, 0);
-        m_card->sendCommand(ak2i_cmdUnlockASIC, nullptr, 0, 0);
-
-        if (m_ak2i_hwrevision == 0x81818181) m_card->sendCommand(ak2i_cmdSetFlash1681_81, nullptr, 0, 20);
-        m_card->sendCommand(ak2i_cmdSetMapTableAddress, nullptr, 0, 0);
-
-        for (uint32_t addr=0; addr < length; addr+=page_size)
-        {
-            a2ki_erase(address + addr);
-
-            for (uint32_t i=0; i < page_size; i++) {
-                a2ki_writebyte(address + addr + i, buffer[addr + i]);
-                showProgress(addr+i+1,length, "Writing");
-            }
-        }
-
-        return true;
+        return Util::write(this, address, length, buffer, true);
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size)
@@ -193,20 +232,29 @@ public:
 
         uint32_t buf_size = PAGE_ROUND_UP(firm_offset + firm_size, page_size);
         uint8_t *buf = (uint8_t *)calloc(buf_size, sizeof(uint8_t));
+        if (!buf) {
+            logMessage(LOG_ERR, "AK2i: calloc failed");
+            return false;
+        }
 
         logMessage(LOG_INFO, "AK2i: Injecting Ntrboot");
-        readFlash(blowfish_adr, buf_size, buf); // Read in data that shouldn't be changed
+        // Read in data that shouldn't be changed
+        if (!readFlash(blowfish_adr, buf_size, buf)) {
+            free(buf);
+            return false;
+        }
         memcpy(buf, blowfish_key, 0x1048);
         memcpy(buf + firm_offset, firm, firm_size);
 
         uint8_t chipid_and_length[8] = {0x00, 0x00, 0x0F, 0xC2, 0x00, 0xB4, 0x17, 0x00};
         memcpy(buf + chipid_offset, chipid_and_length, 8);
 
-        writeFlash(blowfish_adr, buf_size, buf);
+        // only the pages that actually change get erased and programmed
+        bool ok = writeFlash(blowfish_adr, buf_size, buf);
 
         free(buf);
 
-        return true;
+        return ok;
     }
 };
 
@@ -10,6 +10,10 @@ Actual implementation code starts past line 100.
 Flash chips are all identified by the following command sequence:
     0x555:0xAA, 0x2AA:0x55, 0x555:0x90
 
+Chips that answer a CFI query (0xAA or 0x55:0x98) take their erase block layout and
+timings from it rather than from the tables below, and chips missing from the lists
+are used as well if they describe themselves that way.
+
 Supported Chips using the same standard of command definitons (type A):
     Sector Block Addressing = 16KB,8KB,8KB,32KB,64KB,64KB,64KB... (unless otherwise specified)
 
@@ -95,6 +99,7 @@ Known flashchips that are "unsupported":
 #include "../device.h"
 
 #include <stdlib.h>
+#include <algorithm>
 #include <cstring>
 
 namespace flashcart_core {
@@ -111,6 +116,10 @@ const uint16_t supported_flashchips[] = {
     0x9689, 0x9789
 };
 
+const uint32_t dstt_flags = 0xa7180000;
+// after an erase, one word in this many bytes is read back to check the block is blank
+const uint32_t dstt_blank_check_stride = 0x400;
+
 // Header: TOP TF/SD DSTTDS
 // Device ID: 0xFC2
 // Sector Size: 0x2000
@@ -123,24 +132,43 @@ private:
         DSTT_CMD_TYPE_2
     } m_cmd_type;
 
-    uint32_t dstt_flash_command(uint8_t data0, uint32_t data1, uint16_t data2)
+    /// Whether the chip takes AMD unlock bypass (AA/55/20), and whether it's in it now.
+    bool m_unlock_bypass;
+    bool m_bypassed;
+    /// Whether the chip takes more sector addresses after a sector erase command.
+    bool m_multi_erase;
+    /// Erase block sizes from the chip's CFI data; empty if it has none.
+    std::vector<uint32_t> m_cfi_blocks;
+    /// Largest buffered write, from CFI; 0 if the chip can't do them (or has no CFI).
+    uint32_t m_write_buffer;
+
+    static uint64_t dstt_cmd(uint8_t data0, uint32_t data1, uint16_t data2)
     {
-        uint8_t cmd[8];
-        cmd[0] = data0;
-        cmd[1] = (uint8_t)((data1 >> 24)&0xFF);
-        cmd[2] = (uint8_t)((data1 >> 16)&0xFF);
-        cmd[3] = (uint8_t)((data1 >>  8)&0xFF);
-        cmd[4] = (uint8_t)((data1 >>  0)&0xFF);
-        cmd[5] = (uint8_t)((data2 >>  8)&0xFF);
-        cmd[6] = (uint8_t)((data2 >>  0)&0xFF);
-        cmd[7] = 0x00;
+        // data1 and data2 go out big-endian
+        return static_cast<uint64_t>(data0)
+            | static_cast<uint64_t>((data1 >> 24) & 0xFF) << 8
+            | static_cast<uint64_t>((data1 >> 16) & 0xFF) << 16
+            | static_cast<uint64_t>((data1 >>  8) & 0xFF) << 24
+            | static_cast<uint64_t>((data1 >>  0) & 0xFF) << 32
+            | static_cast<uint64_t>((data2 >>  8) & 0xFF) << 40
+            | static_cast<uint64_t>((data2 >>  0) & 0xFF) << 48;
+    }
 
+    uint32_t dstt_flash_command(uint8_t data0, uint32_t data1, uint16_t data2)
+    {
         uint32_t ret;
 
-        m_card->sendCommand(cmd, (uint8_t*)&ret, 4, 0xa7180000);
+        // only plain reads (0x00) go faster with a tuned timing
+        m_card.sendCommand(dstt_cmd(data0, data1, data2), (uint8_t*)&ret, 4, data0 ? dstt_flags : m_card.readFlags(dstt_flags));
         return ret;
     }
 
+    /// Adds a flash command to `batch`; the response is thrown away.
+    static void dstt_batch_command(CardBatch &batch, uint8_t data0, uint32_t data1, uint16_t data2)
+    {
+        batch.command(dstt_cmd(data0, data1, data2), nullptr, 4, dstt_flags);
+    }
+
     void dstt_reset()
     {
         logMessage(LOG_DEBUG, "DSTT: Reset");
@@ -177,6 +205,97 @@ private:
         return flashchip;
     }
 
+    /// Asks the chip for its CFI data and takes the erase block layout and the erase and
+    /// program times from it.
+    ///
+    /// Returns the primary command set (1 or 3 Intel, 2 AMD), or 0 if the chip didn't
+    /// answer with one of those.
+    uint16_t Query_Cfi()
+    {
+        // byte mode AMD chips take the query at AA, x8 only ones at 55, Intel ones anywhere;
+        // the answer is at every byte, or every other byte on chips that also do x16
+        uint8_t cfi[0xC0];
+        unsigned int stride = 0;
+        for (uint32_t query: {0xAA, 0x55}) {
+            dstt_flash_command(0x87, query, 0x98);
+            for (uint32_t i = 0; i < sizeof(cfi); i += 4) {
+                uint32_t word = dstt_flash_command(0, i, 0);
+                memcpy(cfi + i, &word, 4);
+            }
+            for (unsigned int s = 1; s <= 2 && !stride; ++s) {
+                if (cfi[0x10 * s] == 'Q' && cfi[0x11 * s] == 'R' && cfi[0x12 * s] == 'Y') {
+                    stride = s;
+                }
+            }
+            if (stride) {
+                break;
+            }
+        }
+        if (!stride) {
+            // the chip may still have taken the query, and we don't know which command
+            // set gets it back to reading the array
+            dstt_flash_command(0x87, 0, 0xF0);
+            dstt_flash_command(0x87, 0, 0xFF);
+            logMessage(LOG_INFO, "DSTT: No CFI");
+            return 0;
+        }
+
+        auto at = [&](uint32_t i) -> uint32_t { return i * stride < sizeof(cfi) ? cfi[i * stride] : 0; };
+        const uint16_t command_set = at(0x13) | at(0x14) << 8;
+        // back to reading the array
+        dstt_flash_command(0x87, 0, command_set == 2 ? 0xF0 : 0xFF);
+        if (command_set < 1 || command_set > 3) {
+            logMessage(LOG_NOTICE, "DSTT: Unknown CFI command set %u", command_set);
+            return 0;
+        }
+
+        // times are powers of two: typical, then the max as a multiple of it; shifts
+        // bigger than these are garbage, and taken as no data
+        if (at(0x1F) && at(0x1F) < 32 && at(0x23) < 16) {
+            const uint64_t typical = 1ull << at(0x1F);
+            m_card.waitTiming(WaitOp::Program, (uint32_t)std::min<uint64_t>(typical, 1000000),
+                (uint32_t)std::min<uint64_t>(typical << at(0x23), 1000000));
+        }
+        if (at(0x21) && at(0x21) < 32 && at(0x25) < 16) {
+            const uint64_t typical = 1000ull << at(0x21);
+            m_card.waitTiming(WaitOp::Erase, (uint32_t)std::min<uint64_t>(typical, 60000000),
+                (uint32_t)std::min<uint64_t>(typical << at(0x25), 60000000));
+        }
+        const uint32_t write_buffer = at(0x2A) | at(0x2B) << 8;
+        m_write_buffer = at(0x20) && write_buffer < 32 ? 1u << write_buffer : 0;
+
+        std::vector<std::pair<uint32_t, uint32_t>> regions;
+        for (uint32_t i = 0; i < at(0x2C); ++i) {
+            const uint32_t r = 0x2D + i * 4;
+            const uint32_t count = (at(r) | at(r + 1) << 8) + 1;
+            const uint32_t size = at(r + 2) << 8 | at(r + 3) << 16;
+            regions.emplace_back(count, size ? size : 0x80);
+        }
+        // AMD top boot chips list their regions from the top down
+        const uint32_t ext = at(0x15) | at(0x16) << 8;
+        if (command_set == 2 && ext && at(ext) == 'P' && at(ext + 1) == 'R' && at(ext + 2) == 'I'
+            && at(ext + 0xF) == 3) {
+            std::reverse(regions.begin(), regions.end());
+        }
+
+        m_cfi_blocks.clear();
+        uint32_t total = 0;
+        for (auto const& region: regions) {
+            for (uint32_t i = 0; i < region.first && total < m_max_length; ++i) {
+                m_cfi_blocks.push_back(region.second);
+                total += region.second;
+            }
+        }
+        if (total < m_max_length) {
+            logMessage(LOG_NOTICE, "DSTT: CFI erase blocks only cover 0x%x bytes", total);
+            m_cfi_blocks.clear();
+        }
+
+        logMessage(LOG_INFO, "DSTT: CFI command set %u, %u erase blocks, write buffer %u",
+            command_set, (unsigned int)m_cfi_blocks.size(), m_write_buffer);
+        return command_set;
+    }
+
     bool flashchip_supported(uint32_t flashchip)
     {
 		// there's probably a better way to do this?
@@ -206,40 +325,145 @@ private:
         return false;
     }
 
-    void Erase_Block(uint32_t offset, uint32_t length)
+    bool Erase_Block(uint32_t offset, uint32_t length)
     {
+        CardPhaseScope phase(m_card, CardPhase::Erase);
         logMessage(LOG_DEBUG, "DSTT: erase_block(0x%08x)", offset);
+        CardBatchEntry entries[7];
+        CardBatch batch(entries);
         if (m_cmd_type == DSTT_CMD_TYPE_1) {
-            dstt_flash_command(0x87, 0x5555, 0xAA);
-            dstt_flash_command(0x87, 0x2AAA, 0x55);
-            dstt_flash_command(0x87, 0x5555, 0x80);
-            dstt_flash_command(0x87, 0x5555, 0xAA);
-            dstt_flash_command(0x87, 0x2AAA, 0x55);
-
-            dstt_flash_command(0x87, offset, 0x30);
+            dstt_batch_command(batch, 0x87, 0x5555, 0xAA);
+            dstt_batch_command(batch, 0x87, 0x2AAA, 0x55);
+            dstt_batch_command(batch, 0x87, 0x5555, 0x80);
+            dstt_batch_command(batch, 0x87, 0x5555, 0xAA);
+            dstt_batch_command(batch, 0x87, 0x2AAA, 0x55);
+
+            dstt_batch_command(batch, 0x87, offset, 0x30);
+            // DQ7 reads 0 until the erase is done, then the erased 0xFF
+            batch.poll(WaitOp::Erase, dstt_cmd(0, offset, 0), 4, dstt_flags, 0x80, 0x80);
         } else if (m_cmd_type == DSTT_CMD_TYPE_2) {
-            dstt_flash_command(0x87, 0x00,   0x50); // Clear Status Register
-            dstt_flash_command(0x87, offset, 0x20); // Erase Setup
-            dstt_flash_command(0x87, offset, 0xD0); // Erase Confirm
+            dstt_batch_command(batch, 0x87, 0x00,   0x50); // Clear Status Register
+            dstt_batch_command(batch, 0x87, offset, 0x20); // Erase Setup
+            dstt_batch_command(batch, 0x87, offset, 0xD0); // Erase Confirm
+            batch.poll(WaitOp::Erase, dstt_cmd(0, offset & 0xFFFFFFFC, 0), 4, dstt_flags, 0x80, 0x80);
+
+            dstt_batch_command(batch, 0x87, 0x00, 0x50); // Clear Status Register
+            dstt_batch_command(batch, 0x87, 0x00, 0xFF); // Reset
+        }
+        if (m_card.submit(batch)) {
+            return false;
+        }
 
-            // TODO: Timeout if something goes wrong.
-            while (!(dstt_flash_command(0, offset & 0xFFFFFFFC, 0) & 0x80));
+        // the chip says it's done; spot check that the block really is blank
+        if (!Is_Blank(offset, length)) {
+            logMessage(LOG_ERR, "DSTT: block 0x%08x isn't blank after erase", offset);
+            return false;
+        }
+        return true;
+    }
 
-            dstt_flash_command(0x87, 0x00, 0x50); // Clear Status Register
-            dstt_flash_command(0x87, 0x00, 0xFF); // Reset
+    bool Is_Blank(uint32_t offset, uint32_t length)
+    {
+        bool blank = dstt_flash_command(0, offset + length - 4, 0) == 0xFFFFFFFF;
+        for (uint32_t i = 0; blank && i < length; i += dstt_blank_check_stride) {
+            blank = dstt_flash_command(0, offset + i, 0) == 0xFFFFFFFF;
+        }
+        return blank;
+    }
+
+    struct Block {
+        uint32_t offset;
+        uint32_t length;
+        bool erase;
+    };
+
+    /// Whether every byte of the block at `offset` that has to go from 0 back to 1 to get
+    /// from `old` to `data` reads as 0xFF. Those are the bytes a missed erase leaves
+    /// wrong; the rest come out right from programming alone.
+    bool Is_Erased_For(uint32_t offset, uint32_t length, const uint8_t *data, const uint8_t *old)
+    {
+        for (uint32_t i = 0; i < length; i += 4) {
+            uint32_t mask = 0;
+            for (uint32_t b = 0; b < 4; ++b) {
+                if ((old[i + b] & data[i + b]) != data[i + b]) {
+                    mask |= 0xFFu << (b * 8);
+                }
+            }
+            if (mask && (dstt_flash_command(0, offset + i, 0) & mask) != mask) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Erases the blocks of `blocks` that need it with one sector erase command, adding
+    /// each further sector address while the chip still takes them, and waits once.
+    /// `data` and `old` are what the blocks should hold and hold now, from `start`.
+    ///
+    /// A block that doesn't come out erased (the window for more sectors is only some
+    /// 50us, which a slow card bus can miss) gets erased again on its own.
+    bool Erase_Together(const std::vector<Block> &blocks, uint32_t start, const uint8_t *data, const uint8_t *old)
+    {
+        std::vector<uint32_t> offsets;
+        for (auto const& block: blocks) {
+            if (block.erase) {
+                offsets.push_back(block.offset);
+            }
+        }
+        if (offsets.empty()) {
+            return true;
         }
 
-        uint32_t end_offset = offset + length;
-        for (; offset < end_offset; offset += 4)
         {
-            // TODO: Timeout if something goes wrong.
-            while (dstt_flash_command(0, offset, 0) != 0xFFFFFFFF);
+            CardPhaseScope phase(m_card, CardPhase::Erase);
+            logMessage(LOG_DEBUG, "DSTT: erasing %u blocks together", (unsigned int)offsets.size());
+            std::vector<CardBatchEntry> entries(offsets.size() + 6);
+            CardBatch batch(entries.data(), entries.size());
+            dstt_batch_command(batch, 0x87, 0x5555, 0xAA);
+            dstt_batch_command(batch, 0x87, 0x2AAA, 0x55);
+            dstt_batch_command(batch, 0x87, 0x5555, 0x80);
+            dstt_batch_command(batch, 0x87, 0x5555, 0xAA);
+            dstt_batch_command(batch, 0x87, 0x2AAA, 0x55);
+            for (auto const& offset: offsets) {
+                dstt_batch_command(batch, 0x87, offset, 0x30);
+            }
+            batch.poll(WaitOp::Erase, dstt_cmd(0, offsets[0], 0), 4, dstt_flags, 0x80, 0x80);
+
+            // the sectors are erased one after the other, so the wait is for all of them;
+            // what it learns goes back in as the time for one
+            const uint64_t count = offsets.size();
+            const WaitTiming single = m_card.waitTiming(WaitOp::Erase);
+            m_card.waitTiming(WaitOp::Erase, (uint32_t)std::min<uint64_t>(single.expected * count, UINT32_MAX),
+                (uint32_t)std::min<uint64_t>(single.max * count, UINT32_MAX));
+            const bool ok = !m_card.submit(batch);
+            m_card.waitTiming(WaitOp::Erase, std::max<uint32_t>(m_card.waitTiming(WaitOp::Erase).expected / count, 1),
+                single.max);
+            if (!ok) {
+                return false;
+            }
+        }
+
+        for (auto const& block: blocks) {
+            const uint32_t i = block.offset - start;
+            if (block.erase && !Is_Erased_For(block.offset, block.length, data + i, old + i)) {
+                logMessage(LOG_NOTICE, "DSTT: block 0x%08x missed the erase, erasing it alone", block.offset);
+                if (!Erase_Block(block.offset, block.length)) {
+                    return false;
+                }
+            }
         }
+        return true;
     }
 
-    void Erase_Chip() {
+    /// Sizes of the erase blocks in the first m_max_length bytes, from address 0 up.
+    ///
+    /// These come from CFI if the chip has it, and from the table below if not.
+    std::vector<uint32_t> Erase_Blocks() {
+        if (!m_cfi_blocks.empty()) {
+            return m_cfi_blocks;
+        }
+
         std::vector<uint32_t> erase_blocks;
-        logMessage(LOG_INFO, "DSTT: Erasing Flash");
 
         switch(m_flashchip)
         {
@@ -312,43 +536,160 @@ private:
                 break;
         }
 
-        // calculate the max so we can show progress
-        uint32_t erase_endaddr = 0;
-        for (auto const& block_sz: erase_blocks) {
-            erase_endaddr += block_sz;
+        return erase_blocks;
+    }
+
+    /// Writes `data` over the blocks in [start, end), which hold `old` now.
+    ///
+    /// `start` and `end` have to be on block boundaries. Blocks that don't change are left
+    /// alone, and the rest only get erased if some bit has to go from 0 back to 1.
+    bool Write_Blocks(uint32_t start, uint32_t end, const uint8_t *data, const uint8_t *old)
+    {
+        // work out which blocks change first, so that their erases can go together
+        std::vector<Block> blocks;
+        uint32_t block_addr = 0;
+        for (auto const& block_sz: Erase_Blocks()) {
+            const uint32_t offset = block_addr;
+            block_addr += block_sz;
+            if (offset < start || block_addr > end
+                || !memcmp(data + (offset - start), old + (offset - start), block_sz)) {
+                continue;
+            }
+
+            bool erase = false;
+            for (uint32_t i = offset - start; i < block_addr - start; ++i) {
+                if ((old[i] & data[i]) != data[i]) {
+                    erase = true;
+                    break;
+                }
+            }
+            blocks.push_back(Block{ offset, block_sz, erase });
+        }
+
+        if (m_multi_erase) {
+            if (!Erase_Together(blocks, start, data, old)) {
+                return false;
+            }
+        } else {
+            for (auto const& block: blocks) {
+                if (block.erase && !Erase_Block(block.offset, block.length)) {
+                    return false;
+                }
+            }
+        }
+
+        for (auto const& block: blocks) {
+            showProgress(block.offset - start, end - start, "Writing");
+            const uint32_t i = block.offset - start;
+            if (!Program_Range(block.offset, block.length, data + i, block.erase ? nullptr : old + i)) {
+                return false;
+            }
+        }
+
+        showProgress(end - start, end - start, "Writing");
+        return true;
+    }
+
+    /// Widens [address, address + length) out to block boundaries.
+    bool Block_Span(uint32_t address, uint32_t length, uint32_t *start, uint32_t *end)
+    {
+        if (address > m_max_length || length > m_max_length - address) {
+            return false;
         }
 
-        uint32_t erase_addr = 0;
-        for (auto const& block_sz: erase_blocks) {
-            showProgress(erase_addr, erase_endaddr, "Erasing Blocks");
-            Erase_Block(erase_addr, block_sz);
-            erase_addr += block_sz;
+        uint32_t block_addr = 0;
+        *start = *end = 0;
+        for (auto const& block_sz: Erase_Blocks()) {
+            if (block_addr + block_sz <= address) {
+                *start = block_addr + block_sz;
+            }
+            block_addr += block_sz;
+            if (*end < address + length) {
+                *end = block_addr;
+            }
         }
+        return *end >= address + length;
+    }
+
+    /// Enters or leaves unlock bypass, where a program takes two cycles instead of four.
+    bool Unlock_Bypass(bool enter)
+    {
+        CardBatchEntry entries[3];
+        CardBatch batch(entries);
+        if (enter) {
+            dstt_batch_command(batch, 0x87, 0x5555, 0xAA);
+            dstt_batch_command(batch, 0x87, 0x2AAA, 0x55);
+            dstt_batch_command(batch, 0x87, 0x5555, 0x20);
+        } else {
+            dstt_batch_command(batch, 0x87, 0, 0x90);
+            dstt_batch_command(batch, 0x87, 0, 0x00);
+        }
+        if (m_card.submit(batch)) {
+            return false;
+        }
+        m_bypassed = enter;
+        return true;
+    }
+
+    /// Programs the bytes of `data` that differ from `old`, or that aren't 0xFF if `old`
+    /// is null (just erased).
+    bool Program_Range(uint32_t offset, uint32_t length, const uint8_t *data, const uint8_t *old)
+    {
+        if (m_unlock_bypass && !Unlock_Bypass(true)) {
+            return false;
+        }
+
+        bool ok = true;
+        for (uint32_t i = 0; i < length; ++i) {
+            if (data[i] == (old ? old[i] : 0xFF)) {
+                m_card.noteSkippedProgram(1);
+                continue;
+            }
+            if (!Program_Byte(offset + i, data[i])) {
+                ok = false;
+                break;
+            }
+        }
+
+        if (m_bypassed && !Unlock_Bypass(false)) {
+            ok = false;
+        }
+        return ok;
     }
 
     // pretty messy function, but gets the job done
-    void Program_Byte(uint32_t offset, uint8_t data)
+    bool Program_Byte(uint32_t offset, uint8_t data)
     {
+        CardPhaseScope phase(m_card, CardPhase::Program);
         logMessage(LOG_DEBUG, "DSTT: program_byte(0x%08x) = 0x%02x", offset, data);
+        CardBatchEntry entries[5];
+        CardBatch batch(entries);
         if (m_cmd_type == DSTT_CMD_TYPE_2) {
-            dstt_flash_command(0x87, 0x00,   0x50); // Clear Status Register
-            dstt_flash_command(0x87, offset, 0x40); // Word Write
-            dstt_flash_command(0x87, offset, data);
-
-            // TODO: Timeout if something goes wrong.
-            while (!(dstt_flash_command(0, offset & 0xFFFFFFFC, 0) & 0x80));
+            dstt_batch_command(batch, 0x87, 0x00,   0x50); // Clear Status Register
+            dstt_batch_command(batch, 0x87, offset, 0x40); // Word Write
+            dstt_batch_command(batch, 0x87, offset, data);
+            batch.poll(WaitOp::Program, dstt_cmd(0, offset & 0xFFFFFFFC, 0), 4, dstt_flags, 0x80, 0x80);
 
-            dstt_flash_command(0x87, 0x00, 0x50); // Clear Status Register
+            dstt_batch_command(batch, 0x87, 0x00, 0x50); // Clear Status Register
             //dstt_flash_command(0x87, offset, 0xFF); // Reset (offset not required)
         } else if (m_cmd_type == DSTT_CMD_TYPE_1) {
-            dstt_flash_command(0x87, 0x5555, 0xAA);
-            dstt_flash_command(0x87, 0x2AAA, 0x55);
-            dstt_flash_command(0x87, 0x5555, 0xA0);
-            dstt_flash_command(0x87, offset, data);
-
-            // TODO: Timeout if something goes wrong.
-            while ((uint8_t)dstt_flash_command(0, offset, 0) != data);
+            if (!m_bypassed) {
+                dstt_batch_command(batch, 0x87, 0x5555, 0xAA);
+                dstt_batch_command(batch, 0x87, 0x2AAA, 0x55);
+            }
+            dstt_batch_command(batch, 0x87, 0x5555, 0xA0);
+            dstt_batch_command(batch, 0x87, offset, data);
+            batch.poll(WaitOp::Program, dstt_cmd(0, offset, 0), 4, dstt_flags, 0xFF, data);
         }
+        return !m_card.submit(batch);
+    }
+
+    bool getBusTimingProbe(BusTimingProbe *probe) {
+        dstt_reset();
+        memset(probe->cmd, 0, 8);
+        probe->size = 4;
+        probe->flags = dstt_flags;
+        return true;
     }
 
 public:
@@ -364,8 +705,18 @@ public:
 
         m_flashchip = get_flashchip_id();
         logMessage(LOG_NOTICE, "DSTT: Flashchip ID = 0x%04x", m_flashchip);
-        if (!flashchip_supported(m_flashchip))
-            return false;
+
+        m_cfi_blocks.clear();
+        m_write_buffer = 0;
+        const uint16_t command_set = Query_Cfi();
+        const bool known = flashchip_supported(m_flashchip);
+        if (!known) {
+            // a chip we don't know is still fine if it can describe itself, but not a
+            // known one that refused (write protected)
+            if (!command_set || (uint16_t)m_flashchip == 0xED01 || m_cfi_blocks.empty())
+                return false;
+            logMessage(LOG_NOTICE, "DSTT: Unknown flashchip, going by its CFI data");
+        }
 
         switch(m_flashchip) {
             case 0x49B0:
@@ -383,7 +734,46 @@ public:
                 m_cmd_type = DSTT_CMD_TYPE_2;
                 break;
             default:
-                m_cmd_type = DSTT_CMD_TYPE_1;
+                // the command set CFI reports only decides for chips we don't know; the
+                // known ones not listed above have always been driven AMD style
+                m_cmd_type = !known && (command_set == 1 || command_set == 3) ? DSTT_CMD_TYPE_2 : DSTT_CMD_TYPE_1;
+                break;
+        }
+
+        switch(m_flashchip) {
+            // datasheets list unlock bypass for these
+            case 0xB91C: // EN29LV400AT
+            case 0xBA01: // Am29LV400BB
+            case 0xBA1C: // EN29LV400AB
+            case 0xED01: // Am29LV001BT
+                m_unlock_bypass = true;
+                break;
+            default:
+                m_unlock_bypass = false;
+                break;
+        }
+        m_bypassed = false;
+
+        switch(m_flashchip) {
+            // datasheets list erasing several sectors at once for these
+            case 0x49C2: // MX29LV160BB
+            case 0x5BC2: // MX29LV800B
+            case 0xA7C2: // MX29LV320T
+            case 0xA8C2: // MX29LV320B
+            case 0xB91C: // EN29LV400AT
+            case 0xBA01: // Am29LV400BB
+            case 0xBA04: // MBM29LV400BC
+            case 0xBA1C: // EN29LV400AB
+            case 0xBA4A: // ES29LV400DB
+            case 0xBAC2: // MX29LV400B
+            case 0xC4C2: // MX29LV160BT
+            case 0xED01: // Am29LV001BT
+            case 0xEE20: // M29W400T
+            case 0xEF20: // M29W400B
+                m_multi_erase = true;
+                break;
+            default:
+                m_multi_erase = false;
                 break;
         }
 
@@ -396,6 +786,7 @@ public:
 
     bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer) {
         logMessage(LOG_INFO, "DSTT: readFlash(addr=0x%08x, size=0x%x)", address, length);
+        CardPhaseScope phase(m_card, CardPhase::Read);
         dstt_reset();
 
         uint32_t i = 0;
@@ -417,26 +808,36 @@ public:
         return true;
     }
 
-    // todo: we're just assuming this is block (0x2000) aligned
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer)
     {
-        // really fucking temporary, writeFlash can only do full length writes
-        // todo: read and erase properly
-        Erase_Chip();
         logMessage(LOG_INFO, "DSTT: writeFlash(addr=0x%08x, size=0x%x)", address, length);
 
-        for(uint32_t i = 0; i < length; i++)
-        {
-            showProgress(i+1, length, "Writing");
-            Program_Byte(address++, buffer[i]);
+        uint32_t start, end;
+        if (!Block_Span(address, length, &start, &end)) {
+            logMessage(LOG_ERR, "DSTT: writeFlash out of range");
+            return false;
         }
 
-        return true;
+        // what the blocks hold now, then what they should hold
+        uint8_t *old = (uint8_t*)malloc((end - start) * 2);
+        if (!old) {
+            logMessage(LOG_ERR, "DSTT: malloc failed");
+            return false;
+        }
+        uint8_t *data = old + (end - start);
+
+        bool ok = readFlash(start, end - start, old);
+        if (ok) {
+            memcpy(data, old, end - start);
+            memcpy(data + (address - start), buffer, length);
+            ok = Write_Blocks(start, end, data, old);
+        }
+
+        free(old);
+        return ok;
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) {
-        // todo: we just read and write the entire flash chip because we don't align blocks
-        // properly, when writeFlash works, don't use memcpy
         logMessage(LOG_INFO, "DSTT: Injecting Ntrboot");
 
         // don't bother installing if we can't fit
@@ -445,16 +846,27 @@ public:
             return false; // todo: return error code
         }
 
-        uint8_t* buffer = (uint8_t*)malloc(m_max_length);
-        readFlash(0, m_max_length, buffer);
+        // the key and the firm can share a block, so build the new image in one go
+        // rather than with a writeFlash for each
+        uint8_t* buffer = (uint8_t*)malloc(m_max_length * 2);
+        if (!buffer) {
+            logMessage(LOG_ERR, "DSTT: malloc failed");
+            return false;
+        }
+        uint8_t* old = buffer + m_max_length;
 
-        memcpy(buffer + 0x1000, blowfish_key, 0x48);
-        memcpy(buffer + 0x2000, blowfish_key + 0x48, 0x1000);
-        memcpy(buffer + 0x7E00, firm, firm_size);
+        bool ok = readFlash(0, m_max_length, old);
+        if (ok) {
+            memcpy(buffer, old, m_max_length);
+            memcpy(buffer + 0x1000, blowfish_key, 0x48);
+            memcpy(buffer + 0x2000, blowfish_key + 0x48, 0x1000);
+            memcpy(buffer + 0x7E00, firm, firm_size);
 
-        writeFlash(0, m_max_length, buffer);
+            ok = Write_Blocks(0, m_max_length, buffer, old);
+        }
 
-        return true;
+        free(buffer);
+        return ok;
     }
 };
 
@@ -1,10 +1,10 @@
 #include "../device.h"
+#include "../flash_util.h"
+#include "../bit_permute.h"
 
 #include <cstring>
 #include <algorithm>
 
-#define BIT(n) (1 << (n))
-
 namespace flashcart_core {
 using platform::logMessage;
 using platform::showProgress;
@@ -19,81 +19,74 @@ struct r4i_flash_setting {
     bool encrypt_header;
 };
 
-class R4i_Gold_3DS : Flashcart {
+class R4i_Gold_3DS : public Flashcart {
 private:
+    /// rev9-D and rev6-8 scramble the bits of the header and FIRM.
+    using Crypt = BitPermutation<4, 3, 7, 6, 1, 0, 2, 5>;
+
     uint8_t encrypt(uint8_t dec, uint32_t offset)
     {
-        uint8_t enc = 0;
         switch (m_r4i_type) {
             case 1: //rev9-D
             case 3: //rev6-7 maybe 8
-                if (dec & BIT(0)) enc |= BIT(4);
-                if (dec & BIT(1)) enc |= BIT(3);
-                if (dec & BIT(2)) enc |= BIT(7);
-                if (dec & BIT(3)) enc |= BIT(6);
-                if (dec & BIT(4)) enc |= BIT(1);
-                if (dec & BIT(5)) enc |= BIT(0);
-                if (dec & BIT(6)) enc |= BIT(2);
-                if (dec & BIT(7)) enc |= BIT(5);
-                return enc;
+                return Crypt::apply(dec);
             case 2: //rev4-5
-                enc = (offset % 256) + 9;
-                return enc ^ dec;
+                return static_cast<uint8_t>((offset % 256) + 9) ^ dec;
         }
         // FIXME throw error
-        return enc;
-    }
-
-    static uint8_t decrypt(uint8_t enc)
-    {
-         uint8_t dec = 0;
-         if (enc & BIT(0)) dec |= BIT(5);
-         if (enc & BIT(1)) dec |= BIT(4);
-         if (enc & BIT(2)) dec |= BIT(6);
-         if (enc & BIT(3)) dec |= BIT(1);
-         if (enc & BIT(4)) dec |= BIT(0);
-         if (enc & BIT(5)) dec |= BIT(7);
-         if (enc & BIT(6)) dec |= BIT(3);
-         if (enc & BIT(6)) dec |= BIT(2);
-         return dec;
+        return 0;
     }
 
     void encrypt_memcpy(uint8_t *dst, uint8_t *src, uint32_t length)
     {
-        for(int i = 0; i < (int)length; ++i)
+        if (m_r4i_type == 1 || m_r4i_type == 3) {
+            Crypt::apply(dst, src, length);
+            return;
+        }
+
+        for (uint32_t i = 0; i < length; ++i)
             dst[i] = encrypt(src[i], i);
     }
 
-    void r4i_read(uint8_t *outbuf, uint32_t address) {
+    bool r4i_read(uint8_t *outbuf, uint32_t address) {
         uint8_t cmdbuf[8];
+        CardPhaseScope phase(m_card, CardPhase::Read);
         logMessage(LOG_DEBUG, "R4iGold: read(0x%08x)", address);
         memcpy(cmdbuf, cmdReadFlash, 8);
         cmdbuf[1] = (address >> 16) & 0xFF;
         cmdbuf[2] = (address >>  8) & 0xFF;
         cmdbuf[3] = (address >>  0) & 0xFF;
 
-        m_card->sendCommand(cmdbuf, outbuf, 0x200, 32);
-        r4i_wait_flash_busy();
+        // reads don't start anything on the flash, so there's only something to wait
+        // for if an erase or program didn't finish
+        if (m_flash_busy && !r4i_wait_flash_busy(WaitOp::Status)) {
+            return false;
+        }
+
+        return !m_card.sendCommand(cmdbuf, outbuf, 0x200, m_card.readFlags(32));
     }
 
-    void r4i_erase(uint32_t address)
+    bool r4i_erase(uint32_t address)
     {
         uint32_t status;
         uint8_t cmdbuf[8];
+        CardPhaseScope phase(m_card, CardPhase::Erase);
         logMessage(LOG_DEBUG, "R4iGold: erase(0x%08x)", address);
         memcpy(cmdbuf, cmdEraseFlash, 8);
         cmdbuf[1] = (address >> 16) & 0xFF;
         cmdbuf[2] = (address >>  8) & 0xFF;
         cmdbuf[3] = (address >>  0) & 0xFF;
 
-        m_card->sendCommand(cmdbuf, &status, 4, 32);
-        r4i_wait_flash_busy();
+        m_card.sendCommand(cmdbuf, &status, 4, 32);
+        m_flash_busy = true;
+        return r4i_wait_flash_busy(WaitOp::Erase);
     }
 
-    void r4i_writebyte(uint32_t address, uint8_t value)
+    bool r4i_writebyte(uint32_t address, uint8_t value)
     {
         uint32_t status;
         uint8_t cmdbuf[8];
+        CardPhaseScope phase(m_card, CardPhase::Program);
         logMessage(LOG_DEBUG, "R4iGold: write(0x%08x) = 0x%02x", address, value);
         memcpy(cmdbuf, cmdWriteByteFlash, 8);
         cmdbuf[1] = (address >> 16) & 0xFF;
@@ -101,28 +94,65 @@ private:
         cmdbuf[3] = (address >>  0) & 0xFF;
         cmdbuf[4] = value;
 
-        m_card->sendCommand(cmdbuf, &status, 4, 32);
-        r4i_wait_flash_busy();
+        m_card.sendCommand(cmdbuf, &status, 4, 32);
+        m_flash_busy = true;
+        return r4i_wait_flash_busy(WaitOp::Program);
     }
 
-    void r4i_wait_flash_busy() {
+    bool r4i_wait_flash_busy(WaitOp op) {
         uint32_t state;
+        BusyWait wait(m_card, op);
         do {
-            m_card->sendCommand(cmdWaitFlashBusy, &state, 4, 32);
+            if (!wait.poll()) {
+                return false;
+            }
+            m_card.sendCommand(cmdWaitFlashBusy, &state, 4, 32);
             logMessage(LOG_DEBUG, "R4iGold: waitFlashBusy = 0x%08x", state);
         } while ((state & 1) != 0);
+        wait.done();
+        m_flash_busy = false;
+        return true;
+    }
+
+    bool flashUtilRead(uint32_t address, uint32_t size, void *dest) {
+        return r4i_read(static_cast<uint8_t *>(dest), address);
+    }
+
+    bool flashUtilErase(uint32_t address) {
+        return r4i_erase(address);
+    }
+
+    bool flashUtilProgram(uint32_t address, const void *src) {
+        return r4i_writebyte(address, *static_cast<const uint8_t *>(src));
     }
 
-    void injectFlash(uint32_t chunk_addr, uint32_t chunk_length, uint32_t offset, uint8_t *src, uint32_t src_length, bool encrypt) {
-        uint8_t *chunk = (uint8_t *)malloc(chunk_length);
-        readFlash(chunk_addr, chunk_length, chunk);
-        if (encrypt) {
-            encrypt_memcpy(chunk + offset, src, src_length);
-        } else {
-            memcpy(chunk + offset, src, src_length);
+    using Util = FlashUtil<R4i_Gold_3DS, 9, &R4i_Gold_3DS::flashUtilRead, 16, &R4i_Gold_3DS::flashUtilErase, 0, &R4i_Gold_3DS::flashUtilProgram>;
+
+    /// Writes `src` at `chunk_addr + offset`, encrypted if asked to.
+    ///
+    /// The diff against the flash happens on the encrypted bytes, so only 64K blocks that
+    /// change are erased, and only bytes that change are programmed.
+    bool injectFlash(uint32_t chunk_addr, uint32_t offset, uint8_t *src, uint32_t src_length, bool encrypt) {
+        if (!encrypt) {
+            return Util::write(this, chunk_addr + offset, src_length, src, true);
+        }
+
+        uint8_t *buf = (uint8_t *)malloc(src_length);
+        if (!buf) {
+            logMessage(LOG_ERR, "R4iGold: malloc failed");
+            return false;
         }
-        writeFlash(chunk_addr, chunk_length, chunk);
-        free(chunk);
+        encrypt_memcpy(buf, src, src_length);
+        bool ok = Util::write(this, chunk_addr + offset, src_length, buf, true);
+        free(buf);
+        return ok;
+    }
+
+    bool getBusTimingProbe(BusTimingProbe *probe) {
+        memcpy(probe->cmd, cmdReadFlash, 8);
+        probe->size = 0x200;
+        probe->flags = 32;
+        return true;
     }
 
 protected:
@@ -135,9 +165,11 @@ protected:
     static const r4i_flash_setting flashSettings[3];
 
     uint8_t m_r4i_type;
+    /// Set from starting an erase or program until the flash is seen idle again.
+    bool m_flash_busy;
 
 public:
-    R4i_Gold_3DS() : Flashcart("R4i Gold 3DS", "R4iGold3DS", 0x400000) { }
+    R4i_Gold_3DS() : Flashcart("R4i Gold 3DS", "R4iGold3DS", 0x400000), m_flash_busy(false) { }
 
     const char *getAuthor() { return "Kitlith + zoogie"; }
     const char *getDescription() {
@@ -166,10 +198,14 @@ public:
         logMessage(LOG_INFO, "R4iGold: Init");
         uint32_t hw_revision;
         uint32_t hw_type;
-        m_card->sendCommand(cmdGetHWRevision, (uint8_t*)&hw_revision, 4, 0);
-        m_card->sendCommand(cmdCardType, (uint8_t*)&hw_type, 4, 0);
+        m_card.sendCommand(cmdGetHWRevision, (uint8_t*)&hw_revision, 4, 0);
+        m_card.sendCommand(cmdCardType, (uint8_t*)&hw_type, 4, 0);
         logMessage(LOG_NOTICE, "R4iGold: HW Revision = %08x", hw_revision);
         logMessage(LOG_NOTICE, "R4iGold: HW Type = %08x", hw_type);
+        // 64K sectors
+        m_card.waitTiming(WaitOp::Erase, 500000, 15000000);
+        // whatever was going on before, check once before reading
+        m_flash_busy = true;
 
         switch (hw_revision) {
             // rev9-D
@@ -209,26 +245,13 @@ public:
     bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer)
     {
         logMessage(LOG_INFO, "R4iGold: readFlash(addr=0x%08x, size=0x%x)", address, length);
-        for (uint32_t curpos=0; curpos < length; curpos+=0x200) {
-            r4i_read(buffer + curpos, address + curpos);
-            showProgress(curpos+1,length, "Reading");
-        }
-
-        return true;
+        return Util::read(this, address, length, buffer, true);
     }
 
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer)
     {
         logMessage(LOG_INFO, "R4iGold: writeFlash(addr=0x%08x, size=0x%x)", address, length);
-        for (uint32_t addr=0; addr < length; addr+=0x10000)
-            r4i_erase(address + addr);
-
-        for (uint32_t i=0; i < length; i++) {
-            r4i_writebyte(address + i, buffer[i]);
-            showProgress(i+1,length, "Writing");
-        }
-
-        return true;
+        return Util::write(this, address, length, buffer, true);
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size)
@@ -247,12 +270,9 @@ public:
         }
 
         logMessage(LOG_INFO, "R4iGold: Injecting ntrboot");
-        injectFlash(set->blowfish_chunk_adr, 0x10000, set->blowfish_offset, blowfish_key, 0x1048, set->encrypt_header);
-        injectFlash(set->firm_hdr_chunk_adr, 0x10000, set->firm_hdr_offset, firm, 0x200, set->encrypt_header);
-
-        uint32_t buf_size = PAGE_ROUND_UP(firm_size - 0x200 + set->firm_offset, 0x10000);
-        injectFlash(set->firm_chunk_adr, buf_size, set->firm_offset, firm + 0x200, firm_size, true);
-        return true;
+        return injectFlash(set->blowfish_chunk_adr, set->blowfish_offset, blowfish_key, 0x1048, set->encrypt_header)
+            && injectFlash(set->firm_hdr_chunk_adr, set->firm_hdr_offset, firm, 0x200, set->encrypt_header)
+            && injectFlash(set->firm_chunk_adr, set->firm_offset, firm + 0x200, firm_size - 0x200, true);
     }
 };
 
@@ -1,9 +1,9 @@
 #include <cstring>
 #include <algorithm>
-#include <ncgcpp/ntrcard.h>
 
 #include "../device.h"
 #include "../flash_util.h"
+#include "../rom_window.h"
 
 namespace flashcart_core {
 using platform::logMessage;
@@ -32,12 +32,23 @@ constexpr uint64_t norRaw(const uint8_t d1, const uint8_t d2, const uint8_t fpga
         (static_cast<uint64_t>(d1) << 16) | (static_cast<uint64_t>(d2) << 24);
 }
 static_assert(norRaw(0x34, 0x56, 0x12) == 0x56341299, "norRaw result is wrong");
+
+// datasheet worst cases; only used as is if neither status polling nor calibration works
+constexpr uint32_t wrenDelay = 0x60000;
+constexpr uint32_t eraseDelay = 41000000;
+constexpr uint32_t programDelay = 0x60000;
+
+// plain B7 reads, once unlocked; the same timing as norRead()
+constexpr uint32_t romReadFlags = 0x180000;
+
+// the start of the ROM <=> NOR map injectNtrBoot() writes, which maps ROM 1:1
+const uint8_t identityMap[8] = { 0x00, 0x00, 0x00, 0x00, 0x7F, 0xFF, 0xFF, 0xFF };
 }
 
-class R4iSDHC : Flashcart {
+class R4iSDHC : public Flashcart {
     uint32_t norRead(const uint32_t address) {
         CmdBuf4 buf;
-        m_card->sendCommand(norCmd(2, 5, 0x3B, address), buf.u8, 4, 0x180000);
+        m_card.sendCommand(norCmd(2, 5, 0x3B, address), buf.u8, 4, m_card.readFlags(0x180000));
         logMessage(LOG_DEBUG, "R4ISDHC: NOR read at %X returned %X", address, buf.u32);
         return buf.u32;
     }
@@ -49,19 +60,228 @@ class R4iSDHC : Flashcart {
         return true;
     }
 
-    void norWriteEnable() {
-        m_card->sendCommand(norCmd(0, 1, 6, 0), nullptr, 4, 0x180000);
-        ncgc::delay(0x60000);
+    /// Where ROM shows NOR `address`, if it does: 1:1 with a 1:1 map (type 2 carts have no map,
+    /// but move ROM 0x8000-0x10000 elsewhere), and never below 0x8000, which ROM reads
+    /// can't reach.
+    bool romAddress(const uint32_t address, uint32_t *rom) {
+        if (!m_rom_mapped || (address & (RomWindow::blockSize - 1))
+            || address < (cart_type == 2 ? 0x10000 : 0x8000)) {
+            return false;
+        }
+        *rom = address;
+        return true;
+    }
+
+    /// Checks whether the cart maps ROM 1:1, and starts over with the ROM window.
+    void checkRomMap() {
+        uint8_t map[8];
+        m_rom_window.reset();
+        m_rom_mapped = cart_type == 2
+            || (norRead(0x40, 4, map) && norRead(0x44, 4, map + 4) && !std::memcmp(map, identityMap, sizeof(map)));
+        logMessage(LOG_DEBUG, "r4isdhc: ROM %s mapped 1:1", m_rom_mapped ? "is" : "isn't");
+    }
+
+    /// Reads 0x200 bytes, through the ROM window if it can, with norRead() otherwise.
+    bool flashUtilRead(const uint32_t address, uint32_t, void *dest) {
+        uint8_t *const block = static_cast<uint8_t *>(dest);
+        uint32_t rom;
+        const bool mapped = romAddress(address, &rom);
+        if (mapped && m_rom_window.read(m_card, rom, block)) {
+            return true;
+        }
+
+        for (uint32_t i = 0; i < RomWindow::blockSize; i += 4) {
+            norRead(address + i, 4, block + i);
+        }
+        if (mapped) {
+            m_rom_window.check(m_card, rom, block);
+        }
+        return true;
+    }
+
+    bool norStatus(uint8_t *sr) {
+        CmdBuf4 buf;
+        if (m_card.sendCommand(norCmd(2, 1, 5, 0), buf.u8, 4, 0x180000)) {
+            return false;
+        }
+        *sr = buf.u8[0];
+        return true;
+    }
+
+    /// Polls the NOR status register until `(sr & mask) == value`.
+    bool norWaitStatus(WaitOp op, uint8_t mask, uint8_t value) {
+        uint8_t sr;
+        BusyWait wait(m_card, op);
+        do {
+            if (!wait.poll() || !norStatus(&sr)) {
+                return false;
+            }
+        } while ((sr & mask) != value);
+        wait.done();
+        return true;
+    }
+
+    /// Checks whether the status register can be read through the cart, by watching
+    /// WEL follow write enable and write disable.
+    bool probeStatus() {
+        uint8_t wel, wrdi;
+        m_card.sendCommand(norCmd(0, 1, 6, 0), nullptr, 4, 0x180000);
+        m_card.delay(wrenDelay);
+        if (!norStatus(&wel)) {
+            return false;
+        }
+        m_card.sendCommand(norCmd(0, 1, 4, 0), nullptr, 4, 0x180000);
+        m_card.delay(wrenDelay);
+        if (!norStatus(&wrdi)) {
+            return false;
+        }
+
+        logMessage(LOG_DEBUG, "r4isdhc: status after WREN %02X, after WRDI %02X", wel, wrdi);
+        return (wel & 3) == 2 && (wrdi & 3) == 0;
+    }
+
+    void addWriteEnable(CardBatch &batch) {
+        batch.command(norCmd(0, 1, 6, 0), nullptr, 4, 0x180000);
+        if (m_has_status) {
+            batch.poll(WaitOp::Status, norCmd(2, 1, 5, 0), 4, 0x180000, 3, 2);
+        } else {
+            batch.delay(m_wren_delay);
+        }
+    }
+
+    void addPage(CardBatch &batch, const uint32_t address, const uint8_t *bytes) {
+        batch.command(norCmd(0, 6, 2, address, bytes[0], bytes[1]), nullptr, 4, 0x180000);
+        for (uint32_t cur = 2; cur < 0x100; cur += 2) {
+            batch.command(norRaw(bytes[cur], bytes[cur+1]), nullptr, 4, 0x180000);
+        }
+        batch.command(norRaw(bytes[0], bytes[1], 0xF0), nullptr, 4, 0x180000);
+    }
+
+    bool norWriteEnable() {
+        CardBatch batch(m_batch);
+        addWriteEnable(batch);
+        return !m_card.submit(batch);
+    }
+
+    void norSendPage(const uint32_t address, const uint8_t *bytes) {
+        CardBatch batch(m_batch);
+        addPage(batch, address, bytes);
+        m_card.submit(batch);
+    }
+
+    /// Finds a shorter erase delay than the worst case, using the sector at `address`
+    /// (which is about to be erased anyway) as scratch.
+    void calibrateErase(const uint32_t address) {
+        static const uint8_t zeroes[0x100] = {};
+        m_erase_calibrated = true;
+
+        for (uint32_t delay = eraseDelay / 64; delay < eraseDelay; delay *= 2) {
+            // reads while the chip is busy come back as FF, so that can't tell us the erase is
+            // done; a page program only goes through once it is, though
+            norWriteEnable();
+            m_card.sendCommand(norCmd(0, 4, 0x20, address), nullptr, 4, 0x180000);
+            m_card.delay(delay);
+
+            norWriteEnable();
+            norSendPage(address, zeroes);
+            m_card.delay(m_program_delay);
+            if (norRead(address) == 0) {
+                // the doubling only tells us the erase took between delay / 2 and delay,
+                // and erase times vary a lot from sector to sector
+                m_erase_delay = std::min<uint32_t>(delay * 2, eraseDelay);
+                logMessage(LOG_INFO, "r4isdhc: erase delay calibrated to %lu", m_erase_delay);
+                return;
+            }
+
+            // let it finish before trying again
+            m_card.delay(eraseDelay);
+        }
+
+        logMessage(LOG_WARN, "r4isdhc: erase calibration failed, using worst case delay");
+    }
+
+    /// The index of the last word of a page that isn't FF, or -1 if there is none; reading
+    /// it back tells us whether the page program went through.
+    static int probeWord(const uint8_t *bytes, uint32_t *word) {
+        int probe = 0x100 / 4 - 1;
+        for (; probe >= 0; --probe) {
+            std::memcpy(word, bytes + probe * 4, 4);
+            if (*word != 0xFFFFFFFF) {
+                break;
+            }
+        }
+        return probe;
+    }
+
+    /// Programs the page at `address`, finding the shortest write enable and program
+    /// delays that work on the way.
+    ///
+    /// Returns false (with the worst case delays back in place) if the page didn't
+    /// program with any of them.
+    bool calibrateProgram(const uint32_t address, const uint8_t *bytes) {
+        // the last word that isn't FF tells us when the page is done
+        uint32_t word;
+        const int probe = probeWord(bytes, &word);
+        if (probe < 0) {
+            // nothing to program, try again on the next page
+            return true;
+        }
+
+        m_program_calibrated = true;
+        const uint32_t step = programDelay / 64;
+        for (uint32_t wren = wrenDelay / 64; wren <= wrenDelay; wren *= 2) {
+            // programming a page again with the same data doesn't hurt
+            m_card.sendCommand(norCmd(0, 1, 6, 0), nullptr, 4, 0x180000);
+            m_card.delay(wren);
+            norSendPage(address, bytes);
+
+            for (uint32_t waited = step; waited <= programDelay * 4; waited += step) {
+                m_card.delay(step);
+                if (norRead(address + probe * 4) == word) {
+                    m_erase_pending = false;
+                    m_wren_delay = std::min(wren * 2, wrenDelay);
+                    m_program_delay = std::min(waited * 2, programDelay);
+                    logMessage(LOG_INFO, "r4isdhc: write enable delay calibrated to %lu, program delay to %lu",
+                        m_wren_delay, m_program_delay);
+                    return true;
+                }
+            }
+        }
+
+        logMessage(LOG_WARN, "r4isdhc: program calibration failed, using worst case delays");
+        m_wren_delay = wrenDelay;
+        m_program_delay = programDelay;
+        return false;
     }
 
     bool norErase4k(const uint32_t address) {
-        norWriteEnable();
-        m_card->sendCommand(norCmd(0, 4, 0x20, address), nullptr, 4, 0x180000);
-        ncgc::delay(41000000);
+        if (!m_has_status && !m_erase_calibrated) {
+            calibrateErase(address);
+        }
+        if (m_erase_pending) {
+            // nothing was programmed after the last erase, so nothing told us it's done;
+            // the chip would drop this one if it isn't
+            m_card.delay(eraseDelay);
+            m_erase_pending = false;
+        }
+
+        if (!norWriteEnable()) {
+            return false;
+        }
+        m_card.sendCommand(norCmd(0, 4, 0x20, address), nullptr, 4, 0x180000);
+        if (m_has_status) {
+            if (!norWaitStatus(WaitOp::Erase, 1, 0)) {
+                return false;
+            }
+        } else {
+            m_card.delay(m_erase_delay);
+            // reads while busy come back as FF, so the check below can't tell whether the
+            // erase is done; the read back of the first page programmed after it does
+            m_erase_pending = true;
+        }
 
-        // now ideally if i could read the NOR status register, i'd do the memcpy here
-        // while the NOR does the sector erase, then just wait on it at the end. BUT NOPE!
-        // (and the datasheet doesn't say this chip can read while writing, so that's not an option)
+        // N.B. the datasheet doesn't say this chip can read while writing, so we can't
+        // overlap anything with the erase
 
         bool success = false;
         uint32_t retry = 0;
@@ -75,23 +295,56 @@ class R4iSDHC : Flashcart {
 
             ++retry;
             logMessage(LOG_WARN, "r4isdhc: norErase4k: start or end isn't FF");
-            ncgc::delay(41000000);
+            m_card.delay(eraseDelay);
         }
 
         return success;
     }
 
+    bool norProgram(const uint32_t address, const uint8_t *bytes) {
+        CardBatch batch(m_batch);
+        addWriteEnable(batch);
+        addPage(batch, address, bytes);
+        if (m_has_status) {
+            batch.poll(WaitOp::Program, norCmd(2, 1, 5, 0), 4, 0x180000, 1, 0);
+        } else {
+            batch.delay(m_program_delay);
+        }
+
+        return !m_card.submit(batch);
+    }
+
     bool norWrite256(const uint32_t address, const void *src) {
         const uint8_t *bytes = static_cast<const uint8_t *>(src);
-        norWriteEnable();
-        m_card->sendCommand(norCmd(0, 6, 2, address, bytes[0], bytes[1]), nullptr, 4, 0x180000);
-        for (uint32_t cur = 2; cur < 0x100; cur += 2) {
-            m_card->sendCommand(norRaw(bytes[cur], bytes[cur+1]), nullptr, 4, 0x180000);
+        if (m_has_status) {
+            return norProgram(address, bytes);
+        }
+        if (!m_program_calibrated && calibrateProgram(address, bytes)) {
+            return true;
+        }
+        if (!norProgram(address, bytes)) {
+            return false;
         }
-        m_card->sendCommand(norRaw(bytes[0], bytes[1], 0xF0), nullptr, 4, 0x180000);
-        ncgc::delay(0x60000);
 
-        return true;
+        // without a status register, a program sent while the last erase is still
+        // running is dropped silently; check it went through
+        uint32_t word;
+        const int probe = probeWord(bytes, &word);
+        if (probe < 0) {
+            return true;
+        }
+        if (norRead(address + probe * 4) == word) {
+            m_erase_pending = false;
+            return true;
+        }
+
+        logMessage(LOG_WARN, "r4isdhc: page 0x%lX didn't program, using worst case delays", (unsigned long)address);
+        m_wren_delay = wrenDelay;
+        m_erase_delay = eraseDelay;
+        m_program_delay = programDelay;
+        m_card.delay(eraseDelay);
+        m_erase_pending = false;
+        return norProgram(address, bytes) && norRead(address + probe * 4) == word;
     }
 
     bool checkCartType1() {
@@ -99,27 +352,27 @@ class R4iSDHC : Flashcart {
         // this is actually the NOR write disable command
         // the r4isdhc will respond to cart commands with 0xFFFFFFFF if
         // the "magic" command hasn't been sent, so we check for that
-        m_card->sendCommand(0x40199, buf.u8, 4, 0x180000);
-        if (m_card->state() == ncgc::NTRState::Raw) {
+        m_card.sendCommand(0x40199, buf.u8, 4, 0x180000);
+        if (m_card.state() == CardState::Raw) {
             if (buf.u32 != 0xFFFFFFFF) {
                 logMessage(LOG_ERR, "r4isdhc: checkCartType1: pre-test returned 0x%08X", buf.u32);
                 return false;
             }
         }
 
-        ncgc::Err err = m_card->init();
+        CardErr err = m_card.init();
         if (err && !err.unsupported()) {
             logMessage(LOG_ERR, "r4isdhc: checkCartType1: ntrcard::init failed");
             return false;
         }
 
         // only type 1 carts support 0x68 command
-        m_card->sendCommand(0x68, nullptr, 4, 0x180000, true);
+        m_card.sendCommand(0x68, nullptr, 4, 0x180000, true);
 
         // now it will return zeroes
-        m_card->sendCommand(0x40199, buf.u8, 4, 0x180000, true);
+        m_card.sendCommand(0x40199, buf.u8, 4, 0x180000, true);
         if (buf.u32 == 0) {
-            m_card->state(ncgc::NTRState::Raw);
+            m_card.state(CardState::Raw);
             return true;
         }
 
@@ -129,20 +382,20 @@ class R4iSDHC : Flashcart {
 
     bool checkCartType2() {
         // this check only work on the activated BF key2
-        if (m_card->state() != ncgc::NTRState::Key2) {
+        if (m_card.state() != CardState::Key2) {
             logMessage(LOG_ERR, "r4isdhc: checkCartType2: status (%d) not KEY2",
-                static_cast<uint32_t>(m_card->state()));
+                static_cast<uint32_t>(m_card.state()));
             return false;
         }
 
         CmdBuf4 buf;
-        m_card->sendCommand(0x66, nullptr, 4, 0x586000, true);
-        m_card->sendCommand(0x40199, buf.u8, 4, 0x180000, true);
+        m_card.sendCommand(0x66, nullptr, 4, 0x586000, true);
+        m_card.sendCommand(0x40199, buf.u8, 4, 0x180000, true);
 
         // FIXME this is a really poor check
         // a non-r4isdhc cart will stay in KEY2 and likely return something that isn't all-FF
         if (buf.u32 != 0xFFFFFFFF) {
-            m_card->state(ncgc::NTRState::Raw);
+            m_card.state(CardState::Raw);
             return true;
         }
 
@@ -153,27 +406,23 @@ class R4iSDHC : Flashcart {
     }
 
     bool trySecureInit(BlowfishKey key) {
-        ncgc::Err err = m_card->init();
+        CardErr err = m_card.init();
         if (err && !err.unsupported()) {
             logMessage(LOG_ERR, "r4isdhc: trySecureInit: ntrcard::init failed");
             return false;
-        } else if (m_card->state() != ncgc::NTRState::Raw) {
+        } else if (m_card.state() != CardState::Raw) {
             logMessage(LOG_ERR, "r4isdhc: trySecureInit: status (%d) not RAW and cannot reset",
-                static_cast<uint32_t>(m_card->state()));
+                static_cast<uint32_t>(m_card.state()));
             return false;
         }
 
-        ncgc::c::ncgc_ncard_t& state = m_card->rawState();
-        state.hdr.key1_romcnt = state.key1.romcnt = 0x81808F8;
-        state.hdr.key2_romcnt = state.key2.romcnt = 0x416657;
-        state.key2.seed_byte = 0;
-        m_card->setBlowfishState(platform::getBlowfishKey(key), key != BlowfishKey::NTR);
+        const CardSecureParams params = { key, 0x81808F8, 0x416657, 0 };
 
-        if ((err = m_card->beginKey1())) {
+        if ((err = m_card.beginKey1(params))) {
             logMessage(LOG_ERR, "r4isdhc: trySecureInit: init key1 (key = %d) failed: %d", static_cast<int>(key), err.errNo());
             return false;
         }
-        if ((err = m_card->beginKey2())) {
+        if ((err = m_card.beginKey2())) {
             logMessage(LOG_ERR, "r4isdhc: trySecureInit: init key2 failed: %d", err.errNo());
             return false;
         }
@@ -181,13 +430,39 @@ class R4iSDHC : Flashcart {
         return checkCartType2();
     }
 
-    uint8_t cart_type;
+    bool getBusTimingProbe(BusTimingProbe *probe) override {
+        const uint64_t cmd = norCmd(2, 5, 0x3B, 0);
+        for (int i = 0; i < 8; ++i) {
+            probe->cmd[i] = (cmd >> (i * 8)) & 0xFF;
+        }
+        probe->size = 4;
+        probe->flags = 0x180000;
+        return true;
+    }
 
-    using Util = FlashUtil<R4iSDHC, 2, &R4iSDHC::norRead, 12, &R4iSDHC::norErase4k, 8, &R4iSDHC::norWrite256>;
+    uint8_t cart_type;
+    bool m_has_status;
+    bool m_erase_calibrated;
+    bool m_program_calibrated;
+    /// An erase was timed with the calibrated delay, and no page program has shown it
+    /// finished yet.
+    bool m_erase_pending;
+    uint32_t m_wren_delay;
+    uint32_t m_erase_delay;
+    uint32_t m_program_delay;
+    // write enable, a page and the wait
+    CardBatchEntry m_batch[0x84];
+    RomWindow m_rom_window;
+    bool m_rom_mapped;
+
+    using Util = FlashUtil<R4iSDHC, 9, &R4iSDHC::flashUtilRead, 12, &R4iSDHC::norErase4k, 8, &R4iSDHC::norWrite256>;
 
 public:
     // Name & Size of Flash Memory
-    R4iSDHC() : Flashcart("R4iSDHC family", "r4isdhc", 0x200000), cart_type(1) { }
+    R4iSDHC() : Flashcart("R4iSDHC family", "r4isdhc", 0x200000), cart_type(1), m_has_status(false),
+        m_erase_calibrated(false), m_program_calibrated(false), m_erase_pending(false),
+        m_wren_delay(wrenDelay), m_erase_delay(eraseDelay), m_program_delay(programDelay),
+        m_rom_window("r4isdhc", romReadFlags), m_rom_mapped(false) { }
 
     const char* getAuthor() {
         return
@@ -210,8 +485,8 @@ public:
         if (checkCartType1()) {
             cart_type = 1;
         } else {
-            switch (m_card->state()) {
-                case ncgc::NTRState::Raw:
+            switch (m_card.state()) {
+                case CardState::Raw:
                     if (!trySecureInit(BlowfishKey::NTR)
                         && !trySecureInit(BlowfishKey::B9Retail)
                         && !trySecureInit(BlowfishKey::B9Dev)) {
@@ -219,14 +494,14 @@ public:
                         return false;
                     }
                     break;
-                case ncgc::NTRState::Key2:
+                case CardState::Key2:
                     if (!checkCartType2()) {
                         logMessage(LOG_DEBUG, "r4isdhc: type 2 init from KEY2 fail");
                         return false;
                     }
                     break;
                 default:
-                    logMessage(LOG_ERR, "r4isdhc: Unexpected encryption status %d", m_card->state());
+                    logMessage(LOG_ERR, "r4isdhc: Unexpected encryption status %d", m_card.state());
                     return false;
             }
             cart_type = 2;
@@ -239,6 +514,17 @@ public:
         }
 
         logMessage(LOG_ERR, "r4isdhc: found type %d cart", cart_type);
+
+        m_erase_calibrated = m_program_calibrated = m_erase_pending = false;
+        m_wren_delay = wrenDelay;
+        m_erase_delay = eraseDelay;
+        m_program_delay = programDelay;
+        m_has_status = probeStatus();
+        logMessage(LOG_INFO, "r4isdhc: NOR status register %s", m_has_status ? "readable" : "not readable");
+        // 4K sector erase, 256-byte page program
+        m_card.waitTiming(WaitOp::Erase, 45000, 2000000);
+        m_card.waitTiming(WaitOp::Program, 700, 10000);
+        checkRomMap();
         return true;
     }
 
@@ -249,6 +535,9 @@ public:
     }
 
     bool writeFlash(const uint32_t address, const uint32_t length, const uint8_t *const buffer) override {
+        if (cart_type == 1 && address < 0x40 + sizeof(identityMap) && address + length > 0x40) {
+            m_rom_window.disable();
+        }
         return Util::write(this, address, length, buffer, true);
     }
 
@@ -264,7 +553,10 @@ public:
 
         uint8_t map[0x100] = {0};
         // set the 2nd ROM map to some high value (0x7FFFFFFF in big-endian)
-        map[4] = 0x7F; map[5] = 0xFF; map[6] = 0xFF; map[7] = 0xFF;
+        std::memcpy(map, identityMap, sizeof(identityMap));
+        if (cart_type == 1) {
+            m_rom_window.disable();
+        }
         return
             // 1:1 map the ROM <=> NOR (unless it's an "old" cart - those don't seem to have
             // a mapping in the NOR)
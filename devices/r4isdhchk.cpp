@@ -2,14 +2,14 @@
 #include <algorithm>
 
 #include "../device.h"
-
-#define BIT(n) (1 << (n))
+#include "../flash_util.h"
+#include "../bit_permute.h"
 
 namespace flashcart_core {
 using platform::logMessage;
 using platform::showProgress;
 
-class R4iSDHCHK : Flashcart {
+class R4iSDHCHK : public Flashcart {
 private:
     static const uint8_t cmdGetSWRev[8];
     static const uint8_t cmdReadFlash506[8];
@@ -24,47 +24,20 @@ private:
 
     static uint32_t sw_rev;
 
-    uint8_t encrypt(uint8_t dec) {
-        uint8_t enc = 0;
-        if (dec & BIT(0)) enc |= BIT(5);
-        if (dec & BIT(1)) enc |= BIT(4);
-        if (dec & BIT(2)) enc |= BIT(1);
-        if (dec & BIT(3)) enc |= BIT(3);
-        if (dec & BIT(4)) enc |= BIT(6);
-        if (dec & BIT(5)) enc |= BIT(7);
-        if (dec & BIT(6)) enc |= BIT(0);
-        if (dec & BIT(7)) enc |= BIT(2);
-        enc ^= 0x98;
-        return enc;
-    }
-
-    uint8_t decrypt(uint8_t enc) {
-        uint8_t dec = 0;
-        enc ^= 0x98;
-        if (enc & BIT(0)) dec |= BIT(6);
-        if (enc & BIT(1)) dec |= BIT(2);
-        if (enc & BIT(2)) dec |= BIT(7);
-        if (enc & BIT(3)) dec |= BIT(3);
-        if (enc & BIT(4)) dec |= BIT(1);
-        if (enc & BIT(5)) dec |= BIT(0);
-        if (enc & BIT(6)) dec |= BIT(4);
-        if (enc & BIT(7)) dec |= BIT(5);
-        return dec;
-    }
+    /// What the cart does to data on its way to the flash...
+    using Encrypt = BitPermutation<5, 4, 1, 3, 6, 7, 0, 2, 0x00, 0x98>;
+    /// ...and on its way back.
+    using Decrypt = BitPermutation<6, 2, 7, 3, 1, 0, 4, 5, 0x98, 0x00>;
 
     void encrypt_memcpy(uint8_t * dst, uint8_t * src, uint32_t length) {
-        for(uint32_t i = 0; i < length; ++i) {
-            dst[i] = encrypt(src[i]);
-        }
+        Encrypt::apply(dst, src, length);
     }
 
-    void read_cmd(uint32_t address, uint8_t *resp) {
-        uint8_t cmdbuf[8];
-
+    bool make_read_cmd(uint32_t address, uint8_t *cmdbuf) {
         switch (sw_rev) {
             case 0x00000505:
                 /*placeholder if going to be supported in the future. There are no reports that this revision currently exists.*/
-                return;
+                return false;
             case 0x00000605:
                 address = address + 0x610000;
                 memcpy(cmdbuf, cmdReadFlash506, 8);
@@ -74,40 +47,64 @@ private:
                 memcpy(cmdbuf, cmdReadFlash700, 8);
                 break;
             default:
-                return;
+                return false;
         }
 
       cmdbuf[2] = (address >> 16) & 0x1F;
       cmdbuf[3] = (address >>  8) & 0xFF;
       cmdbuf[4] = (address >>  0) & 0xFF;
+      return true;
+    }
 
-      m_card->sendCommand(cmdbuf, resp, 0x200, 80);
+    bool read_cmd(uint32_t address, uint8_t *resp) {
+        uint8_t cmdbuf[8];
+        CardPhaseScope phase(m_card, CardPhase::Read);
+
+        if (!make_read_cmd(address, cmdbuf)) {
+            return false;
+        }
+
+      return !m_card.sendCommand(cmdbuf, resp, 0x200, m_card.readFlags(80));
+    }
+
+    bool getBusTimingProbe(BusTimingProbe *probe) {
+        probe->size = 0x200;
+        probe->flags = 80;
+        return make_read_cmd(0, probe->cmd);
     }
 
-    void wait_flash_busy(void) {
+    bool wait_flash_busy(WaitOp op) {
       uint8_t cmdbuf[8];
       uint32_t resp = 0;
       memcpy(cmdbuf, cmdWaitFlashBusy, 8);
 
+      BusyWait wait(m_card, op);
       do {
-          m_card->sendCommand(cmdbuf, (uint8_t *)&resp, 4, 80);
+          if (!wait.poll()) {
+              return false;
+          }
+          m_card.sendCommand(cmdbuf, (uint8_t *)&resp, 4, 80);
       } while(resp);
+      wait.done();
+      return true;
     }
 
-    void erase_cmd(uint32_t address) {
+    bool erase_cmd(uint32_t address) {
         uint8_t cmdbuf[8];
+        CardPhaseScope phase(m_card, CardPhase::Erase);
         logMessage(LOG_DEBUG, "r4isdhc.hk: erase(0x%08x)", address);
         memcpy(cmdbuf, cmdEraseFlash, 8);
         cmdbuf[1] = (address >> 16) & 0xFF;
         cmdbuf[2] = (address >>  8) & 0xFF;
         cmdbuf[3] = (address >>  0) & 0xFF;
 
-        m_card->sendCommand(cmdbuf, nullptr, 0, 80);
-        wait_flash_busy();
+        m_card.sendCommand(cmdbuf, nullptr, 0, 80);
+        return wait_flash_busy(WaitOp::Erase);
     }
 
-    void write_cmd(uint32_t address, uint8_t value) {
+    bool write_cmd(uint32_t address, uint8_t value) {
         uint8_t cmdbuf[8];
+        CardPhaseScope phase(m_card, CardPhase::Program);
         logMessage(LOG_DEBUG, "r4isdhc.hk: write(0x%08x) = 0x%02x", address, value);
         memcpy(cmdbuf, cmdWriteByteFlash, 8);
         cmdbuf[1] = (address >> 16) & 0xFF;
@@ -115,31 +112,27 @@ private:
         cmdbuf[3] = (address >>  0) & 0xFF;
         cmdbuf[4] = value;
 
-        m_card->sendCommand(cmdbuf, nullptr, 0, 80);
-        wait_flash_busy();
+        m_card.sendCommand(cmdbuf, nullptr, 0, 80);
+        return wait_flash_busy(WaitOp::Program);
     }
 
     bool trySecureInit(BlowfishKey key) {
-        ncgc::Err err = m_card->init();
+        CardErr err = m_card.init();
         if (err && !err.unsupported()) {
             logMessage(LOG_ERR, "r4isdhc.hk: trySecureInit: ntrcard::init failed");
             return false;
-        } else if (m_card->state() != ncgc::NTRState::Raw) {
+        } else if (m_card.state() != CardState::Raw) {
             logMessage(LOG_ERR, "r4isdhc.hk: trySecureInit: status (%d) not RAW and cannot reset",
-                static_cast<uint32_t>(m_card->state()));
+                static_cast<uint32_t>(m_card.state()));
             return false;
         }
 
-        ncgc::c::ncgc_ncard_t& state = m_card->rawState();
-        state.hdr.key1_romcnt = state.key1.romcnt = 0x1808F8;
-        state.hdr.key2_romcnt = state.key2.romcnt = 0x416017;
-        state.key2.seed_byte = 0;
-        m_card->setBlowfishState(platform::getBlowfishKey(key), key != BlowfishKey::NTR);
-        if ((err = m_card->beginKey1())) {
+        const CardSecureParams params = { key, 0x1808F8, 0x416017, 0 };
+        if ((err = m_card.beginKey1(params))) {
             logMessage(LOG_ERR, "r4isdhc.hk: trySecureInit: init key1 (key = %d) failed: %d", static_cast<int>(key), err.errNo());
             return false;
         }
-        if ((err = m_card->beginKey2())) {
+        if ((err = m_card.beginKey2())) {
             logMessage(LOG_ERR, "r4isdhc.hk: trySecureInit: init key2 failed: %d", err.errNo());
             return false;
         }
@@ -147,18 +140,31 @@ private:
         return true;
     }
 
-    void injectFlash(uint32_t chunk_addr, uint32_t chunk_length, uint32_t offset, uint8_t *src, uint32_t src_length, bool encryption) {
-        uint8_t *chunk = (uint8_t *)malloc(chunk_length);
-        readFlash(chunk_addr, chunk_length, chunk);
-        if (encryption) {
-            encrypt_memcpy(chunk + offset, src, src_length);
-        } else {
-            memcpy(chunk + offset, src, src_length);
+    // FlashUtil works on raw flash contents, so the cart's crypto is undone on the
+    // way in and out, and diffing and verification happen on what's really stored
+    bool flashUtilRead(uint32_t address, uint32_t size, void *dest) {
+        uint8_t *buf = static_cast<uint8_t *>(dest);
+        if (!read_cmd(address, buf)) {
+            return false;
         }
-        writeFlash(chunk_addr, chunk_length, chunk);
-        free(chunk);
+        /*the read command decrypts the raw flash contents before returning it you*/
+        /*so to get the raw flash contents, encrypt the returned values*/
+        encrypt_memcpy(buf, buf, 0x200);
+        return true;
     }
 
+    bool flashUtilErase(uint32_t address) {
+        return erase_cmd(address);
+    }
+
+    bool flashUtilProgram(uint32_t address, const void *src) {
+        /*the write command encrypts whatever you send it before actually writing to flash*/
+        /*so we decrypt whatever we send to be written*/
+        return write_cmd(address, Decrypt::apply(*static_cast<const uint8_t *>(src)));
+    }
+
+    using Util = FlashUtil<R4iSDHCHK, 9, &R4iSDHCHK::flashUtilRead, 16, &R4iSDHCHK::flashUtilErase, 0, &R4iSDHCHK::flashUtilProgram>;
+
 public:
     R4iSDHCHK() : Flashcart("R4 SDHC Dual-Core", "R4iSDHC.hk", 0x200000) { }
 
@@ -183,29 +189,31 @@ public:
           logMessage(LOG_ERR, "r4isdhc.hk: Secure init failed!");
           return false;
         }
+        // 64K sectors
+        m_card.waitTiming(WaitOp::Erase, 500000, 15000000);
 
         uint32_t resp1[0x200/4];
         uint32_t resp2[0x200/4];
 
         //this is how the updater does it. Not sure exactly what it's for
         do {
-          m_card->sendCommand(cmdGetCartUniqueKey, resp1, 0x200, 80);
-          m_card->sendCommand(cmdGetCartUniqueKey, resp2, 0x200, 80);
+          m_card.sendCommand(cmdGetCartUniqueKey, resp1, 0x200, 80);
+          m_card.sendCommand(cmdGetCartUniqueKey, resp2, 0x200, 80);
           logMessage(LOG_DEBUG, "resp1: 0x%08x, resp2: 0x%08x", *resp1, *resp2);
         } while(std::memcmp(resp1, resp2, 0x200));
 
-        m_card->sendCommand(cmdGetSWRev, &sw_rev, 4, 80);
+        m_card.sendCommand(cmdGetSWRev, &sw_rev, 4, 80);
 
         logMessage(LOG_INFO, "r4isdhc.hk: Current Software Revision: %08x", sw_rev);
 
-        m_card->sendCommand(cmdUnkD0AA, nullptr, 4, 80);
-        m_card->sendCommand(cmdUnkD0AA, nullptr, 4, 80);
-        m_card->sendCommand(cmdGetChipID, nullptr, 0, 80);
-        m_card->sendCommand(cmdUnkD0AA, nullptr, 4, 80);
+        m_card.sendCommand(cmdUnkD0AA, nullptr, 4, 80);
+        m_card.sendCommand(cmdUnkD0AA, nullptr, 4, 80);
+        m_card.sendCommand(cmdGetChipID, nullptr, 0, 80);
+        m_card.sendCommand(cmdUnkD0AA, nullptr, 4, 80);
 
         do {
-          m_card->sendCommand(cmdGetCartUniqueKey, resp1, 0x200, 80);
-          m_card->sendCommand(cmdGetCartUniqueKey, resp2, 0x200, 80);
+          m_card.sendCommand(cmdGetCartUniqueKey, resp1, 0x200, 80);
+          m_card.sendCommand(cmdGetCartUniqueKey, resp2, 0x200, 80);
         } while(std::memcmp(resp1, resp2, 0x200));
         
         switch (sw_rev) {
@@ -231,49 +239,36 @@ public:
 
     bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer) {
         logMessage(LOG_INFO, "r4isdhc.hk: readFlash(addr=0x%08x, size=0x%x)", address, length);
-        for(uint32_t addr = 0; addr < length; addr += 0x200)
-        {
-            read_cmd(addr + address, buffer + addr);
-            showProgress(addr, length, "Reading");
-            for(int i = 0; i < 0x200; i++)
-                /*the read command decrypts the raw flash contents before returning it you*/
-                /*so to get the raw flash contents, encrypt the returned values*/
-                *(buffer + addr + i) = encrypt(*(buffer + addr + i));
-        }
-        return true;
+        return Util::read(this, address, length, buffer, true);
     }
 
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer) {
         logMessage(LOG_INFO, "r4isdhc.hk: writeFlash(addr=0x%08x, size=0x%x)", address, length);
-        for (uint32_t addr=0; addr < length; addr+=0x10000) {
-           erase_cmd(address + addr);
-           showProgress(addr, length, "Erasing");
-        }
-
-        for (uint32_t i=0; i < length; i++) {
-            /*the write command encrypts whatever you send it before actually writing to flash*/
-            /*so we decrypt whatever we send to be written*/
-            uint8_t byte = decrypt(buffer[i]);
-            write_cmd(address + i, byte);
-            showProgress(i,length, "Writing");
-        }
-
-        return true;
+        return Util::write(this, address, length, buffer, true);
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) {
         logMessage(LOG_INFO, "r4isdhc.hk: Injecting ntrboot");
-        uint8_t *block_0 = (uint8_t *)malloc(0x10000);
-        uint32_t buf_size = PAGE_ROUND_UP(firm_size - 0x200 + 0x000000, 0x10000);
         uint8_t gameHeader[0x200];
 
+        if (sw_rev == 0x00000505) {
+            /*placeholder if going to be supported in the future. There are no reports that this revision currently exists.*/
+            return false;
+        }
+
+        uint8_t *block_0 = (uint8_t *)malloc(0x10000);
+        if (!block_0) {
+            logMessage(LOG_ERR, "r4isdhc.hk: malloc failed");
+            return false;
+        }
+
         logMessage(LOG_INFO, "r4isdhc.hk: Patch firmware (header)");
-        readFlash(0, 0x10000, block_0);
+        if (!readFlash(0, 0x10000, block_0)) {
+            free(block_0);
+            return false;
+        }
 
         switch (sw_rev) {
-            case 0x00000505:
-                /*placeholder if going to be supported in the future. There are no reports that this revision currently exists.*/
-                return false;
             case 0x00000605: {
                 /*Modify the PicoBlaze 3 instruction (aka cart header) to remap the following in flash:*/
                 /*game header from 0x11100, move to 0x1000 (len = 200h)*/
@@ -330,19 +325,24 @@ public:
             }
             default:
                 logMessage(LOG_ERR, "r4isdhc.hk: 0x%08x is not a recognized version and therefore is not supported.", sw_rev);
+                free(block_0);
                 return false;
         }
 
-        readFlash(0x11100, 0x200, gameHeader);
+        if (!readFlash(0x11100, 0x200, gameHeader)) {
+            free(block_0);
+            return false;
+        }
         memcpy(block_0 + 0x1000, gameHeader, 0x200);
         memcpy(block_0 + 0x1600, blowfish_key, 0x1048);
         memcpy(block_0 + 0x3EA8, firm, 0x200);
         memcpy(block_0 + 0x5000, firm + 0x200, firm_size - 0x200);
         encrypt_memcpy(block_0 + 0x1200, block_0 + 0x1200, 0xEE00);
-        injectFlash(0, 0x10000, 0, block_0, 0x10000, false);
-        
+        // only the bytes that differ from what's on the flash get programmed
+        bool ok = writeFlash(0, 0x10000, block_0);
+
         free(block_0);
-        return true;
+        return ok;
     }
 };
 
@@ -3,6 +3,8 @@
 #include <cstdlib>
 #include <cstring>
 
+#include "device.h"
+
 namespace flashcart_core {
 
 template<
@@ -32,12 +34,23 @@ class FlashUtil {
 
     static_assert(eraseSizePower >= writeSizePower, "Erase page size must be at least write page size");
 
+    static Card &card(FlashcartClass *const fc) {
+        return static_cast<Flashcart *>(fc)->m_card;
+    }
+
     /// Writes a `(1 << eraseSizePower)`-byte page at address `dest_address`.
-    static bool writeHelper(FlashcartClass *const fc, const std::uint32_t dest_address, const std::uint8_t *const src) {
+    ///
+    /// `old` is what the page holds now, or null if it was just erased; write pages that
+    /// already hold their contents are skipped.
+    static bool writeHelper(FlashcartClass *const fc, const std::uint32_t dest_address, const std::uint8_t *const src,
+                            const std::uint8_t *const old) {
         std::uint32_t cur = 0;
 
         while (cur < eraseSize) {
-            if (!(fc->*writeFn)(dest_address + cur, src + cur)) {
+            const bool unchanged = old ? !std::memcmp(src + cur, old + cur, writeSize) : erased(src + cur, writeSize);
+            if (unchanged) {
+                card(fc).noteSkippedProgram(writeSize);
+            } else if (!(fc->*writeFn)(dest_address + cur, src + cur)) {
                 return false;
             }
 
@@ -48,6 +61,59 @@ class FlashUtil {
         return cur == eraseSize;
     }
 
+    static bool erased(const std::uint8_t *const p, const std::uint32_t length) {
+        for (std::uint32_t i = 0; i < length; ++i) {
+            if (p[i] != 0xFF) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Whether programming alone (which can only clear bits) gets from `old` to `data`.
+    static bool programmable(const std::uint8_t *const old, const std::uint8_t *const data, const std::uint32_t length) {
+        for (std::uint32_t i = 0; i < length; ++i) {
+            if ((old[i] & data[i]) != data[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Reads back `length` bytes at `address` and compares them against `src`.
+    ///
+    /// `buf` must be at least `length` bytes. If it is null, only the first and last
+    /// 4 bytes are checked.
+    static bool verify(FlashcartClass *const fc, const std::uint32_t address, const std::uint32_t length,
+                       const std::uint8_t *const src, std::uint8_t *const buf) {
+        CardPhaseScope phase(card(fc), CardPhase::Verify);
+
+        if (buf) {
+            if (!read(fc, address, length, buf)
+                || std::memcmp(buf, src, length)) {
+                platform::logMessage(LOG_NOTICE, "Flash write verification failed");
+                return false;
+            }
+        } else {
+            std::uint32_t t;
+            if (!read(fc, address, 4, &t)
+                || std::memcmp(&t, src, std::min<std::uint32_t>(length, 4))) {
+                platform::logMessage(LOG_NOTICE, "Flash write start verification failed");
+                return false;
+            }
+
+            if (length > 4) {
+                if (!read(fc, address + length - 4, 4, &t)
+                    || std::memcmp(&t, src + length - 4, 4)) {
+                    platform::logMessage(LOG_NOTICE, "Flash write start verification failed");
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
 public:
     static bool read(FlashcartClass *const fc, 
                      const std::uint32_t start_address, const std::uint32_t length, void *const destVoid,
@@ -56,6 +122,7 @@ public:
         constexpr std::uint32_t blockSize = freeReadSize ? 0x1000 : readSize;
         std::uint8_t *const dest = static_cast<std::uint8_t *>(destVoid);
         std::uint32_t cur = 0;
+        CardPhaseScope phase(card(fc), CardPhase::Read);
 
         // special case for small reads if we can read any size, and
         // and we're not showing the progress bar
@@ -108,11 +175,13 @@ public:
         const std::uint32_t real_length = ((length + first_page_offset) + eraseSizeM1) & ~eraseSizeM1;
         const std::uint8_t *const src = static_cast<const std::uint8_t *>(srcVoid);
         std::uint32_t cur = 0;
-        std::uint8_t *buf = static_cast<std::uint8_t *>(std::malloc(eraseSize));
+        // what the page holds now, then what it should hold
+        std::uint8_t *buf = static_cast<std::uint8_t *>(std::malloc(eraseSize * 2));
         if (!buf) {
             platform::logMessage(LOG_ERR, "FlashUtil::write: malloc failed");
             return false;
         }
+        std::uint8_t *const page = buf + eraseSize;
 
         if (progress) {
             platform::showProgress(cur, real_length, progress_str);
@@ -130,13 +199,22 @@ public:
             }
 
             if (std::memcmp(buf + buf_ofs, src + src_ofs, len)) {
-                if (!(fc->*eraseFn)(cur_addr)) {
-                    platform::logMessage(LOG_ERR, "FlashUtil::write: erase failed");
-                    goto fail;
+                const bool erase = !programmable(buf + buf_ofs, src + src_ofs, len);
+                if (erase) {
+                    CardPhaseScope phase(card(fc), CardPhase::Erase);
+                    if (!(fc->*eraseFn)(cur_addr)) {
+                        platform::logMessage(LOG_ERR, "FlashUtil::write: erase failed");
+                        goto fail;
+                    }
                 }
 
-                std::memcpy(buf + buf_ofs, src + src_ofs, len);
-                writeHelper(fc, cur_addr, buf);
+                std::memcpy(page, buf, eraseSize);
+                std::memcpy(page + buf_ofs, src + src_ofs, len);
+                CardPhaseScope phase(card(fc), CardPhase::Program);
+                if (!writeHelper(fc, cur_addr, page, erase ? nullptr : buf)) {
+                    platform::logMessage(LOG_ERR, "FlashUtil::write: program failed");
+                    goto fail;
+                }
             }
 
             cur += eraseSize;
@@ -147,27 +225,8 @@ public:
 
         std::free(buf);
         buf = static_cast<uint8_t *>(std::malloc(length));
-        if (buf) {
-            if (!read(fc, dest_address, length, buf)
-                || std::memcmp(buf, src, length)) {
-                platform::logMessage(LOG_NOTICE, "Flash write verification failed");
-                goto fail;
-            }
-        } else {
-            std::uint32_t t;
-            if (!read(fc, dest_address, 4, &t)
-                || std::memcmp(&t, src, std::min<std::uint32_t>(length, 4))) {
-                platform::logMessage(LOG_NOTICE, "Flash write start verification failed");
-                goto fail;
-            }
-
-            if (length > 4) {
-                if (!read(fc, dest_address + length - 4, 4, &t)
-                    || std::memcmp(&t, src + length - 4, 4)) {
-                    platform::logMessage(LOG_NOTICE, "Flash write start verification failed");
-                    goto fail;
-                }
-            }
+        if (!verify(fc, dest_address, length, src, buf)) {
+            goto fail;
         }
 
         if (buf) {
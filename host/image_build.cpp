@@ -0,0 +1,149 @@
+// Builds a post-inject flash image offline: runs a driver's injectNtrBoot() against a
+// virtual cart holding a dump, writes the result, and lists the pages that changed, so
+// that flashing a real cart can be limited to those.
+//
+// Build on the host, from the repository root, with every core source except
+// ncgc_transport.cpp, plus the simulator and the virtual cart:
+//   g++ -std=c++11 -O2 -I. -o image_build $(ls *.cpp | grep -v ncgc_transport) devices/*.cpp
+//       $(ls host/sim_*.cpp | grep -v bench) host/virtual_cart.cpp host/image_build.cpp
+//
+// Usage: image_build [-v] [-p page_size] <cart> <dump> <firm> <blowfish key> <output>
+// where <cart> is one of the simulator's models (ak2i-44, dstt-9089, ...). The dump is
+// left untouched; changed pages are printed to stdout as "offset size", one a line.
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../device.h"
+#include "virtual_cart.h"
+
+namespace flashcart_core {
+namespace platform {
+namespace {
+log_priority logLevel = LOG_WARN;
+}
+
+void showProgress(std::uint32_t, std::uint32_t, const char *) {}
+
+int logMessage(log_priority priority, const char *fmt, ...) {
+    if (priority < logLevel) {
+        return 0;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    int r = std::vfprintf(stderr, fmt, args);
+    va_end(args);
+    std::fputc('\n', stderr);
+    return r;
+}
+
+auto getBlowfishKey(BlowfishKey) -> const std::uint8_t(&)[0x1048] {
+    // the simulated carts don't check KEY1
+    static std::uint8_t table[0x1048];
+    return table;
+}
+}
+
+namespace {
+bool readFile(const char *path, std::vector<std::uint8_t> *data) {
+    std::FILE *f = std::fopen(path, "rb");
+    if (!f) {
+        std::fprintf(stderr, "can't open %s\n", path);
+        return false;
+    }
+
+    std::uint8_t buf[0x1000];
+    std::size_t n;
+    data->clear();
+    while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0) {
+        data->insert(data->end(), buf, buf + n);
+    }
+    const bool ok = !std::ferror(f);
+    std::fclose(f);
+    return ok;
+}
+
+bool writeFile(const char *path, const std::uint8_t *data, std::uint32_t size) {
+    std::FILE *f = std::fopen(path, "wb");
+    if (!f) {
+        std::fprintf(stderr, "can't create %s\n", path);
+        return false;
+    }
+
+    const bool ok = std::fwrite(data, 1, size, f) == size;
+    return std::fclose(f) == 0 && ok;
+}
+
+int usage() {
+    std::fprintf(stderr, "usage: image_build [-v] [-p page_size] <cart> <dump> <firm> <blowfish key> <output>\ncarts:");
+    for (const SimCartModel &model : simCartModels()) {
+        std::fprintf(stderr, " %s", model.name);
+    }
+    std::fputc('\n', stderr);
+    return 2;
+}
+}
+}
+
+int main(int argc, char **argv) {
+    using namespace flashcart_core;
+
+    std::uint32_t pageSize = 0x1000;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (!std::strcmp(argv[i], "-v")) {
+            platform::logLevel = LOG_DEBUG;
+        } else if (!std::strcmp(argv[i], "-p") && i + 1 < argc) {
+            pageSize = static_cast<std::uint32_t>(std::strtoul(argv[++i], nullptr, 0));
+        } else {
+            return usage();
+        }
+    }
+    if (argc - i != 5 || !pageSize) {
+        return usage();
+    }
+    const char *cartName = argv[i], *dumpPath = argv[i + 1], *firmPath = argv[i + 2];
+    const char *keyPath = argv[i + 3], *outPath = argv[i + 4];
+
+    std::vector<std::uint8_t> firm, key;
+    if (!readFile(firmPath, &firm) || !readFile(keyPath, &key)) {
+        return 1;
+    }
+    if (key.size() != 0x1048 || firm.empty()) {
+        std::fprintf(stderr, "the blowfish key has to be 0x1048 bytes, and the firm can't be empty\n");
+        return 1;
+    }
+
+    MappedImage original;
+    VirtualCart cart;
+    if (!original.open(dumpPath, MappedImage::Mode::ReadOnly)
+        || !cart.open(cartName, dumpPath, MappedImage::Mode::CopyOnWrite)) {
+        return 1;
+    }
+
+    if (!cart.flashcart()->injectNtrBoot(key.data(), firm.data(), static_cast<std::uint32_t>(firm.size()))) {
+        std::fprintf(stderr, "inject failed\n");
+        return 1;
+    }
+
+    const MappedImage &image = cart.image();
+    if (!writeFile(outPath, image.data(), image.size())) {
+        return 1;
+    }
+
+    std::uint32_t pages = 0, dirty = 0;
+    for (std::uint32_t offset = 0; offset < image.size(); offset += pageSize, ++pages) {
+        const std::uint32_t size = std::min(pageSize, image.size() - offset);
+        if (std::memcmp(image.data() + offset, original.data() + offset, size)) {
+            std::printf("0x%08X 0x%X\n", offset, size);
+            ++dirty;
+        }
+    }
+    std::fprintf(stderr, "%u of %u pages changed, %.3f ms simulated\n", dirty, pages, cart.transport().now() / 1e3);
+    return 0;
+}
@@ -0,0 +1,136 @@
+// Checks the BitPermutation tables against the per-bit code the drivers used to have,
+// and compares their speed: per-bit tests, table lookups, and the bulk kernel (SSSE3
+// nibble shuffles where the compiler targets it, table lookups otherwise).
+//
+// Build on the host, from the repository root:
+//   g++ -std=c++11 -O2 -mssse3 -I. -o permute_bench host/permute_bench.cpp
+// (leave out -mssse3 for the table-only path).
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include "../bit_permute.h"
+
+using namespace flashcart_core;
+
+namespace {
+#define BIT(n) (1 << (n))
+
+std::uint8_t r4iGoldEncrypt(std::uint8_t dec) {
+    std::uint8_t enc = 0;
+    if (dec & BIT(0)) enc |= BIT(4);
+    if (dec & BIT(1)) enc |= BIT(3);
+    if (dec & BIT(2)) enc |= BIT(7);
+    if (dec & BIT(3)) enc |= BIT(6);
+    if (dec & BIT(4)) enc |= BIT(1);
+    if (dec & BIT(5)) enc |= BIT(0);
+    if (dec & BIT(6)) enc |= BIT(2);
+    if (dec & BIT(7)) enc |= BIT(5);
+    return enc;
+}
+
+std::uint8_t r4iSdhcHkEncrypt(std::uint8_t dec) {
+    std::uint8_t enc = 0;
+    if (dec & BIT(0)) enc |= BIT(5);
+    if (dec & BIT(1)) enc |= BIT(4);
+    if (dec & BIT(2)) enc |= BIT(1);
+    if (dec & BIT(3)) enc |= BIT(3);
+    if (dec & BIT(4)) enc |= BIT(6);
+    if (dec & BIT(5)) enc |= BIT(7);
+    if (dec & BIT(6)) enc |= BIT(0);
+    if (dec & BIT(7)) enc |= BIT(2);
+    enc ^= 0x98;
+    return enc;
+}
+
+std::uint8_t r4iSdhcHkDecrypt(std::uint8_t enc) {
+    std::uint8_t dec = 0;
+    enc ^= 0x98;
+    if (enc & BIT(0)) dec |= BIT(6);
+    if (enc & BIT(1)) dec |= BIT(2);
+    if (enc & BIT(2)) dec |= BIT(7);
+    if (enc & BIT(3)) dec |= BIT(3);
+    if (enc & BIT(4)) dec |= BIT(1);
+    if (enc & BIT(5)) dec |= BIT(0);
+    if (enc & BIT(6)) dec |= BIT(4);
+    if (enc & BIT(7)) dec |= BIT(5);
+    return dec;
+}
+
+#undef BIT
+
+// the same as in the drivers
+using R4iGoldCrypt = BitPermutation<4, 3, 7, 6, 1, 0, 2, 5>;
+using R4iSdhcHkEncrypt = BitPermutation<5, 4, 1, 3, 6, 7, 0, 2, 0x00, 0x98>;
+using R4iSdhcHkDecrypt = BitPermutation<6, 2, 7, 3, 1, 0, 4, 5, 0x98, 0x00>;
+
+const std::size_t benchSize = 0x4000000;
+const int benchRounds = 4;
+
+double mbPerS(std::clock_t start) {
+    const double s = static_cast<double>(std::clock() - start) / CLOCKS_PER_SEC;
+    return s > 0 ? benchSize * benchRounds / s / 1e6 : 0;
+}
+
+template<typename Perm>
+bool bench(const char *name, std::uint8_t (*reference)(std::uint8_t), std::vector<std::uint8_t> &src,
+           std::vector<std::uint8_t> &dst) {
+    for (unsigned int v = 0; v < 256; ++v) {
+        const std::uint8_t b = static_cast<std::uint8_t>(v);
+        if (Perm::apply(b) != reference(b)) {
+            std::printf("%-20s table differs at %02X\n", name, v);
+            return false;
+        }
+    }
+
+    std::clock_t start = std::clock();
+    for (int r = 0; r < benchRounds; ++r) {
+        for (std::size_t i = 0; i < benchSize; ++i) {
+            dst[i] = reference(src[i]);
+        }
+    }
+    const double bits = mbPerS(start);
+    const std::vector<std::uint8_t> expected = dst;
+
+    start = std::clock();
+    for (int r = 0; r < benchRounds; ++r) {
+        for (std::size_t i = 0; i < benchSize; ++i) {
+            dst[i] = Perm::apply(src[i]);
+        }
+    }
+    const double table = mbPerS(start);
+
+    start = std::clock();
+    for (int r = 0; r < benchRounds; ++r) {
+        Perm::apply(dst.data(), src.data(), benchSize);
+    }
+    const double bulk = mbPerS(start);
+
+    const bool ok = dst == expected;
+    std::printf("%-20s %10.1f %10.1f %10.1f %s\n", name, bits, table, bulk, ok ? "" : "bulk output differs");
+    return ok;
+}
+}
+
+int main() {
+    std::vector<std::uint8_t> src(benchSize), dst(benchSize);
+    std::uint32_t x = 1;
+    for (std::uint8_t &b : src) {
+        x = x * 1103515245 + 12345;
+        b = static_cast<std::uint8_t>(x >> 16);
+    }
+
+#if defined(__SSSE3__)
+    std::printf("bulk kernel: SSSE3\n");
+#else
+    std::printf("bulk kernel: table\n");
+#endif
+    std::printf("%-20s %10s %10s %10s (MB/s)\n", "", "per-bit", "table", "bulk");
+    bool ok = bench<R4iGoldCrypt>("r4igold encrypt", r4iGoldEncrypt, src, dst);
+    ok = bench<R4iSdhcHkEncrypt>("r4isdhc.hk encrypt", r4iSdhcHkEncrypt, src, dst) && ok;
+    ok = bench<R4iSdhcHkDecrypt>("r4isdhc.hk decrypt", r4iSdhcHkDecrypt, src, dst) && ok;
+    return ok ? 0 : 1;
+}
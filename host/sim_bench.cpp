@@ -0,0 +1,241 @@
+// Runs every driver against a simulated cart and reports what each operation costs:
+// card commands, simulated bus time, simulated wall time (bus time plus the driver's
+// waits and delays) and host CPU time.
+//
+// Build on the host, from the repository root, with every core source except
+// ncgc_transport.cpp:
+//   g++ -std=c++11 -O2 -I. -o sim_bench $(ls *.cpp | grep -v ncgc_transport) devices/*.cpp host/sim_*.cpp
+//
+// Usage: sim_bench [-v] [-o op,...] [config...]
+// where the ops are read, write and inject (all by default; init always runs), and dump
+// (a whole-flash Flashcart::readUsedFlash(), only when asked for), e.g.
+// "sim_bench -o read r4igold-1 r4igold-2 r4igold-3" for read throughput alone. Configs run
+// in the order given, and settings the drivers save (platform::saveData()) are kept for
+// the rest of the run, so naming a config twice shows what they save.
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../device.h"
+#include "sim_carts.h"
+
+namespace flashcart_core {
+namespace platform {
+namespace {
+log_priority logLevel = LOG_WARN;
+}
+
+void showProgress(std::uint32_t, std::uint32_t, const char *) {}
+
+int logMessage(log_priority priority, const char *fmt, ...) {
+    if (priority < logLevel) {
+        return 0;
+    }
+
+    // keep driver messages next to the row they belong to
+    std::fflush(stdout);
+    va_list args;
+    va_start(args, fmt);
+    int r = std::vfprintf(stderr, fmt, args);
+    va_end(args);
+    std::fputc('\n', stderr);
+    return r;
+}
+
+namespace {
+// kept for the rest of the run, as a platform with storage would keep it between sessions
+std::map<std::string, std::vector<std::uint8_t>> savedData;
+}
+
+bool loadData(const char *name, void *data, std::uint32_t size) {
+    auto it = savedData.find(name);
+    if (it == savedData.end() || it->second.size() != size) {
+        return false;
+    }
+    std::memcpy(data, it->second.data(), size);
+    return true;
+}
+
+bool saveData(const char *name, const void *data, std::uint32_t size) {
+    const std::uint8_t *p = static_cast<const std::uint8_t *>(data);
+    savedData[name].assign(p, p + size);
+    return true;
+}
+
+auto getBlowfishKey(BlowfishKey key) -> const std::uint8_t(&)[0x1048] {
+    // the simulated carts don't check KEY1, so any table does
+    static std::uint8_t table[0x1048];
+    for (std::uint32_t i = 0; i < sizeof(table); ++i) {
+        table[i] = static_cast<std::uint8_t>(i * 13 + static_cast<int>(key));
+    }
+    return table;
+}
+}
+
+namespace {
+enum Op : unsigned int {
+    OpRead = 1 << 0,
+    OpWrite = 1 << 1,
+    OpInject = 1 << 2,
+    OpDump = 1 << 3
+};
+unsigned int selectedOps = OpRead | OpWrite | OpInject;
+
+bool parseOps(const char *list) {
+    selectedOps = 0;
+    while (*list) {
+        const std::size_t n = std::strcspn(list, ",");
+        if (n == 4 && !std::strncmp(list, "read", n)) {
+            selectedOps |= OpRead;
+        } else if (n == 5 && !std::strncmp(list, "write", n)) {
+            selectedOps |= OpWrite;
+        } else if (n == 6 && !std::strncmp(list, "inject", n)) {
+            selectedOps |= OpInject;
+        } else if (n == 4 && !std::strncmp(list, "dump", n)) {
+            selectedOps |= OpDump;
+        } else {
+            return false;
+        }
+        list += n + (list[n] == ',');
+    }
+    return selectedOps != 0;
+}
+
+/// Measures one operation from construction to report().
+class Meter {
+    SimTransport &m_sim;
+    std::uint32_t m_transfers;
+    std::uint64_t m_bus_ns;
+    std::uint64_t m_time_us;
+    std::clock_t m_cpu;
+
+public:
+    explicit Meter(SimTransport &sim)
+        : m_sim(sim), m_transfers(sim.transfers()), m_bus_ns(sim.busTime()), m_time_us(sim.now()),
+          m_cpu(std::clock()) {}
+
+    void report(const char *config, const char *op, bool ok) const {
+        const double cpuMs = static_cast<double>(std::clock() - m_cpu) * 1000 / CLOCKS_PER_SEC;
+        std::printf("%-16s %-7s %-4s %10u %12.3f %12.3f %10.3f\n", config, op, ok ? "ok" : "FAIL",
+                    m_sim.transfers() - m_transfers, (m_sim.busTime() - m_bus_ns) / 1e6,
+                    (m_sim.now() - m_time_us) / 1e3, cpuMs);
+    }
+};
+
+bool run(const SimCartModel &config) {
+    Flashcart *driver = config.flashcart();
+    if (!driver) {
+        std::printf("%-16s no driver named %s\n", config.name, config.driver);
+        return false;
+    }
+
+    std::unique_ptr<SimCart> cart(config.make());
+    cart->flash()->fill(0xC0FFEE);
+    SimTransport sim(cart.get());
+
+    bool ok;
+    {
+        Meter meter(sim);
+        ok = driver->initialize(&sim);
+        meter.report(config.name, "init", ok);
+    }
+    if (!ok) {
+        return false;
+    }
+
+    bool allOk = true;
+    if (selectedOps & OpRead) {
+        const std::uint32_t length = std::min<std::uint32_t>(driver->getMaxLength(), 0x40000);
+        std::vector<std::uint8_t> buf(length);
+        Meter meter(sim);
+        ok = driver->readFlash(0, length, buf.data());
+        ok = ok && !std::memcmp(buf.data(), cart->flash()->data(), length);
+        meter.report(config.name, "read", ok);
+        allOk = allOk && ok;
+    }
+    if (selectedOps & OpWrite) {
+        const std::uint32_t length = std::min<std::uint32_t>(driver->getMaxLength(), 0x10000);
+        std::vector<std::uint8_t> pattern(length);
+        for (std::uint32_t i = 0; i < length; ++i) {
+            pattern[i] = static_cast<std::uint8_t>(i ^ (i >> 8));
+        }
+        Meter meter(sim);
+        ok = driver->writeFlash(0, length, pattern.data());
+        // checked against the chip itself, not a read back through the driver
+        ok = ok && !std::memcmp(pattern.data(), cart->flash()->data(), length);
+        meter.report(config.name, "write", ok);
+        allOk = allOk && ok;
+    }
+    if (selectedOps & OpInject) {
+        std::uint8_t key[0x1048];
+        std::vector<std::uint8_t> firm(0x8000);
+        for (std::uint32_t i = 0; i < sizeof(key); ++i) {
+            key[i] = static_cast<std::uint8_t>(i * 7);
+        }
+        for (std::uint32_t i = 0; i < firm.size(); ++i) {
+            firm[i] = static_cast<std::uint8_t>(i * 3 + (i >> 9));
+        }
+        Meter meter(sim);
+        ok = driver->injectNtrBoot(key, firm.data(), static_cast<std::uint32_t>(firm.size()));
+        meter.report(config.name, "inject", ok);
+        allOk = allOk && ok;
+    }
+    if (selectedOps & OpDump) {
+        const std::uint32_t length = std::min<std::uint32_t>(driver->getMaxLength(), cart->flash()->size());
+        std::vector<std::uint8_t> buf(driver->getMaxLength());
+        std::vector<FlashExtent> skipped;
+        Meter meter(sim);
+        ok = driver->readUsedFlash(buf.data(), &skipped, 0x1000);
+        // sampled, so anything skipped has to be blank on the chip as well
+        ok = ok && !std::memcmp(buf.data(), cart->flash()->data(), length);
+        meter.report(config.name, "dump", ok);
+        allOk = allOk && ok;
+    }
+
+    driver->shutdown();
+    return allOk;
+}
+}
+}
+
+int main(int argc, char **argv) {
+    using namespace flashcart_core;
+
+    std::vector<const char *> only;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "-v")) {
+            platform::logLevel = LOG_DEBUG;
+        } else if (!std::strcmp(argv[i], "-o") && i + 1 < argc) {
+            if (!parseOps(argv[++i])) {
+                std::fprintf(stderr, "unknown op in %s\n", argv[i]);
+                return 2;
+            }
+        } else {
+            only.push_back(argv[i]);
+        }
+    }
+
+    std::printf("%-16s %-7s %-4s %10s %12s %12s %10s\n", "config", "op", "", "commands", "bus ms", "sim ms", "cpu ms");
+    bool ok = true;
+    if (only.empty()) {
+        for (const SimCartModel &config : simCartModels()) {
+            ok = run(config) && ok;
+        }
+    }
+    for (const char *name : only) {
+        const SimCartModel *config = findSimCartModel(name);
+        if (!config) {
+            std::fprintf(stderr, "unknown config %s\n", name);
+            return 2;
+        }
+        ok = run(*config) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,654 @@
+#include <cstring>
+#include <algorithm>
+
+#include "sim_carts.h"
+
+namespace flashcart_core {
+
+namespace {
+// parallel NOR datasheet typicals (MX29LV160): 64K sector erase, byte program
+const std::uint32_t norEraseTime = 700000;
+const std::uint32_t norProgramTime = 9;
+
+const std::uint32_t aceVersion = 0x03010000;
+
+std::uint8_t cmdByte(std::uint64_t cmd, unsigned int i) {
+    return static_cast<std::uint8_t>(cmd >> (i * 8));
+}
+
+/// `count` command bytes from `first` on, as a big-endian number.
+std::uint32_t cmdBytes(std::uint64_t cmd, unsigned int first, unsigned int count) {
+    std::uint32_t v = 0;
+    for (unsigned int i = first; i < first + count; ++i) {
+        v = v << 8 | cmdByte(cmd, i);
+    }
+    return v;
+}
+
+/// Answers with `value`, little-endian, repeated for as long as asked.
+void put32(std::uint8_t *in, std::uint32_t inLength, std::uint32_t value) {
+    for (std::uint32_t i = 0; in && i < inLength; ++i) {
+        in[i] = static_cast<std::uint8_t>(value >> ((i % 4) * 8));
+    }
+}
+
+// r4isdhc.hk: plain bit i is stored as bit hkBits[i], then XORed with 0x98
+const std::uint8_t hkBits[8] = { 5, 4, 1, 3, 6, 7, 0, 2 };
+
+std::uint8_t hkEncrypt(std::uint8_t dec) {
+    std::uint8_t enc = 0;
+    for (unsigned int i = 0; i < 8; ++i) {
+        if (dec & (1 << i)) {
+            enc |= 1 << hkBits[i];
+        }
+    }
+    return enc ^ 0x98;
+}
+
+std::uint8_t hkDecrypt(std::uint8_t enc) {
+    std::uint8_t dec = 0;
+    enc ^= 0x98;
+    for (unsigned int i = 0; i < 8; ++i) {
+        if (enc & (1 << hkBits[i])) {
+            dec |= 1 << i;
+        }
+    }
+    return dec;
+}
+
+/// The ROM address a KEY2 read of `address` gets: reads of the secure area (below 0x8000)
+/// return 0x8000 on, as on a real cart.
+std::uint32_t romAddress(std::uint32_t address) {
+    return address < 0x8000 ? 0x8000 | (address & 0x1FF) : address;
+}
+
+std::uint8_t log2Up(std::uint32_t v) {
+    std::uint8_t n = 0;
+    while ((1u << n) < v) {
+        ++n;
+    }
+    return n;
+}
+
+/// A CFI query answer describing `nor`, for the primary command set `commandSet`
+/// (1 Intel, 2 AMD).
+std::vector<std::uint8_t> cfiTable(const SimNor &nor, std::uint16_t commandSet) {
+    std::vector<std::uint8_t> t(0x60, 0);
+    t[0x10] = 'Q';
+    t[0x11] = 'R';
+    t[0x12] = 'Y';
+    t[0x13] = static_cast<std::uint8_t>(commandSet);
+    t[0x14] = static_cast<std::uint8_t>(commandSet >> 8);
+    t[0x1F] = log2Up(nor.programTime());
+    t[0x21] = log2Up(nor.eraseTime() / 1000);
+    // max times are 16x typical
+    t[0x23] = 4;
+    t[0x25] = 4;
+    t[0x27] = log2Up(nor.size());
+
+    // erase block regions: runs of same-sized sectors
+    std::uint32_t regions = 0;
+    std::uint32_t address = 0, start, size;
+    while (regions < 4 && nor.sector(address, &start, &size)) {
+        std::uint32_t count = 0;
+        std::uint32_t s, z;
+        while (nor.sector(address, &s, &z) && z == size) {
+            address += size;
+            ++count;
+        }
+        const std::uint32_t r = 0x2D + regions * 4;
+        t[r] = static_cast<std::uint8_t>(count - 1);
+        t[r + 1] = static_cast<std::uint8_t>((count - 1) >> 8);
+        t[r + 2] = static_cast<std::uint8_t>(size >> 8);
+        t[r + 3] = static_cast<std::uint8_t>(size >> 16);
+        ++regions;
+    }
+    t[0x2C] = static_cast<std::uint8_t>(regions);
+
+    if (commandSet == 2) {
+        // AMD extended table: bottom boot
+        t[0x15] = 0x40;
+        t[0x40] = 'P';
+        t[0x41] = 'R';
+        t[0x42] = 'I';
+        t[0x43] = '1';
+        t[0x44] = '1';
+        t[0x4F] = 2;
+    }
+    return t;
+}
+
+SimNor dsttNor(std::uint16_t chipId) {
+    switch (chipId) {
+        case 0x041F: {
+            // AT49BV001: one 64K block as far as the driver is concerned
+            return SimNor(0x10000, 0x10000, 1000000, 30);
+        }
+        case 0x80BF: {
+            // SST39VF: small sectors, quick erase
+            return SimNor(0x10000, 0x800, 18000, 14);
+        }
+        case 0x9089: {
+            // Intel 28F160B3
+            return SimNor(0x10000, 0x10000, 1000000, 12);
+        }
+        case 0x912C: {
+            // Micron MT28F160A3: 4K parameter blocks
+            SimNor nor(0x10000, 0x8000, 600000, 12);
+            nor.bootSectors(std::vector<std::uint32_t>(8, 0x1000));
+            return nor;
+        }
+        case 0x49C2:
+        default: {
+            // MX29LV160BB and most others: bottom boot block
+            SimNor nor(0x10000, 0x8000, norEraseTime, norProgramTime);
+            nor.bootSectors({ 0x2000, 0x1000, 0x1000, 0x4000 });
+            return nor;
+        }
+    }
+}
+}
+
+SimAk2iCart::SimAk2iCart(bool hw81)
+    : m_nor(hw81 ? 0x1000000 : 0x200000, 0x10000, norEraseTime, norProgramTime),
+      m_revision(hw81 ? 0x81818181 : 0x44444444), m_unlocked(false) {}
+
+bool SimAk2iCart::command(std::uint64_t cmd, const std::uint8_t *, std::uint32_t,
+                          std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) {
+    const bool hw81 = m_revision == 0x81818181;
+    switch (cmdByte(cmd, 0)) {
+        case 0xD1:
+            put32(in, inLength, m_revision);
+            return true;
+        case 0xC2:
+            switch (cmdBytes(cmd, 1, 4)) {
+                case 0xAA55AA55: m_unlocked = true; break;
+                case 0xAAAA5555: m_unlocked = false; break;
+                default: break;
+            }
+            put32(in, inLength, 0);
+            return true;
+        case 0xD0:
+        case 0xD8:
+            put32(in, inLength, 0);
+            return true;
+        case 0xC0:
+            put32(in, inLength, m_nor.busy(now) ? 1 : 0);
+            return true;
+        case 0xB7:
+            if (m_nor.busy(now)) {
+                return false;
+            }
+            if (in) {
+                m_nor.read(cmdBytes(cmd, 1, 4), in, inLength);
+            }
+            return true;
+        case 0xD4: {
+            const std::uint32_t address = (hw81 ? cmdByte(cmd, 1) : cmdByte(cmd, 1) & 0x1F) << 16 | cmdBytes(cmd, 2, 2);
+            const std::uint8_t op = cmdByte(cmd, 5);
+            if (m_unlocked && op == (hw81 ? 0x80 : 0x01)) {
+                m_nor.erase(address, now);
+            } else if (m_unlocked && op == (hw81 ? 0xA0 : 0x03)) {
+                const std::uint8_t value = cmdByte(cmd, 4);
+                m_nor.program(address, &value, 1, now);
+            }
+            put32(in, inLength, 0);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+SimR4iGoldCart::SimR4iGoldCart(int type)
+    : m_nor(type == 1 ? 0x400000 : 0x200000, 0x10000, norEraseTime, norProgramTime), m_type(type) {}
+
+bool SimR4iGoldCart::command(std::uint64_t cmd, const std::uint8_t *, std::uint32_t,
+                             std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) {
+    switch (cmdByte(cmd, 0)) {
+        case 0xD1:
+            put32(in, inLength, m_type == 1 ? 0xA7A7A7A7 : 0);
+            return true;
+        case 0xC7:
+            put32(in, inLength, m_type == 2 ? 0xA79BCA95 : (m_type == 3 ? 0xB7DB5BB5 : 0));
+            return true;
+        case 0xC0:
+            put32(in, inLength, m_nor.busy(now) ? 1 : 0);
+            return true;
+        case 0xA5:
+            if (m_nor.busy(now)) {
+                return false;
+            }
+            if (in) {
+                m_nor.read(cmdBytes(cmd, 1, 3), in, inLength);
+            }
+            return true;
+        case 0xDA: {
+            const std::uint32_t address = cmdBytes(cmd, 1, 3);
+            if (cmdByte(cmd, 5) == 0xA5) {
+                m_nor.erase(address, now);
+            } else if (cmdByte(cmd, 5) == 0x5A) {
+                const std::uint8_t value = cmdByte(cmd, 4);
+                m_nor.program(address, &value, 1, now);
+            }
+            put32(in, inLength, 0);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+SimR4iSdhcHkCart::SimR4iSdhcHkCart(std::uint32_t swRev)
+    : m_nor(0x200000, 0x10000, norEraseTime, norProgramTime), m_sw_rev(swRev) {}
+
+bool SimR4iSdhcHkCart::command(std::uint64_t cmd, const std::uint8_t *, std::uint32_t,
+                               std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) {
+    switch (cmdByte(cmd, 0)) {
+        case 0xB7: {
+            std::uint32_t address;
+            if (cmdByte(cmd, 5) == 0x15 && !cmdBytes(cmd, 1, 4)) {
+                // the "unique key" lives at the end of the main data area
+                address = 0x2FE00;
+            } else if (m_sw_rev == 0x605 && cmdByte(cmd, 1) == 0x01) {
+                // 6.05 reads at 0x610000 up, of which only the low 5 bits of the top byte go out
+                address = ((cmdByte(cmd, 2) - 1) & 0x1F) << 16 | cmdBytes(cmd, 3, 2);
+            } else if (m_sw_rev != 0x605 && cmdByte(cmd, 5) == 0x22) {
+                address = (cmdByte(cmd, 2) & 0x1F) << 16 | cmdBytes(cmd, 3, 2);
+            } else {
+                return false;
+            }
+
+            if (m_nor.busy(now)) {
+                return false;
+            }
+            for (std::uint32_t i = 0; in && i < inLength; ++i) {
+                in[i] = hkDecrypt(m_nor.read(address + i));
+            }
+            return true;
+        }
+        case 0xC5:
+            put32(in, inLength, m_sw_rev);
+            return true;
+        case 0xD0:
+            put32(in, inLength, 0);
+            return true;
+        case 0xC0:
+            put32(in, inLength, m_nor.busy(now) ? 1 : 0);
+            return true;
+        case 0xD4: {
+            const std::uint32_t address = cmdBytes(cmd, 1, 3);
+            if (cmdByte(cmd, 5) == 0x01) {
+                m_nor.erase(address, now);
+            } else if (cmdByte(cmd, 5) == 0x03) {
+                const std::uint8_t value = hkEncrypt(cmdByte(cmd, 4));
+                m_nor.program(address, &value, 1, now);
+            }
+            put32(in, inLength, 0);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+SimDsttCart::SimDsttCart(std::uint16_t chipId)
+    : m_nor(dsttNor(chipId)), m_chip_id(chipId), m_intel(chipId == 0x9089 || chipId == 0x912C),
+      m_bypass_supported(chipId == 0xBA01), m_multi_erase_supported(chipId == 0x49C2 || chipId == 0xBA01) {
+    if (chipId != 0x041F && chipId != 0x80BF) {
+        m_cfi = cfiTable(m_nor, m_intel ? 1 : 2);
+    }
+    reset();
+}
+
+void SimDsttCart::reset() {
+    m_mode = Mode::Array;
+    m_cycle = 0;
+    m_pending = 0;
+    m_erasing = false;
+    m_last_program = 0xFF;
+    m_toggle = 0;
+    m_bypass = false;
+    m_bypass_exit = false;
+    m_erase_window = false;
+}
+
+void SimDsttCart::write(std::uint32_t address, std::uint8_t data, std::uint64_t now) {
+    if (m_intel) {
+        if (m_nor.busy(now)) {
+            if (data == 0x70) {
+                m_mode = Mode::Status;
+            }
+            return;
+        }
+
+        const std::uint8_t pending = m_pending;
+        m_pending = 0;
+        if (pending == 0x40 || pending == 0x10) {
+            m_mode = Mode::Status;
+            m_erasing = false;
+            m_nor.program(address, &data, 1, now);
+            return;
+        } else if (pending == 0x20) {
+            m_mode = Mode::Status;
+            if (data == 0xD0) {
+                m_erasing = true;
+                m_nor.erase(address, now);
+            }
+            return;
+        }
+
+        switch (data) {
+            case 0xFF: m_mode = Mode::Array; break;
+            case 0x70: m_mode = Mode::Status; break;
+            case 0x90: m_mode = Mode::Id; break;
+            case 0x98: m_mode = m_cfi.empty() ? m_mode : Mode::Cfi; break;
+            case 0x10:
+            case 0x20:
+            case 0x40: m_pending = data; break;
+            // 0x50 clears the error bits, which never get set here
+            default: break;
+        }
+        return;
+    }
+
+    // the window for more sectors closes with anything but another sector address
+    const bool eraseWindow = m_erase_window;
+    m_erase_window = false;
+    if (m_nor.busy(now)) {
+        if (eraseWindow && data == 0x30) {
+            m_erase_window = m_nor.eraseAlso(address);
+        }
+        return;
+    }
+    if (m_pending) {
+        m_pending = 0;
+        m_erasing = false;
+        m_last_program = data;
+        m_nor.program(address, &data, 1, now);
+        return;
+    }
+    if (m_bypass) {
+        // only A0 (program) and 90 00 (exit) are taken
+        if (m_bypass_exit) {
+            m_bypass_exit = false;
+            m_bypass = data != 0x00;
+        } else if (data == 0xA0) {
+            m_pending = data;
+        } else if (data == 0x90) {
+            m_bypass_exit = true;
+        }
+        return;
+    }
+    if (data == 0xF0) {
+        m_mode = Mode::Array;
+        m_cycle = 0;
+        return;
+    }
+
+    // byte mode CFI query
+    if (data == 0x98 && (address & 0x7FF) == 0xAA && !m_cfi.empty()) {
+        m_mode = Mode::Cfi;
+        m_cycle = 0;
+        return;
+    }
+
+    const bool unlock1 = (address & 0x7FF) == 0x555;
+    const bool unlock2 = (address & 0x7FF) == 0x2AA;
+    switch (m_cycle) {
+        case 0:
+        case 3:
+            m_cycle = (unlock1 && data == 0xAA) ? m_cycle + 1 : 0;
+            break;
+        case 1:
+        case 4:
+            m_cycle = (unlock2 && data == 0x55) ? m_cycle + 1 : 0;
+            break;
+        case 2:
+            m_cycle = 0;
+            if (!unlock1) {
+                break;
+            }
+            if (data == 0x90) {
+                m_mode = Mode::Id;
+            } else if (data == 0xA0) {
+                m_pending = data;
+            } else if (data == 0x80) {
+                m_cycle = 3;
+            } else if (data == 0x20 && m_bypass_supported) {
+                m_bypass = true;
+            }
+            break;
+        case 5:
+            m_cycle = 0;
+            if (data == 0x30) {
+                m_erasing = true;
+                m_erase_window = m_nor.erase(address, now) && m_multi_erase_supported;
+            }
+            break;
+    }
+}
+
+std::uint8_t SimDsttCart::status(std::uint64_t now) {
+    if (m_intel) {
+        return m_nor.busy(now) ? 0x00 : 0x80;
+    }
+
+    // DQ7 reads inverted while programming and 0 while erasing; DQ6 toggles either way
+    m_toggle ^= 0x40;
+    return (m_erasing ? 0 : (~m_last_program & 0x80)) | m_toggle;
+}
+
+bool SimDsttCart::command(std::uint64_t cmd, const std::uint8_t *, std::uint32_t,
+                          std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) {
+    const std::uint32_t address = cmdBytes(cmd, 1, 4);
+    switch (cmdByte(cmd, 0)) {
+        case 0x86:
+        case 0x88:
+            put32(in, inLength, 0);
+            return true;
+        case 0x87:
+            write(address, cmdByte(cmd, 6), now);
+            put32(in, inLength, 0);
+            return true;
+        case 0x00: {
+            m_erase_window = false;
+            if (!in) {
+                return true;
+            }
+
+            const bool busy = m_nor.busy(now);
+            if (busy || (m_intel && m_mode == Mode::Status)) {
+                std::memset(in, status(now), inLength);
+            } else if (m_mode == Mode::Id) {
+                put32(in, inLength, m_chip_id);
+            } else if (m_mode == Mode::Cfi) {
+                // byte mode: the query bytes sit at even addresses
+                for (std::uint32_t i = 0; i < inLength; ++i) {
+                    const std::uint32_t a = address + i;
+                    in[i] = (a & 1) || a / 2 >= m_cfi.size() ? 0 : m_cfi[a / 2];
+                }
+            } else {
+                m_nor.read(address, in, inLength);
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+SimR4iSdhcCart::SimR4iSdhcCart(int type, bool statusReadable)
+    : m_spi(0x200000, 0xC22015), m_type(type), m_status_readable(statusReadable), m_active(false) {}
+
+void SimR4iSdhcCart::reset() {
+    m_active = false;
+    m_page.clear();
+    m_spi.reset();
+}
+
+bool SimR4iSdhcCart::command(std::uint64_t cmd, const std::uint8_t *, std::uint32_t,
+                             std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) {
+    const std::uint8_t op = cmdByte(cmd, 0);
+    if (op == 0x68 || op == 0x66) {
+        if (op == (m_type == 1 ? 0x68 : 0x66)) {
+            m_active = true;
+        }
+        put32(in, inLength, 0);
+        return true;
+    }
+    if (op == 0xB7) {
+        // ROM shows the flash 1:1, with 0x8000-0x10000 moved to the end on type 2 carts and
+        // only with the 1:1 map at 0x40 on type 1 ones
+        static const std::uint8_t identityMap[8] = { 0x00, 0x00, 0x00, 0x00, 0x7F, 0xFF, 0xFF, 0xFF };
+        const SimNor &nor = m_spi.nor();
+        const std::uint32_t rom = romAddress(cmdBytes(cmd, 1, 4));
+        if (!m_active || (m_type == 1 && std::memcmp(nor.data() + 0x40, identityMap, sizeof(identityMap)))) {
+            return false;
+        }
+        if (in) {
+            nor.read(m_type == 2 && rom < 0x10000 ? rom + 0x1F0000 : rom, in, inLength);
+        }
+        return true;
+    }
+    if (op != 0x99 || !m_active) {
+        return false;
+    }
+
+    // 99 XY CC AA AA AA D1 D2 (norCmd): Y bytes out to the flash, X back;
+    // 99 PP D1 D2 (norRaw): two more bytes of a page, or the end of it if PP is F0
+    const std::uint8_t param = cmdByte(cmd, 1);
+    put32(in, inLength, 0);
+    if (param == 0x00 || param == 0xF0) {
+        if (!m_page.empty()) {
+            if (param == 0xF0) {
+                m_spi.transfer(m_page.data(), static_cast<std::uint32_t>(m_page.size()), nullptr, 0, now);
+                m_page.clear();
+            } else {
+                m_page.push_back(cmdByte(cmd, 2));
+                m_page.push_back(cmdByte(cmd, 3));
+            }
+        }
+        return true;
+    }
+
+    const std::uint8_t tx[6] = { cmdByte(cmd, 2), cmdByte(cmd, 3), cmdByte(cmd, 4),
+                                 cmdByte(cmd, 5), cmdByte(cmd, 6), cmdByte(cmd, 7) };
+    const std::uint32_t txLength = std::min<std::uint32_t>(param & 0xF, sizeof(tx));
+    if (tx[0] == 0x02) {
+        m_page.assign(tx, tx + txLength);
+        return true;
+    }
+
+    m_spi.transfer(tx, txLength, (param >> 4) ? in : nullptr, inLength, now);
+    if (tx[0] == 0x05 && !m_status_readable && in) {
+        std::memset(in, 0xFF, inLength);
+    }
+    return true;
+}
+
+SimAce3dsPlusCart::SimAce3dsPlusCart(bool sfdp, const std::vector<std::uint32_t> &aap)
+    : m_spi(0x200000, 0xC22015, sfdp), m_aap(aap), m_aap_done(0), m_sd_cmd(0) {}
+
+void SimAce3dsPlusCart::reset() {
+    m_aap_done = 0;
+    m_sd_cmd = 0;
+    m_spi.reset();
+}
+
+bool SimAce3dsPlusCart::command(std::uint64_t cmd, const std::uint8_t *, std::uint32_t,
+                                std::uint8_t *in, std::uint32_t inLength, std::uint64_t) {
+    switch (cmdByte(cmd, 0)) {
+        case 0xB7:
+            // ROM reads; the right ones unlock the cart, which then shows the flash through
+            // the map at 0x0-0x4000
+            if (m_aap_done < m_aap.size()) {
+                if (cmdBytes(cmd, 1, 4) == m_aap[m_aap_done]) {
+                    ++m_aap_done;
+                }
+                put32(in, inLength, 0xFFFFFFFF);
+            } else if (in) {
+                const std::uint32_t rom = romAddress(cmdBytes(cmd, 1, 4));
+                const SimNor &nor = m_spi.nor();
+                const std::uint32_t page = nor.read((rom >> 12) * 2) | nor.read((rom >> 12) * 2 + 1) << 8;
+                nor.read(page << 12 | (rom & 0xFFF), in, inLength);
+            }
+            return true;
+        case 0xB0:
+            put32(in, inLength, m_aap_done == m_aap.size() ? aceVersion : 0);
+            return true;
+        case 0xC0:
+            m_sd_cmd = cmdByte(cmd, 1);
+            return true;
+        case 0xC2:
+        case 0xC7:
+            return true;
+        case 0xB9:
+        case 0xC6:
+            put32(in, inLength, 0);
+            return true;
+        case 0xBA:
+        case 0xBF:
+            // one response that keeps the driver's SD init happy: SDHC, ready, CSD big enough
+            if (in) {
+                std::memset(in, 0, inLength);
+                const std::uint8_t resp[] = { m_sd_cmd, 0xC0, 0x00, 0x01, 0xC8, 0x00, 0x0A };
+                std::memcpy(in, resp, std::min<std::uint32_t>(sizeof(resp), inLength));
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool SimAce3dsPlusCart::spi(const std::uint8_t *out, std::uint32_t outLength, std::uint8_t *in, std::uint32_t inLength,
+                            std::uint64_t now) {
+    m_spi.transfer(out, outLength, in, inLength, now);
+    return true;
+}
+
+Flashcart *SimCartModel::flashcart() const {
+    for (Flashcart *cart : *flashcart_list) {
+        if (!std::strcmp(cart->getShortName(), driver)) {
+            return cart;
+        }
+    }
+    return nullptr;
+}
+
+const std::vector<SimCartModel> &simCartModels() {
+    static const std::vector<SimCartModel> models = {
+        { "ak2i-44", "ak2i", [] () -> SimCart * { return new SimAk2iCart(false); } },
+        { "ak2i-81", "ak2i", [] () -> SimCart * { return new SimAk2iCart(true); } },
+        { "r4igold-1", "R4iGold3DS", [] () -> SimCart * { return new SimR4iGoldCart(1); } },
+        { "r4igold-2", "R4iGold3DS", [] () -> SimCart * { return new SimR4iGoldCart(2); } },
+        { "r4igold-3", "R4iGold3DS", [] () -> SimCart * { return new SimR4iGoldCart(3); } },
+        { "r4isdhchk-605", "R4iSDHC.hk", [] () -> SimCart * { return new SimR4iSdhcHkCart(0x605); } },
+        { "r4isdhchk-707", "R4iSDHC.hk", [] () -> SimCart * { return new SimR4iSdhcHkCart(0x707); } },
+        { "dstt-49c2", "DSTT", [] () -> SimCart * { return new SimDsttCart(0x49C2); } },
+        { "dstt-041f", "DSTT", [] () -> SimCart * { return new SimDsttCart(0x041F); } },
+        { "dstt-80bf", "DSTT", [] () -> SimCart * { return new SimDsttCart(0x80BF); } },
+        { "dstt-ba01", "DSTT", [] () -> SimCart * { return new SimDsttCart(0xBA01); } },
+        { "dstt-9089", "DSTT", [] () -> SimCart * { return new SimDsttCart(0x9089); } },
+        { "dstt-912c", "DSTT", [] () -> SimCart * { return new SimDsttCart(0x912C); } },
+        { "r4isdhc-1", "r4isdhc", [] () -> SimCart * { return new SimR4iSdhcCart(1, true); } },
+        { "r4isdhc-1-nosr", "r4isdhc", [] () -> SimCart * { return new SimR4iSdhcCart(1, false); } },
+        { "r4isdhc-2", "r4isdhc", [] () -> SimCart * { return new SimR4iSdhcCart(2, true); } },
+        { "ace3dsplus", "Ace3DSPlus", [] () -> SimCart * { return new SimAce3dsPlusCart(); } },
+        { "ace3dsplus-nosfdp", "Ace3DSPlus", [] () -> SimCart * { return new SimAce3dsPlusCart(false); } },
+        // Metroid Prime Hunters unlock; one only the sweep's second pass gets
+        { "ace3dsplus-mph", "Ace3DSPlus", [] () -> SimCart * { return new SimAce3dsPlusCart(true, { 0x1159400, 0xB7400 }); } },
+        { "ace3dsplus-sweep", "Ace3DSPlus", [] () -> SimCart * { return new SimAce3dsPlusCart(true, { 0x1A0000, 0x40000 }); } },
+    };
+    return models;
+}
+
+const SimCartModel *findSimCartModel(const char *name) {
+    for (const SimCartModel &model : simCartModels()) {
+        if (!std::strcmp(model.name, name)) {
+            return &model;
+        }
+    }
+    return nullptr;
+}
+}
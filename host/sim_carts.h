@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "../device.h"
+#include "sim_transport.h"
+#include "sim_nor.h"
+
+namespace flashcart_core {
+
+/// Acekard 2i: D1 revision, C2 lock/unlock, B7 reads, D4 erase and byte program, C0 busy.
+class SimAk2iCart : public SimCart {
+    SimNor m_nor;
+    std::uint32_t m_revision;
+    bool m_unlocked;
+
+public:
+    /// HW-81 has 16MB of flash and its own erase/program commands; HW-44 has 2MB.
+    explicit SimAk2iCart(bool hw81);
+
+    void reset() override { m_unlocked = false; }
+    SimNor *flash() override { return &m_nor; }
+    bool command(std::uint64_t cmd, const std::uint8_t *out, std::uint32_t outLength,
+                 std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) override;
+};
+
+/// R4i Gold 3DS: D1/C7 revision and type, A5 reads, DA erase and byte program, C0 busy.
+class SimR4iGoldCart : public SimCart {
+    SimNor m_nor;
+    int m_type;
+
+public:
+    /// `type` as the driver numbers them: 1 (RTS, rev A5-A7), 2 (rev 4-5), 3 (rev 6-8).
+    explicit SimR4iGoldCart(int type);
+
+    SimNor *flash() override { return &m_nor; }
+    bool command(std::uint64_t cmd, const std::uint8_t *out, std::uint32_t outLength,
+                 std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) override;
+};
+
+/// R4 SDHC Dual-Core (r4isdhc.hk): B7 reads and D4 byte programs, both through the cart's
+/// bit permutation, C5 software revision, C0 busy.
+class SimR4iSdhcHkCart : public SimCart {
+    SimNor m_nor;
+    std::uint32_t m_sw_rev;
+
+public:
+    /// `swRev` is 0x605 or 0x707 (which read differently).
+    explicit SimR4iSdhcHkCart(std::uint32_t swRev);
+
+    SimNor *flash() override { return &m_nor; }
+    bool command(std::uint64_t cmd, const std::uint8_t *out, std::uint32_t outLength,
+                 std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) override;
+};
+
+/// DSTT: a 64K window on a parallel NOR, driven through raw bus writes (87) and reads (00).
+///
+/// AMD/JEDEC chips take the 5555/2AAA unlock sequences and report progress by data
+/// polling (DQ7) and toggling (DQ6); Intel chips take single-cycle commands and report
+/// through their status register.
+class SimDsttCart : public SimCart {
+    enum class Mode { Array, Id, Status, Cfi };
+
+    SimNor m_nor;
+    std::uint16_t m_chip_id;
+    bool m_intel;
+    Mode m_mode;
+    std::uint8_t m_cycle;
+    /// Intel: the setup command waiting for its second cycle; AMD: A0 seen.
+    std::uint8_t m_pending;
+    bool m_erasing;
+    std::uint8_t m_last_program;
+    std::uint8_t m_toggle;
+    /// AMD unlock bypass: supported by the chip, entered, 90 (the first exit cycle) seen.
+    bool m_bypass_supported;
+    bool m_bypass;
+    bool m_bypass_exit;
+    /// AMD multi-sector erase: supported by the chip, and still taking more sectors.
+    bool m_multi_erase_supported;
+    bool m_erase_window;
+    /// The CFI query answer, empty if the chip doesn't have one.
+    std::vector<std::uint8_t> m_cfi;
+
+    void write(std::uint32_t address, std::uint8_t data, std::uint64_t now);
+    std::uint8_t status(std::uint64_t now);
+
+public:
+    /// Chips with a known layout: 49C2, 041F, 80BF, BA01 (AMD style; 49C2 and BA01 take
+    /// several sectors per erase, BA01 also has unlock bypass), 9089, 912C (Intel style).
+    /// All but 041F and 80BF answer a CFI query, in byte mode.
+    explicit SimDsttCart(std::uint16_t chipId);
+
+    void reset() override;
+    SimNor *flash() override { return &m_nor; }
+    bool command(std::uint64_t cmd, const std::uint8_t *out, std::uint32_t outLength,
+                 std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) override;
+};
+
+/// R4iSDHC family: an SPI NOR behind an FPGA that takes SPI transactions in 99-commands.
+///
+/// The cart answers FF until unlocked (68 for type 1 from RAW, 66 for type 2 from KEY2).
+/// B7 reads show the flash as the driver expects ROM to be mapped.
+class SimR4iSdhcCart : public SimCart {
+    SimSpiNor m_spi;
+    int m_type;
+    bool m_status_readable;
+    bool m_active;
+    /// A page program being sent over several commands.
+    std::vector<std::uint8_t> m_page;
+
+public:
+    /// Some carts don't pass the status register through; the driver then has to calibrate.
+    SimR4iSdhcCart(int type, bool statusReadable);
+
+    void reset() override;
+    SimNor *flash() override { return &m_spi.nor(); }
+    bool command(std::uint64_t cmd, const std::uint8_t *out, std::uint32_t outLength,
+                 std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) override;
+};
+
+/// Ace3DS Plus: B0 version once the anti-anti-piracy reads are done, a token SD controller
+/// (C0, B0 status, B9, BA/BF buffer), and an SPI NOR on AUXSPI, which B7 reads show through
+/// the map at 0x0-0x4000 once the cart is unlocked.
+class SimAce3dsPlusCart : public SimCart {
+    SimSpiNor m_spi;
+    /// The ROM reads (B7) that unlock the cart, in order; other reads in between are fine.
+    std::vector<std::uint32_t> m_aap;
+    std::size_t m_aap_done;
+    std::uint8_t m_sd_cmd;
+
+public:
+    /// The default unlock is the Deep Labyrinth one.
+    explicit SimAce3dsPlusCart(bool sfdp = true,
+                               const std::vector<std::uint32_t> &aap = { 0x10FE00, 0x167400 });
+
+    void reset() override;
+    SimNor *flash() override { return &m_spi.nor(); }
+    bool command(std::uint64_t cmd, const std::uint8_t *out, std::uint32_t outLength,
+                 std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) override;
+    bool spi(const std::uint8_t *out, std::uint32_t outLength, std::uint8_t *in, std::uint32_t inLength,
+             std::uint64_t now) override;
+};
+
+/// A cart configuration the host tools know by name ("ak2i-44", "dstt-9089", ...).
+struct SimCartModel {
+    const char *name;
+    /// The driver's getShortName().
+    const char *driver;
+    SimCart *(*make)();
+
+    /// The driver for this model from flashcart_list, or null.
+    Flashcart *flashcart() const;
+};
+
+const std::vector<SimCartModel> &simCartModels();
+const SimCartModel *findSimCartModel(const char *name);
+}
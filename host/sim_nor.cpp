@@ -0,0 +1,216 @@
+#include <cstring>
+#include <algorithm>
+
+#include "sim_nor.h"
+
+namespace flashcart_core {
+
+namespace {
+// datasheet typicals for a 2MB SPI NOR (MX25L1606E)
+const std::uint32_t spiEraseTime = 45000;
+const std::uint32_t spiProgramTime = 700;
+const std::uint32_t spiPageSize = 0x100;
+}
+
+SimNor::SimNor(std::uint32_t size, std::uint32_t sectorSize, std::uint32_t eraseTime, std::uint32_t programTime)
+    : m_own(size, 0xFF), m_mapped(nullptr), m_size(size), m_sector_size(sectorSize), m_erase_time(eraseTime),
+      m_program_time(programTime), m_busy_until(0), m_erases(0), m_programs(0) {}
+
+void SimNor::fill(std::uint32_t seed) {
+    std::uint32_t x = seed | 1;
+    std::uint8_t *p = data();
+    for (std::uint32_t i = 0; i < m_size; ++i) {
+        // xorshift32
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        p[i] = static_cast<std::uint8_t>(x);
+    }
+}
+
+bool SimNor::sector(std::uint32_t address, std::uint32_t *start, std::uint32_t *size) const {
+    if (address >= m_size) {
+        return false;
+    }
+
+    std::uint32_t s = 0;
+    for (std::uint32_t bootSize : m_boot_sectors) {
+        if (address < s + bootSize) {
+            *start = s;
+            *size = bootSize;
+            return true;
+        }
+        s += bootSize;
+    }
+
+    *start = s + (address - s) / m_sector_size * m_sector_size;
+    *size = std::min<std::uint32_t>(m_sector_size, m_size - *start);
+    return true;
+}
+
+bool SimNor::erase(std::uint32_t address, std::uint64_t now) {
+    std::uint32_t start, length;
+    if (busy(now) || !sector(address, &start, &length)) {
+        return false;
+    }
+
+    std::memset(data() + start, 0xFF, length);
+    m_busy_until = now + m_erase_time;
+    ++m_erases;
+    return true;
+}
+
+bool SimNor::eraseAlso(std::uint32_t address) {
+    std::uint32_t start, length;
+    if (!sector(address, &start, &length)) {
+        return false;
+    }
+
+    std::memset(data() + start, 0xFF, length);
+    m_busy_until += m_erase_time;
+    ++m_erases;
+    return true;
+}
+
+bool SimNor::program(std::uint32_t address, const std::uint8_t *data, std::uint32_t length, std::uint64_t now) {
+    if (busy(now) || address >= m_size || length > m_size - address) {
+        return false;
+    }
+
+    std::uint8_t *p = this->data();
+    for (std::uint32_t i = 0; i < length; ++i) {
+        p[address + i] &= data[i];
+    }
+    m_busy_until = now + m_program_time;
+    ++m_programs;
+    return true;
+}
+
+void SimNor::read(std::uint32_t address, std::uint8_t *buf, std::uint32_t length) const {
+    for (std::uint32_t i = 0; i < length; ++i) {
+        buf[i] = read(address + i);
+    }
+}
+
+namespace {
+/// An SFDP typical time field (5 bit count, 2 bit unit) for `time` us, in the
+/// coarsest of `units` (in us, finest first) that still fits.
+std::uint32_t sfdpTime(std::uint32_t time, const std::uint32_t *units, unsigned int unitCount) {
+    unsigned int unit = 0;
+    while (unit + 1 < unitCount && (time + units[unit] - 1) / units[unit] > 32) {
+        ++unit;
+    }
+    const std::uint32_t count = std::max<std::uint32_t>((time + units[unit] - 1) / units[unit], 1);
+    return unit << 5 | (std::min<std::uint32_t>(count, 32) - 1);
+}
+
+/// JEDEC SFDP (JESD216B) with just the basic flash parameter table.
+std::vector<std::uint8_t> sfdpTable(const SimNor &nor) {
+    static const std::uint32_t eraseUnits[] = { 1000, 16000, 128000, 1000000 };
+    static const std::uint32_t programUnits[] = { 8, 64 };
+    const std::uint32_t basic = 0x30;
+
+    std::uint32_t dw[16] = {};
+    // 4K erase with 20, 1-1-2 fast read (DREAD), 3-byte addresses, 64+ byte writes
+    dw[0] = 0x00010000 | 0x20 << 8 | 1 << 2 | 1;
+    dw[1] = nor.size() * 8 - 1;
+    // DREAD: 3B with 8 dummy clocks
+    dw[3] = 0x3B08;
+    // erase type 1: 4K, 20
+    dw[7] = 0x20 << 8 | 12;
+    // max erase and program times are 16x typical
+    dw[9] = sfdpTime(nor.eraseTime(), eraseUnits, 4) << 4 | 7;
+    dw[10] = sfdpTime(nor.programTime(), programUnits, 2) << 8 | 8 << 4 | 7;
+
+    std::vector<std::uint8_t> t(basic + sizeof(dw), 0xFF);
+    const std::uint8_t header[] = { 'S', 'F', 'D', 'P', 0x06, 0x01, 0x00, 0xFF,
+                                    0x00, 0x06, 0x01, 16, basic, 0x00, 0x00, 0xFF };
+    std::memcpy(t.data(), header, sizeof(header));
+    for (unsigned int i = 0; i < 16; ++i) {
+        for (unsigned int b = 0; b < 4; ++b) {
+            t[basic + i * 4 + b] = static_cast<std::uint8_t>(dw[i] >> (b * 8));
+        }
+    }
+    return t;
+}
+}
+
+SimSpiNor::SimSpiNor(std::uint32_t size, std::uint32_t id, bool sfdp)
+    : m_nor(size, 0x1000, spiEraseTime, spiProgramTime), m_id(id), m_wel(false) {
+    if (sfdp) {
+        m_sfdp = sfdpTable(m_nor);
+    }
+}
+
+void SimSpiNor::transfer(const std::uint8_t *out, std::uint32_t outLength, std::uint8_t *in, std::uint32_t inLength,
+                         std::uint64_t now) {
+    if (in) {
+        std::memset(in, 0xFF, inLength);
+    }
+    if (!outLength) {
+        return;
+    }
+
+    const std::uint8_t cmd = out[0];
+    const std::uint32_t address = outLength >= 4 ? (out[1] << 16 | out[2] << 8 | out[3]) : 0;
+    if (m_nor.busy(now)) {
+        if (cmd == 0x05 && in) {
+            std::memset(in, status(now), inLength);
+        }
+        return;
+    }
+
+    switch (cmd) {
+        case 0x03:
+        case 0x0B:
+        case 0x3B:
+            if (in && outLength >= 4) {
+                m_nor.read(address, in, inLength);
+            }
+            break;
+        case 0x05:
+            if (in) {
+                std::memset(in, status(now), inLength);
+            }
+            break;
+        case 0x06:
+            m_wel = true;
+            break;
+        case 0x04:
+            m_wel = false;
+            break;
+        case 0x5A:
+            // address, then a dummy byte
+            for (std::uint32_t i = 0; in && outLength >= 5 && !m_sfdp.empty() && i < inLength; ++i) {
+                in[i] = address + i < m_sfdp.size() ? m_sfdp[address + i] : 0xFF;
+            }
+            break;
+        case 0x9F:
+            for (std::uint32_t i = 0; in && i < inLength; ++i) {
+                in[i] = m_id >> (16 - (i % 3) * 8);
+            }
+            break;
+        case 0x20:
+            if (m_wel && outLength >= 4) {
+                m_nor.erase(address, now);
+                m_wel = false;
+            }
+            break;
+        case 0x02:
+            if (m_wel && outLength > 4) {
+                // a page program wraps around within the page
+                std::uint8_t page[spiPageSize];
+                const std::uint32_t base = address & ~(spiPageSize - 1);
+                std::memset(page, 0xFF, sizeof(page));
+                for (std::uint32_t i = 4; i < outLength; ++i) {
+                    page[(address + i - 4) & (spiPageSize - 1)] &= out[i];
+                }
+                m_nor.program(base, page, spiPageSize, now);
+                m_wel = false;
+            }
+            break;
+        default:
+            break;
+    }
+}
+}
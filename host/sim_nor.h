@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace flashcart_core {
+
+/// RAM-backed NOR flash for SimCart models.
+///
+/// Erasing sets a whole sector to FF, programming can only clear bits, and both keep the
+/// chip busy for a while, in simulated time; what the chip does with other commands while
+/// busy is up to the model using it.
+class SimNor {
+    std::vector<std::uint8_t> m_own;
+    /// Storage someone else owns, see map().
+    std::uint8_t *m_mapped;
+    std::uint32_t m_size;
+    std::vector<std::uint32_t> m_boot_sectors;
+    std::uint32_t m_sector_size;
+    /// In microseconds.
+    std::uint32_t m_erase_time;
+    std::uint32_t m_program_time;
+    std::uint64_t m_busy_until;
+    std::uint32_t m_erases;
+    std::uint32_t m_programs;
+
+public:
+    SimNor(std::uint32_t size, std::uint32_t sectorSize, std::uint32_t eraseTime, std::uint32_t programTime);
+
+    /// Sizes of the first few sectors, for boot block chips; the rest are `sectorSize`.
+    void bootSectors(const std::vector<std::uint32_t> &sizes) { m_boot_sectors = sizes; }
+
+    /// Puts the chip's contents in `data` (e.g. a mapped image file) instead; the chip
+    /// becomes `size` bytes large, and `data` has to outlive it.
+    void map(std::uint8_t *data, std::uint32_t size) { m_mapped = data; m_size = size; }
+
+    std::uint32_t size() const { return m_size; }
+    std::uint8_t *data() { return m_mapped ? m_mapped : m_own.data(); }
+    const std::uint8_t *data() const { return m_mapped ? m_mapped : m_own.data(); }
+    /// Fills the chip with junk, so nothing starts out erased.
+    void fill(std::uint32_t seed);
+
+    std::uint32_t eraseTime() const { return m_erase_time; }
+    std::uint32_t programTime() const { return m_program_time; }
+
+    bool busy(std::uint64_t now) const { return now < m_busy_until; }
+    /// Finds the sector holding `address`.
+    bool sector(std::uint32_t address, std::uint32_t *start, std::uint32_t *size) const;
+
+    /// Starts erasing the sector holding `address`; false if busy or out of range.
+    bool erase(std::uint32_t address, std::uint64_t now);
+    /// Adds the sector holding `address` to the erase in progress, as AMD chips allow
+    /// right after a sector erase command; false if out of range.
+    bool eraseAlso(std::uint32_t address);
+    /// Starts programming `length` bytes at `address`; false if busy or out of range.
+    bool program(std::uint32_t address, const std::uint8_t *data, std::uint32_t length, std::uint64_t now);
+
+    std::uint8_t read(std::uint32_t address) const { return address < m_size ? data()[address] : 0xFF; }
+    void read(std::uint32_t address, std::uint8_t *buf, std::uint32_t length) const;
+
+    std::uint32_t erases() const { return m_erases; }
+    std::uint32_t programs() const { return m_programs; }
+};
+
+/// An SPI NOR flash (MX25L / W25Q style: 4K sectors, 256-byte pages) on top of SimNor.
+///
+/// Knows READ (03), FAST_READ (0B), DREAD (3B), RDSR (05), WREN (06), WRDI (04),
+/// SE (20), PP (02), RDID (9F) and, if it has one, RDSFDP (5A). While busy, only RDSR
+/// is answered.
+class SimSpiNor {
+    SimNor m_nor;
+    std::uint32_t m_id;
+    bool m_wel;
+    /// The SFDP area, empty if the chip doesn't have one.
+    std::vector<std::uint8_t> m_sfdp;
+
+public:
+    /// `id` is the RDID response, manufacturer in the high byte.
+    SimSpiNor(std::uint32_t size, std::uint32_t id, bool sfdp = true);
+
+    SimNor &nor() { return m_nor; }
+    void reset() { m_wel = false; }
+    std::uint8_t status(std::uint64_t now) const { return (m_nor.busy(now) ? 1 : 0) | (m_wel ? 2 : 0); }
+
+    /// One transaction: `out` is shifted in, then `inLength` bytes are shifted out to `in`.
+    void transfer(const std::uint8_t *out, std::uint32_t outLength, std::uint8_t *in, std::uint32_t inLength,
+                  std::uint64_t now);
+};
+}
@@ -0,0 +1,167 @@
+#include <cstring>
+#include <algorithm>
+
+#include "sim_transport.h"
+#include "../bus_timing.h"
+
+namespace flashcart_core {
+
+namespace {
+// card bus clock: 33.51MHz / 5 or / 8
+const std::uint64_t fastClockPs = 149198;
+const std::uint64_t slowClockPs = 238717;
+// AUXSPI at its fastest, 4MHz: 2us a byte
+const std::uint64_t spiByteNs = 2000;
+// ncgc::delay() counts ARM9 cycles
+const std::uint64_t delayPerUs = 67;
+// reset and header read, and the KEY1 handshake; roughly what ncgc takes on hardware
+const std::uint64_t initNs = 10000000;
+const std::uint64_t key1Ns = 2000000;
+const std::uint64_t key2Ns = 100000;
+}
+
+bool SimRomCart::command(std::uint64_t cmd, const std::uint8_t *, std::uint32_t,
+                         std::uint8_t *in, std::uint32_t inLength, std::uint64_t) {
+    if (!in) {
+        return true;
+    }
+
+    switch (cmd & 0xFF) {
+        case 0x90:
+        case 0xB8:
+            for (std::uint32_t i = 0; i < inLength; ++i) {
+                in[i] = m_chip_id >> ((i % 4) * 8);
+            }
+            return true;
+        case 0xB7: {
+            const std::uint32_t address = ((cmd >> 8) & 0xFF) << 24 | ((cmd >> 16) & 0xFF) << 16
+                | ((cmd >> 24) & 0xFF) << 8 | ((cmd >> 32) & 0xFF);
+            for (std::uint32_t i = 0; i < inLength; ++i) {
+                in[i] = address + i < m_size ? m_rom[address + i] : 0xFF;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+void SimTransport::attach(SimCart *cart) {
+    m_cart = cart;
+    m_state = CardState::Raw;
+    m_time_ns = 0;
+    m_bus_ns = 0;
+    m_transfers = 0;
+    m_bytes = 0;
+}
+
+void SimTransport::transfer(std::uint64_t ns, std::uint32_t bytes) {
+    advance(ns);
+    m_bus_ns += ns;
+    ++m_transfers;
+    m_bytes += bytes;
+}
+
+std::uint64_t SimTransport::commandTime(std::uint32_t flags, std::uint32_t size) {
+    const BusTiming timing = BusTiming::fromFlags(flags);
+    // 8 command bytes, the first gap, the data, and the second gap before every
+    // 0x200-byte block after the first
+    const std::uint64_t blocks = size ? (size - 1) / 0x200 : 0;
+    const std::uint64_t clocks = 8 + timing.latency1 + size + blocks * timing.latency2;
+    return clocks * (timing.slow_clock ? slowClockPs : fastClockPs) / 1000;
+}
+
+CardErr SimTransport::sendCommand(std::uint64_t cmd, void *buf, std::uint32_t size, std::uint32_t flags, bool) {
+    if (!m_cart) {
+        return CardErr(-1);
+    }
+
+    std::uint8_t *in = static_cast<std::uint8_t *>(buf);
+    if (!m_cart->command(cmd, nullptr, 0, in, size, now()) && in) {
+        std::memset(in, 0xFF, size);
+    }
+    transfer(commandTime(flags, size), size);
+    return CardErr();
+}
+
+CardErr SimTransport::sendWriteCommand(std::uint64_t cmd, const void *buf, std::uint32_t size, std::uint32_t flags) {
+    if (!m_cart) {
+        return CardErr(-1);
+    }
+
+    m_cart->command(cmd, static_cast<const std::uint8_t *>(buf), size, nullptr, 0, now());
+    transfer(commandTime(flags, size), size);
+    return CardErr();
+}
+
+CardErr SimTransport::sendSpi(const std::uint8_t *cmd, std::uint32_t cmdLength, std::uint8_t *resp, std::uint32_t respLength) {
+    if (!m_cart) {
+        return CardErr(-1);
+    }
+
+    if (!m_cart->spi(cmd, cmdLength, resp, respLength, now()) && resp) {
+        std::memset(resp, 0xFF, respLength);
+    }
+    transfer((cmdLength + respLength) * spiByteNs, cmdLength + respLength);
+    return CardErr();
+}
+
+CardErr SimTransport::readData(std::uint32_t address, void *buf, std::uint32_t size) {
+    // as ncgc does it: KEY2 0xB7 reads, 0x200 bytes at a time
+    if (m_state != CardState::Key2) {
+        return CardErr(-1, true);
+    }
+
+    std::uint8_t *p = static_cast<std::uint8_t *>(buf);
+    for (std::uint32_t i = 0; i < size; i += 0x200) {
+        const std::uint32_t a = address + i;
+        const std::uint64_t cmd = 0xB7 | static_cast<std::uint64_t>(a >> 24 & 0xFF) << 8
+            | static_cast<std::uint64_t>(a >> 16 & 0xFF) << 16 | static_cast<std::uint64_t>(a >> 8 & 0xFF) << 24
+            | static_cast<std::uint64_t>(a & 0xFF) << 32;
+        std::uint8_t block[0x200];
+        CardErr err = sendCommand(cmd, block, sizeof(block), 0xA7586000, false);
+        if (err) {
+            return err;
+        }
+        if (p) {
+            std::memcpy(p + i, block, std::min<std::uint32_t>(sizeof(block), size - i));
+        }
+    }
+    return CardErr();
+}
+
+CardErr SimTransport::init() {
+    if (!m_cart) {
+        return CardErr(-1);
+    }
+
+    m_cart->reset();
+    m_state = CardState::Raw;
+    advance(initNs);
+    return CardErr();
+}
+
+CardErr SimTransport::beginKey1(const CardSecureParams &) {
+    if (m_state != CardState::Raw) {
+        return CardErr(-1);
+    }
+
+    m_state = CardState::Key1;
+    advance(key1Ns);
+    return CardErr();
+}
+
+CardErr SimTransport::beginKey2() {
+    if (m_state != CardState::Key1) {
+        return CardErr(-1);
+    }
+
+    m_state = CardState::Key2;
+    advance(key2Ns);
+    return CardErr();
+}
+
+void SimTransport::delay(std::uint32_t delay) {
+    advance(static_cast<std::uint64_t>(delay) * 1000 / delayPerUs);
+}
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+
+#include "../card_transport.h"
+
+namespace flashcart_core {
+class SimNor;
+
+/// A simulated cart: what it answers to each command. See SimTransport.
+class SimCart {
+public:
+    virtual ~SimCart() {}
+
+    /// Power cycle.
+    virtual void reset() {}
+    /// The cart's flash, for tests and tools to look at; null if it has none.
+    virtual SimNor *flash() { return nullptr; }
+
+    /// Handles a card bus command at simulated time `now` (in microseconds). `out` is the
+    /// data sent with a write command; `in` (if not null) gets the response.
+    /// Returns false if the cart doesn't answer, which reads as 0xFF like an open bus.
+    virtual bool command(std::uint64_t cmd, const std::uint8_t *out, std::uint32_t outLength,
+                         std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) = 0;
+    /// Handles an AUXSPI transfer; carts without SPI don't answer.
+    virtual bool spi(const std::uint8_t *out, std::uint32_t outLength, std::uint8_t *in, std::uint32_t inLength,
+                     std::uint64_t now) { return false; }
+};
+
+/// A cart that's just a ROM image: answers chip ID (0x90, 0xB8) and reads (0xB7).
+class SimRomCart : public SimCart {
+    const std::uint8_t *m_rom;
+    std::uint32_t m_size;
+    std::uint32_t m_chip_id;
+
+public:
+    /// `rom` must stay alive for as long as this is used.
+    SimRomCart(const void *rom, std::uint32_t size, std::uint32_t chipId = 0x00000FC2)
+        : m_rom(static_cast<const std::uint8_t *>(rom)), m_size(size), m_chip_id(chipId) {}
+
+    bool command(std::uint64_t cmd, const std::uint8_t *out, std::uint32_t outLength,
+                 std::uint8_t *in, std::uint32_t inLength, std::uint64_t now) override;
+};
+
+/// CardTransport to a simulated cart, for running the drivers on a PC without hardware.
+///
+/// Commands go to the SimCart in the clear (the encryption is the transport's business,
+/// so KEY1/KEY2 only change state()). Time is simulated: each transfer takes as long as it
+/// would on the DS card bus with the ROMCNT it was sent with, and delays take as long as
+/// asked, so BusyWait and the stats see realistic timings.
+class SimTransport : public CardTransport {
+    SimCart *m_cart;
+    CardState m_state;
+    std::uint64_t m_time_ns;
+    std::uint64_t m_bus_ns;
+    std::uint32_t m_transfers;
+    std::uint64_t m_bytes;
+
+    void advance(std::uint64_t ns) { m_time_ns += ns; }
+    void transfer(std::uint64_t ns, std::uint32_t bytes);
+
+public:
+    explicit SimTransport(SimCart *cart = nullptr) { attach(cart); }
+
+    /// Attaches a cart and starts the clock from 0.
+    void attach(SimCart *cart);
+    SimCart *cart() { return m_cart; }
+
+    /// Simulated time spent transferring on the bus, not counting delays, in nanoseconds.
+    std::uint64_t busTime() const { return m_bus_ns; }
+    std::uint32_t transfers() const { return m_transfers; }
+    std::uint64_t bytes() const { return m_bytes; }
+
+    /// How long one command with `size` bytes of data takes with ROMCNT `flags`.
+    static std::uint64_t commandTime(std::uint32_t flags, std::uint32_t size);
+
+    CardErr sendCommand(std::uint64_t cmd, void *buf, std::uint32_t size, std::uint32_t flags, bool flagsAsIs) override;
+    CardErr sendWriteCommand(std::uint64_t cmd, const void *buf, std::uint32_t size, std::uint32_t flags) override;
+    CardErr sendSpi(const std::uint8_t *cmd, std::uint32_t cmdLength, std::uint8_t *resp, std::uint32_t respLength) override;
+    CardErr readData(std::uint32_t address, void *buf, std::uint32_t size) override;
+
+    CardErr init() override;
+    CardErr beginKey1(const CardSecureParams &params) override;
+    CardErr beginKey2() override;
+    CardState state() override { return m_state; }
+    void state(CardState state) override { m_state = state; }
+
+    void delay(std::uint32_t delay) override;
+    std::uint64_t now() override { return m_time_ns / 1000; }
+};
+}
@@ -0,0 +1,249 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "usb_transport.h"
+#include "../card_batch.h"
+
+namespace flashcart_core {
+using platform::logMessage;
+
+namespace {
+/// The first 8 bytes of an SPI transfer sending `cmd`, then `data`.
+std::uint64_t spiCommand(const std::uint8_t *cmd, std::uint32_t cmdLength, const std::uint8_t *data,
+                         std::uint32_t dataLength) {
+    std::uint64_t cmd64 = 0;
+    for (std::uint32_t i = 0; i < std::min<std::uint32_t>(cmdLength + dataLength, 8); ++i) {
+        cmd64 |= static_cast<std::uint64_t>(i < cmdLength ? cmd[i] : data[i - cmdLength]) << (i * 8);
+    }
+    return cmd64;
+}
+}
+
+bool UsbTransport::open(const char *path) {
+    close();
+    m_fd = ::open(path, O_RDWR | O_NOCTTY);
+    if (m_fd < 0) {
+        logMessage(LOG_ERR, "UsbTransport: can't open %s: %s", path, std::strerror(errno));
+        return false;
+    }
+
+    // CDC ACM: the baud rate means nothing, but the tty must not mangle the bytes
+    struct termios tio;
+    if (isatty(m_fd) && tcgetattr(m_fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(m_fd, TCSANOW, &tio);
+        tcflush(m_fd, TCIOFLUSH);
+    }
+    return true;
+}
+
+void UsbTransport::close() {
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+bool UsbTransport::writeAll(const void *data, std::uint32_t length) {
+    const std::uint8_t *p = static_cast<const std::uint8_t *>(data);
+    while (length) {
+        ssize_t n = ::write(m_fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            logMessage(LOG_ERR, "UsbTransport: write failed: %s", std::strerror(errno));
+            close();
+            return false;
+        }
+        p += n;
+        length -= static_cast<std::uint32_t>(n);
+    }
+    return true;
+}
+
+bool UsbTransport::readAll(void *data, std::uint32_t length) {
+    std::uint8_t *p = static_cast<std::uint8_t *>(data);
+    while (length) {
+        ssize_t n = ::read(m_fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            logMessage(LOG_ERR, "UsbTransport: read failed: %s", n ? std::strerror(errno) : "reader gone");
+            // the stream is out of step now, there's no getting it back
+            close();
+            return false;
+        }
+        p += n;
+        length -= static_cast<std::uint32_t>(n);
+    }
+    return true;
+}
+
+bool UsbTransport::request(CardRecordKind kind, std::uint64_t cmd, std::uint32_t romcnt, std::uint8_t flags,
+                           const void *out, std::uint32_t outLength, std::uint32_t inLength,
+                           const void *more, std::uint32_t moreLength) {
+    if (m_fd < 0) {
+        return false;
+    }
+
+    CardRecord rec;
+    std::memset(&rec, 0, sizeof(rec));
+    rec.kind = static_cast<std::uint8_t>(kind);
+    rec.flags = flags;
+    rec.cmd = cmd;
+    rec.romcnt = romcnt;
+    rec.out_length = outLength + moreLength;
+    rec.in_length = inLength;
+    return writeAll(&rec, sizeof(rec)) && (!outLength || writeAll(out, outLength))
+        && (!moreLength || writeAll(more, moreLength));
+}
+
+CardErr UsbTransport::response(CardRecord *rec, void *in, std::uint32_t inLength) {
+    if (m_fd < 0 || !readAll(rec, sizeof(*rec))) {
+        return CardErr(-1);
+    }
+
+    // the reader may send back less (or more) than asked for
+    std::uint8_t *p = static_cast<std::uint8_t *>(in);
+    std::uint8_t discard[64];
+    for (std::uint32_t i = 0; i < rec->in_length; ) {
+        const std::uint32_t n = (p && i < inLength) ? std::min(inLength - i, rec->in_length - i)
+            : std::min<std::uint32_t>(sizeof(discard), rec->in_length - i);
+        if (!readAll((p && i < inLength) ? p + i : discard, n)) {
+            return CardErr(-1);
+        }
+        i += n;
+    }
+
+    if (rec->flags & CardRecord::Failed) {
+        return CardErr(rec->err, rec->flags & CardRecord::Unsupported);
+    }
+    return CardErr();
+}
+
+CardErr UsbTransport::call(CardRecordKind kind, std::uint64_t cmd, std::uint32_t romcnt, std::uint8_t flags,
+                           const void *out, std::uint32_t outLength, void *in, std::uint32_t inLength) {
+    CardRecord rec;
+    if (!request(kind, cmd, romcnt, flags, out, outLength, inLength)) {
+        return CardErr(-1);
+    }
+    return response(&rec, in, inLength);
+}
+
+CardErr UsbTransport::sendCommand(std::uint64_t cmd, void *buf, std::uint32_t size, std::uint32_t flags, bool flagsAsIs) {
+    return call(CardRecordKind::Command, cmd, flags, flagsAsIs ? CardRecord::FlagsAsIs : 0, nullptr, 0, buf, size);
+}
+
+CardErr UsbTransport::sendWriteCommand(std::uint64_t cmd, const void *buf, std::uint32_t size, std::uint32_t flags) {
+    return call(CardRecordKind::WriteCommand, cmd, flags, 0, buf, size, nullptr, 0);
+}
+
+CardErr UsbTransport::sendSpi(const std::uint8_t *cmd, std::uint32_t cmdLength, std::uint8_t *resp, std::uint32_t respLength) {
+    return call(CardRecordKind::Spi, spiCommand(cmd, cmdLength, nullptr, 0), 0, 0, cmd, cmdLength, resp, respLength);
+}
+
+CardErr UsbTransport::sendSpiWrite(const std::uint8_t *cmd, std::uint32_t cmdLength, const std::uint8_t *data,
+                                   std::uint32_t dataLength) {
+    CardRecord rec;
+    if (!request(CardRecordKind::Spi, spiCommand(cmd, cmdLength, data, dataLength), 0, 0, cmd, cmdLength, 0,
+                 data, dataLength)) {
+        return CardErr(-1);
+    }
+    return response(&rec, nullptr, 0);
+}
+
+CardErr UsbTransport::readData(std::uint32_t address, void *buf, std::uint32_t size) {
+    return call(CardRecordKind::ReadData, address, 0, 0, nullptr, 0, buf, size);
+}
+
+CardErr UsbTransport::init() {
+    return call(CardRecordKind::Init, 0, 0, 0, nullptr, 0, nullptr, 0);
+}
+
+CardErr UsbTransport::beginKey1(const CardSecureParams &params) {
+    std::uint8_t out[sizeof(UsbSecureParams) + 0x1048];
+    UsbSecureParams p = { params.key1_romcnt, params.key2_romcnt, params.key2_seed, params.key != BlowfishKey::NTR, 0 };
+    std::memcpy(out, &p, sizeof(p));
+    std::memcpy(out + sizeof(p), platform::getBlowfishKey(params.key), 0x1048);
+    return call(CardRecordKind::BeginKey1, 0, params.key1_romcnt, 0, out, sizeof(out), nullptr, 0);
+}
+
+CardErr UsbTransport::beginKey2() {
+    return call(CardRecordKind::BeginKey2, 0, 0, 0, nullptr, 0, nullptr, 0);
+}
+
+CardState UsbTransport::state() {
+    CardRecord rec;
+    if (!request(CardRecordKind::State, 0, 0, 0, nullptr, 0, 0) || response(&rec, nullptr, 0)) {
+        return CardState::Unknown;
+    }
+    return static_cast<CardState>(rec.cmd);
+}
+
+void UsbTransport::state(CardState state) {
+    call(CardRecordKind::SetState, static_cast<std::uint64_t>(state), 0, 0, nullptr, 0, nullptr, 0);
+}
+
+void UsbTransport::delay(std::uint32_t delay) {
+    call(CardRecordKind::Delay, delay, 0, 0, nullptr, 0, nullptr, 0);
+}
+
+bool UsbTransport::submit(const CardBatch &batch, CardErr *err, std::uint32_t *completed) {
+    std::uint32_t count = 0;
+    while (count < batch.size() && batch[count].kind != CardBatchEntry::Kind::Poll) {
+        ++count;
+    }
+    if (!count) {
+        return false;
+    }
+
+    bool sent = true;
+    for (std::uint32_t i = 0; sent && i < count; ++i) {
+        const CardBatchEntry &e = batch[i];
+        const std::uint8_t chained = i ? Chained : 0;
+        switch (e.kind) {
+            case CardBatchEntry::Kind::Command:
+                sent = request(CardRecordKind::Command, e.cmd, e.flags, chained, nullptr, 0, e.in_length);
+                break;
+            case CardBatchEntry::Kind::WriteCommand:
+                sent = request(CardRecordKind::WriteCommand, e.cmd, e.flags, chained, e.out, e.out_length, 0);
+                break;
+            case CardBatchEntry::Kind::Spi:
+                sent = request(CardRecordKind::Spi, spiCommand(e.out, e.out_length, e.data, e.data_length), 0, chained,
+                               e.out, e.out_length, e.in_length, e.data, e.data_length);
+                break;
+            case CardBatchEntry::Kind::Delay:
+                sent = request(CardRecordKind::Delay, e.cmd, 0, chained, nullptr, 0, 0);
+                break;
+            case CardBatchEntry::Kind::Poll:
+                break;
+        }
+    }
+
+    // every request sent gets a response, even the ones skipped after a failure
+    *err = sent ? CardErr() : CardErr(-1);
+    std::uint32_t done = 0;
+    for (std::uint32_t i = 0; sent && i < count; ++i) {
+        CardRecord rec;
+        CardErr r = response(&rec, batch[i].in, batch[i].in_length);
+        if (r && !*err) {
+            *err = r;
+        } else if (!*err) {
+            ++done;
+        }
+        if (!isOpen()) {
+            break;
+        }
+    }
+
+    *completed = done;
+    return true;
+}
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+
+#include "../card_transport.h"
+#include "../card_record.h"
+
+namespace flashcart_core {
+
+/// CardTransport for a PC-side USB card reader, for running the drivers on Linux.
+///
+/// The reader shows up as a serial device (CDC ACM) and speaks the trace format of
+/// card_record.h: each request is a CardRecord followed by its `out_length` bytes, and
+/// each response is a CardRecord (with `flags`, `err`, `duration` and, for State, `cmd`
+/// filled in) followed by its `in_length` bytes. Responses come back in request order.
+///
+/// BeginKey1 requests carry a UsbSecureParams and the 0x1048-byte Blowfish state. Delay
+/// requests are waited out by the reader, so they stay accurate whatever the USB latency.
+class UsbTransport : public CardTransport {
+    int m_fd;
+
+    bool writeAll(const void *data, std::uint32_t length);
+    bool readAll(void *data, std::uint32_t length);
+    bool request(CardRecordKind kind, std::uint64_t cmd, std::uint32_t romcnt, std::uint8_t flags,
+                 const void *out, std::uint32_t outLength, std::uint32_t inLength,
+                 const void *more = nullptr, std::uint32_t moreLength = 0);
+    CardErr response(CardRecord *rec, void *in, std::uint32_t inLength);
+    CardErr call(CardRecordKind kind, std::uint64_t cmd, std::uint32_t romcnt, std::uint8_t flags,
+                 const void *out, std::uint32_t outLength, void *in, std::uint32_t inLength);
+
+public:
+    enum : std::uint8_t {
+        /// Request flag: skip this request (failing it with -2) if the one before it failed.
+        Chained = 1 << 7
+    };
+
+    struct UsbSecureParams {
+        std::uint32_t key1_romcnt;
+        std::uint32_t key2_romcnt;
+        std::uint8_t key2_seed;
+        std::uint8_t as_is;
+        std::uint16_t reserved;
+    };
+    static_assert(sizeof(UsbSecureParams) == 12, "Wrong UsbSecureParams size");
+
+    UsbTransport() : m_fd(-1) {}
+    ~UsbTransport() { close(); }
+
+    UsbTransport(const UsbTransport &) = delete;
+    UsbTransport &operator=(const UsbTransport &) = delete;
+
+    /// Opens the reader's device node, e.g. /dev/ttyACM0.
+    bool open(const char *path);
+    void close();
+    bool isOpen() const { return m_fd >= 0; }
+
+    CardErr sendCommand(std::uint64_t cmd, void *buf, std::uint32_t size, std::uint32_t flags, bool flagsAsIs) override;
+    CardErr sendWriteCommand(std::uint64_t cmd, const void *buf, std::uint32_t size, std::uint32_t flags) override;
+    CardErr sendSpi(const std::uint8_t *cmd, std::uint32_t cmdLength, std::uint8_t *resp, std::uint32_t respLength) override;
+    CardErr sendSpiWrite(const std::uint8_t *cmd, std::uint32_t cmdLength, const std::uint8_t *data,
+                         std::uint32_t dataLength) override;
+    CardErr readData(std::uint32_t address, void *buf, std::uint32_t size) override;
+
+    CardErr init() override;
+    CardErr beginKey1(const CardSecureParams &params) override;
+    CardErr beginKey2() override;
+    CardState state() override;
+    void state(CardState state) override;
+
+    void delay(std::uint32_t delay) override;
+
+    /// Sends the requests of a batch (chained) before reading any responses, saving a USB
+    /// round trip per entry. The reader can't poll, so this stops at the first poll and
+    /// leaves the rest of the batch to Card.
+    bool submit(const CardBatch &batch, CardErr *err, std::uint32_t *completed) override;
+};
+}
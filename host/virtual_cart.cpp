@@ -0,0 +1,85 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "virtual_cart.h"
+#include "../platform.h"
+
+namespace flashcart_core {
+using platform::logMessage;
+
+bool MappedImage::open(const char *path, Mode mode) {
+    close();
+
+    const int fd = ::open(path, mode == Mode::ReadWrite ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        logMessage(LOG_ERR, "MappedImage: can't open %s", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0 || static_cast<std::uint64_t>(st.st_size) > 0xFFFFFFFFu) {
+        logMessage(LOG_ERR, "MappedImage: bad size for %s", path);
+        ::close(fd);
+        return false;
+    }
+
+    const int prot = mode == Mode::ReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *p = mmap(nullptr, st.st_size, prot, mode == Mode::CopyOnWrite ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    // the mapping keeps the file
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        logMessage(LOG_ERR, "MappedImage: can't map %s", path);
+        return false;
+    }
+
+    m_data = static_cast<std::uint8_t *>(p);
+    m_size = static_cast<std::uint32_t>(st.st_size);
+    return true;
+}
+
+void MappedImage::close() {
+    if (m_data) {
+        munmap(m_data, m_size);
+        m_data = nullptr;
+        m_size = 0;
+    }
+}
+
+bool VirtualCart::open(const char *model, const char *path, MappedImage::Mode mode) {
+    close();
+
+    const SimCartModel *m = findSimCartModel(model);
+    if (!m || !m->flashcart()) {
+        logMessage(LOG_ERR, "VirtualCart: unknown cart %s", model);
+        return false;
+    }
+    // the simulated chip writes to its storage, so read only images can't work
+    if (mode == MappedImage::Mode::ReadOnly || !m_image.open(path, mode)) {
+        return false;
+    }
+
+    m_cart.reset(m->make());
+    m_cart->flash()->map(m_image.data(), m_image.size());
+    m_transport.attach(m_cart.get());
+    if (!m->flashcart()->initialize(&m_transport)) {
+        logMessage(LOG_ERR, "VirtualCart: %s driver didn't initialize", m->driver);
+        close();
+        return false;
+    }
+
+    m_flashcart = m->flashcart();
+    return true;
+}
+
+void VirtualCart::close() {
+    if (m_flashcart) {
+        m_flashcart->shutdown();
+        m_flashcart = nullptr;
+    }
+    m_transport.attach(nullptr);
+    m_cart.reset();
+    m_image.close();
+}
+}
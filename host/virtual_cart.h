@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "sim_carts.h"
+
+namespace flashcart_core {
+
+/// A flash image file mapped into memory.
+class MappedImage {
+    std::uint8_t *m_data;
+    std::uint32_t m_size;
+
+public:
+    enum class Mode {
+        ReadOnly,
+        /// Writes go to the file.
+        ReadWrite,
+        /// Writes stay in memory; the file is left as is.
+        CopyOnWrite
+    };
+
+    MappedImage() : m_data(nullptr), m_size(0) {}
+    ~MappedImage() { close(); }
+    MappedImage(const MappedImage &) = delete;
+    MappedImage &operator=(const MappedImage &) = delete;
+
+    bool open(const char *path, Mode mode);
+    void close();
+    bool isOpen() const { return m_data != nullptr; }
+
+    std::uint8_t *data() { return m_data; }
+    const std::uint8_t *data() const { return m_data; }
+    std::uint32_t size() const { return m_size; }
+};
+
+/// A simulated cart whose flash is an image file, with its driver.
+///
+/// The driver is used as is (`flashcart()->readFlash()` etc.), so anything that works on
+/// a real cart works on an image: dumping, restoring, injecting. The chip takes the size
+/// of the image; anything a driver touches past the end of it reads as FF and can't be
+/// programmed.
+class VirtualCart {
+    MappedImage m_image;
+    std::unique_ptr<SimCart> m_cart;
+    SimTransport m_transport;
+    Flashcart *m_flashcart;
+
+public:
+    VirtualCart() : m_flashcart(nullptr) {}
+
+    /// Maps `path` as the flash of a `model` (see simCartModels()) and initializes its driver.
+    bool open(const char *model, const char *path, MappedImage::Mode mode);
+    void close();
+
+    Flashcart *flashcart() { return m_flashcart; }
+    MappedImage &image() { return m_image; }
+    SimTransport &transport() { return m_transport; }
+};
+}
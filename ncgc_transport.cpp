@@ -0,0 +1,73 @@
+#include "ncgc_transport.h"
+#include "device.h"
+
+namespace flashcart_core {
+
+namespace {
+CardErr toCardErr(const ncgc::Err &err) {
+    return err ? CardErr(err.errNo(), err.unsupported()) : CardErr();
+}
+}
+
+CardErr NcgcTransport::sendCommand(std::uint64_t cmd, void *buf, std::uint32_t size, std::uint32_t flags, bool flagsAsIs) {
+    return toCardErr(m_card->sendCommand(cmd, buf, size, flags, flagsAsIs));
+}
+
+CardErr NcgcTransport::sendWriteCommand(std::uint64_t cmd, const void *buf, std::uint32_t size, std::uint32_t flags) {
+    return toCardErr(m_card->sendWriteCommand(cmd, buf, size, flags));
+}
+
+CardErr NcgcTransport::sendSpi(const std::uint8_t *cmd, std::uint32_t cmdLength, std::uint8_t *resp, std::uint32_t respLength) {
+    return toCardErr(m_card->sendSpi(cmd, cmdLength, resp, respLength));
+}
+
+CardErr NcgcTransport::readData(std::uint32_t address, void *buf, std::uint32_t size) {
+    return toCardErr(m_card->readData(address, buf, size));
+}
+
+CardErr NcgcTransport::init() {
+    return toCardErr(m_card->init());
+}
+
+CardErr NcgcTransport::beginKey1(const CardSecureParams &params) {
+    ncgc::c::ncgc_ncard_t& state = m_card->rawState();
+    state.hdr.key1_romcnt = state.key1.romcnt = params.key1_romcnt;
+    state.hdr.key2_romcnt = state.key2.romcnt = params.key2_romcnt;
+    state.key2.seed_byte = params.key2_seed;
+    m_card->setBlowfishState(platform::getBlowfishKey(params.key), params.key != BlowfishKey::NTR);
+    return toCardErr(m_card->beginKey1());
+}
+
+CardErr NcgcTransport::beginKey2() {
+    return toCardErr(m_card->beginKey2());
+}
+
+CardState NcgcTransport::state() {
+    switch (m_card->state()) {
+        case ncgc::NTRState::Raw: return CardState::Raw;
+        case ncgc::NTRState::Key1: return CardState::Key1;
+        case ncgc::NTRState::Key2: return CardState::Key2;
+        default: return CardState::Unknown;
+    }
+}
+
+void NcgcTransport::state(CardState state) {
+    switch (state) {
+        case CardState::Raw: m_card->state(ncgc::NTRState::Raw); break;
+        case CardState::Key1: m_card->state(ncgc::NTRState::Key1); break;
+        case CardState::Key2: m_card->state(ncgc::NTRState::Key2); break;
+        default: break;
+    }
+}
+
+void NcgcTransport::delay(std::uint32_t delay) {
+    ncgc::delay(delay);
+}
+
+bool Flashcart::initialize(ncgc::NTRCard *card) {
+    // there's only ever the one card slot
+    static NcgcTransport transport;
+    transport.attach(card);
+    return initialize(&transport);
+}
+}
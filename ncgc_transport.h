@@ -0,0 +1,32 @@
+#pragma once
+
+#include <ncgcpp/ntrcard.h>
+
+#include "card_transport.h"
+
+namespace flashcart_core {
+
+/// CardTransport over libncgc's NTR card.
+class NcgcTransport : public CardTransport {
+    ncgc::NTRCard *m_card;
+
+public:
+    explicit NcgcTransport(ncgc::NTRCard *card = nullptr) : m_card(card) {}
+
+    void attach(ncgc::NTRCard *card) { m_card = card; }
+    ncgc::NTRCard *card() { return m_card; }
+
+    CardErr sendCommand(std::uint64_t cmd, void *buf, std::uint32_t size, std::uint32_t flags, bool flagsAsIs) override;
+    CardErr sendWriteCommand(std::uint64_t cmd, const void *buf, std::uint32_t size, std::uint32_t flags) override;
+    CardErr sendSpi(const std::uint8_t *cmd, std::uint32_t cmdLength, std::uint8_t *resp, std::uint32_t respLength) override;
+    CardErr readData(std::uint32_t address, void *buf, std::uint32_t size) override;
+
+    CardErr init() override;
+    CardErr beginKey1(const CardSecureParams &params) override;
+    CardErr beginKey2() override;
+    CardState state() override;
+    void state(CardState state) override;
+
+    void delay(std::uint32_t delay) override;
+};
+}
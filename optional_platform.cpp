@@ -10,5 +10,11 @@ namespace platform {
 __attribute__((weak)) void showProgress(std::uint32_t current, std::uint32_t total, const char* status_string) { ; }
 
 __attribute__((weak)) int logMessage(log_priority priority, const char *fmt, ...) { return 0; }
+
+__attribute__((weak)) std::uint64_t now() { return 0; }
+
+__attribute__((weak)) bool loadData(const char *name, void *data, std::uint32_t size) { return false; }
+
+__attribute__((weak)) bool saveData(const char *name, const void *data, std::uint32_t size) { return false; }
 }
 }
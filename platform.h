@@ -21,5 +21,11 @@ namespace platform {
 void showProgress(std::uint32_t current, std::uint32_t total, const char* status_string);
 int logMessage(log_priority priority, const char *fmt, ...);
 auto getBlowfishKey(BlowfishKey key) -> const std::uint8_t(&)[0x1048];
+// Monotonic time in microseconds; only used for card statistics. Optional.
+std::uint64_t now();
+// Small persistent settings, e.g. tuned card timings; `name` is short and file name safe.
+// Optional; without these, nothing is remembered between sessions.
+bool loadData(const char *name, void *data, std::uint32_t size);
+bool saveData(const char *name, const void *data, std::uint32_t size);
 }
 }
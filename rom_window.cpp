@@ -0,0 +1,60 @@
+#include <cstring>
+
+#include "rom_window.h"
+#include "card.h"
+
+namespace flashcart_core {
+using platform::logMessage;
+
+CardErr RomWindow::fetch(Card &card, std::uint32_t rom, std::uint8_t *dest) {
+    if (!m_flags) {
+        return card.readData(rom, dest, blockSize);
+    }
+
+    const std::uint64_t cmd = 0xB7 | static_cast<std::uint64_t>(rom >> 24 & 0xFF) << 8
+        | static_cast<std::uint64_t>(rom >> 16 & 0xFF) << 16 | static_cast<std::uint64_t>(rom >> 8 & 0xFF) << 24
+        | static_cast<std::uint64_t>(rom & 0xFF) << 32;
+    return card.sendCommand(cmd, dest, blockSize, m_flags);
+}
+
+bool RomWindow::read(Card &card, std::uint32_t rom, std::uint8_t *dest) {
+    if (m_state != State::Usable) {
+        return false;
+    }
+
+    CardErr err = fetch(card, rom, dest);
+    if (err) {
+        logMessage(LOG_NOTICE, "%s: ROM window read at 0x%08lX failed: %d, not using it",
+            m_name, static_cast<unsigned long>(rom), err.errNo());
+        m_state = State::Unusable;
+        return false;
+    }
+    return true;
+}
+
+void RomWindow::check(Card &card, std::uint32_t rom, const std::uint8_t *block) {
+    if (m_state != State::Unchecked) {
+        return;
+    }
+
+    std::uint8_t window[blockSize];
+    CardErr err = fetch(card, rom, window);
+    if (err) {
+        logMessage(LOG_INFO, "%s: no ROM window (%s)", m_name,
+            err.unsupported() ? "the transport can't read ROM" : "read failed");
+        m_state = State::Unusable;
+    } else if (std::memcmp(window, block, blockSize)) {
+        logMessage(LOG_NOTICE, "%s: ROM at 0x%08lX doesn't match the flash, not using the ROM window",
+            m_name, static_cast<unsigned long>(rom));
+        m_state = State::Unusable;
+    } else {
+        for (std::uint32_t i = 1; i < blockSize; ++i) {
+            if (block[i] != block[0]) {
+                logMessage(LOG_INFO, "%s: reading flash through the ROM window", m_name);
+                m_state = State::Usable;
+                break;
+            }
+        }
+    }
+}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+
+#include "card_transport.h"
+
+namespace flashcart_core {
+class Card;
+
+/// Reads a cart's flash through its ROM window: on carts that map ROM onto NOR, ROM reads
+/// (B7, through Card::readData() in KEY2) move 0x200 bytes a command, where the cart's own
+/// flash read command may only give a few.
+///
+/// The window isn't trusted until a block read both ways has matched, so drivers read
+/// with their own command and pass the result to check() until read() starts working.
+/// Blocks that are all one byte don't count, as they'd match a wrong mapping too easily.
+class RomWindow {
+    enum class State : std::uint8_t {
+        Unchecked,
+        Usable,
+        Unusable
+    };
+
+    const char *const m_name;
+    const std::uint32_t m_flags;
+    State m_state;
+
+    CardErr fetch(Card &card, std::uint32_t rom, std::uint8_t *dest);
+
+public:
+    static constexpr std::uint32_t blockSize = 0x200;
+
+    /// `name` prefixes log messages. Carts that take their commands unencrypted once unlocked
+    /// get B7 sent as a plain command with ROMCNT `flags` instead of a KEY2 read.
+    explicit RomWindow(const char *name, std::uint32_t flags = 0)
+        : m_name(name), m_flags(flags), m_state(State::Unchecked) {}
+
+    /// Forgets what's known about the window, for a new cart.
+    void reset() { m_state = State::Unchecked; }
+    /// Stops using the window until reset(), e.g. once the cart's ROM => NOR map has been
+    /// written: the cart may or may not pick the new one up before it's reset.
+    void disable() { m_state = State::Unusable; }
+    bool unusable() const { return m_state == State::Unusable; }
+
+    /// Reads the block at ROM address `rom` into `dest`, if the window is known to work.
+    /// Returns false if the caller has to read it with its own command.
+    bool read(Card &card, std::uint32_t rom, std::uint8_t *dest);
+    /// Compares `block`, read with the cart's own command, with what ROM address `rom` shows,
+    /// while the window isn't known to work or not.
+    void check(Card &card, std::uint32_t rom, const std::uint8_t *block);
+};
+}